@@ -0,0 +1,84 @@
+/*
+ * Compares the cost of submitting many jobs as one print command per file,
+ * read the way a command file is, against a single print_batch command with a
+ * manifest.  Printers stay disabled, so only submission is measured.
+ *
+ * Usage: bin/bench_batch_bench [jobs]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "job_table.h"
+
+extern int sf_suppress_chatter;
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Runs the commands in a child, so each way of submitting starts from the
+ * same empty job table, and prints how long they took.
+ */
+static void run(char *label, char *commands, int jobs) {
+	FILE *in, *out;
+	double start;
+	int pid;
+	if ((pid = fork()) == 0) {
+		in = fopen(commands, "r");
+		out = fopen("/dev/null", "w");
+		start = now();
+		read_commands_from_file(in, out);
+		start = now() - start;
+		printf("%-12s %d of %d jobs in %.3f s (%.2f us per job)\n", label, job_table_size(), jobs, start, start / jobs * 1e6);
+		fclose(in);
+		fclose(out);
+		fflush(stdout);
+		_exit(job_table_size() == jobs ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char *argv[]) {
+	int jobs = argc > 1 ? atoi(argv[1]) : 10000;
+	char lines[] = "/tmp/imprimer_batch_lines_XXXXXX";
+	char manifest[] = "/tmp/imprimer_batch_manifest_XXXXXX";
+	char batch[] = "/tmp/imprimer_batch_command_XXXXXX";
+	FILE *lines_file = fdopen(mkstemp(lines), "w");
+	FILE *manifest_file = fdopen(mkstemp(manifest), "w");
+	FILE *batch_file = fdopen(mkstemp(batch), "w");
+	char *setup = "type aaa\nprinter p1 aaa\nprinter p2 aaa\n";
+	fputs(setup, lines_file);
+	fputs(setup, batch_file);
+	for (int i = 0; i < jobs; i++) {
+		fprintf(lines_file, "print /tmp/bench%d.aaa p1 p2\n", i);
+		fprintf(manifest_file, "/tmp/bench%d.aaa\n", i);
+	}
+	fprintf(batch_file, "print_batch @%s p1 p2\n", manifest);
+	fclose(lines_file);
+	fclose(manifest_file);
+	fclose(batch_file);
+	sf_suppress_chatter = 1;
+	sf_init();
+	conversions_init();
+	fflush(stdout);
+	run("print", lines, jobs);
+	run("print_batch", batch, jobs);
+	conversions_fini();
+	sf_fini();
+	unlink(lines);
+	unlink(manifest);
+	unlink(batch);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,52 @@
+#!/bin/bash
+#
+# Measures how long imprimer takes to start the next job on a printer once the
+# previous job on that printer has finished (JOB_FINISHED -> JOB_STARTED).
+#
+# Usage: bench/dispatch_latency.sh [jobs] [printers]
+
+IMPRIMER=${IMPRIMER:-bin/imprimer}
+JOBS=${1:-20}
+PRINTERS=${2:-2}
+WORKD=$(mktemp -d)
+
+trap 'bash util/stop_printers.sh > /dev/null 2>&1; rm -rf $WORKD' EXIT
+
+mkdir -p spool
+echo "dispatch latency bench" > $WORKD/input.aaa
+{
+	echo "type aaa"
+	for p in $(seq 1 $PRINTERS); do
+		echo "printer bench$p aaa"
+		echo "enable bench$p"
+	done
+	for j in $(seq 1 $JOBS); do
+		echo "print $WORKD/input.aaa"
+	done
+} > $WORKD/script.imp
+
+# Keep stdin open so the event loop keeps dispatching after the script is read.
+(cat $WORKD/script.imp; while [ $(cat $WORKD/events | grep -cE 'JOB_(FINISHED|ABORTED)') -lt $JOBS ]; do sleep 0.2; done) \
+	| $IMPRIMER -o /dev/null 2> $WORKD/events > /dev/null
+
+sed 's/\x1b\[[0-9;]*m//g' $WORKD/events | awk -v jobs=$JOBS -v printers=$PRINTERS '
+/JOB_STARTED/ {
+	line = $0; gsub(/[\[\]:,]/, " ", line); split(line, f, " ")
+	id = f[3]; printer = f[4]
+	job_printer[id] = printer
+	if (printer in finished_at) {
+		latency = ($1 + 0) - finished_at[printer]
+		sum += latency; count++
+		if (latency > max) max = latency
+		delete finished_at[printer]
+	}
+}
+/JOB_FINISHED|JOB_ABORTED/ {
+	line = $0; gsub(/[\[\]:,]/, " ", line); split(line, f, " ")
+	finished_at[job_printer[f[3]]] = $1 + 0
+}
+END {
+	printf "jobs=%d printers=%d samples=%d\n", jobs, printers, count
+	if (count > 0)
+		printf "finish->start latency: mean %.3f ms, max %.3f ms\n", sum / count * 1000, max * 1000
+}'
@@ -0,0 +1,113 @@
+/*
+ * Measures what the journal adds to job submission, and how long replaying a
+ * journal takes when it is reopened.  Printers stay disabled, so jobs are only
+ * created and, for every other job, cancelled.
+ *
+ * Usage: bin/bench_journal_bench [jobs]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "job_table.h"
+#include "journal.h"
+
+extern int sf_suppress_chatter;
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Runs the commands in a child, so every run starts from an empty job table,
+ * and prints how long they took.
+ */
+static void run(char *label, char *commands, int jobs) {
+	FILE *in, *out;
+	double start;
+	int pid;
+	if ((pid = fork()) == 0) {
+		in = fopen(commands, "r");
+		out = fopen("/dev/null", "w");
+		start = now();
+		read_commands_from_file(in, out);
+		journal_sync();
+		start = now() - start;
+		printf("%-16s %d jobs in %.3f s (%.2f us per job)\n", label, jobs, start, start / jobs * 1e6);
+		journal_fini();
+		fclose(in);
+		fclose(out);
+		fflush(stdout);
+		_exit(EXIT_SUCCESS);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+/*
+ * Reopens the journal left by the last run and reports the replay time.
+ */
+static void replay(char *path) {
+	FILE *out;
+	double start;
+	int pid;
+	if ((pid = fork()) == 0) {
+		out = fopen("/dev/null", "w");
+		start = now();
+		journal_open(path, out);
+		start = now() - start;
+		printf("%-16s %d jobs restored in %.3f s\n", "replay", job_table_size(), start);
+		journal_fini();
+		fclose(out);
+		fflush(stdout);
+		_exit(EXIT_SUCCESS);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+static void write_commands(FILE *file, int jobs) {
+	fputs("type aaa\nprinter p1 aaa\nprinter p2 aaa\n", file);
+	for (int i = 0; i < jobs; i++) {
+		fprintf(file, "print /tmp/bench%d.aaa p1 p2\n", i);
+		if (i % 2) {
+			fprintf(file, "cancel %d\n", i);
+		}
+	}
+	fclose(file);
+}
+
+int main(int argc, char *argv[]) {
+	int jobs = argc > 1 ? atoi(argv[1]) : 10000;
+	char plain[] = "/tmp/imprimer_journal_plain_XXXXXX";
+	char journaled[] = "/tmp/imprimer_journal_commands_XXXXXX";
+	char journal[] = "/tmp/imprimer_journal_XXXXXX";
+	FILE *plain_file = fdopen(mkstemp(plain), "w");
+	FILE *journaled_file = fdopen(mkstemp(journaled), "w");
+	close(mkstemp(journal));
+	unlink(journal);
+	fprintf(journaled_file, "journal %s\n", journal);
+	write_commands(plain_file, jobs);
+	write_commands(journaled_file, jobs);
+	sf_suppress_chatter = 1;
+	sf_init();
+	conversions_init();
+	fflush(stdout);
+	run("without journal", plain, jobs);
+	run("with journal", journaled, jobs);
+	replay(journal);
+	conversions_fini();
+	sf_fini();
+	unlink(plain);
+	unlink(journaled);
+	unlink(journal);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,291 @@
+/*
+ * Synthetic load for the whole spooler.  Defines N types, a printer of each
+ * type and a ring of conversions between them, submits M jobs with input
+ * files of random sizes, and reports throughput, submit-to-finish latency and
+ * CPU per job.  bin/imprimer is run as a child in a scratch directory, and a
+ * stand-in listens on every printer's socket in spool/ and discards what it
+ * is sent, so util/printer is never started and jobs do not sleep.  CPU time
+ * covers imprimer and all its descendants, but not the stand-in.
+ *
+ * Usage: bin/bench_load_gen [-n types] [-m jobs] [-s min[:max]] [-w workers]
+ *                           [-c command] [-p]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define MAX_FILES 64
+
+typedef struct options {
+	int types;
+	int jobs;
+	long min_size;
+	long max_size;
+	int workers;
+	int pool;
+	char *command;
+} OPTIONS;
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(double *) a, y = *(double *) b;
+	return (x > y) - (x < y);
+}
+
+static double cpu_time(struct rusage *usage) {
+	return usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6 + usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+}
+
+static int listen_on(char *path) {
+	struct sockaddr_un address;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+	if (fd == -1 || bind(fd, (struct sockaddr *) &address, sizeof(address)) == -1 || listen(fd, 16) == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+/*
+ * The printer stand-in: accepts on every listener and reads each connection
+ * until the job leader closes it.  Runs until it is killed.
+ */
+static void run_printers(int *listeners, int count) {
+	struct epoll_event event, events[32];
+	char buffer[1 << 16];
+	int epoll_fd = epoll_create1(0), ready, fd;
+	for (int i = 0; i < count; i++) {
+		event.events = EPOLLIN;
+		event.data.u64 = ((uint64_t) 1 << 32) | listeners[i];
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listeners[i], &event);
+	}
+	while ((ready = epoll_wait(epoll_fd, events, 32, -1)) >= 0) {
+		for (int i = 0; i < ready; i++) {
+			fd = (int) (events[i].data.u64 & 0xffffffff);
+			if (events[i].data.u64 >> 32) {
+				if ((event.data.u64 = accept(fd, NULL, NULL)) != (uint64_t) -1) {
+					event.events = EPOLLIN;
+					epoll_ctl(epoll_fd, EPOLL_CTL_ADD, (int) event.data.u64, &event);
+				}
+			} else if (read(fd, buffer, sizeof(buffer)) <= 0) {
+				close(fd);
+			}
+		}
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+static void write_input(char *name, long size) {
+	char block[4096];
+	FILE *file = fopen(name, "w");
+	memset(block, 'x', sizeof(block));
+	for (long written = 0; written < size; written += sizeof(block)) {
+		fwrite(block, 1, size - written < sizeof(block) ? size - written : sizeof(block), file);
+	}
+	fclose(file);
+}
+
+/*
+ * The script defines everything and submits every job up front; jobs wait in
+ * the queue for the printers.
+ */
+static void write_script(FILE *script, OPTIONS *options) {
+	char name[32];
+	int files = options->jobs < MAX_FILES ? options->jobs : MAX_FILES;
+	long size;
+	for (int i = 0; i < options->types; i++) {
+		fprintf(script, "type t%d\n", i);
+	}
+	for (int i = 0; i < options->types && options->types > 1; i++) {
+		fprintf(script, "conversion t%d t%d %s\n", i, (i + 1) % options->types, options->command);
+	}
+	for (int i = 0; i < options->types; i++) {
+		fprintf(script, "printer p%d t%d\nenable p%d\n", i, i, i);
+	}
+	if (options->workers > 0) {
+		fprintf(script, "workers %d\n", options->workers);
+	}
+	if (options->pool) {
+		fprintf(script, "pool on\n");
+	}
+	for (int i = 0; i < files; i++) {
+		size = options->min_size + (options->max_size > options->min_size ? random() % (options->max_size - options->min_size + 1) : 0);
+		snprintf(name, sizeof(name), "in%d.t%d", i, i % options->types);
+		write_input(name, size);
+	}
+	for (int i = 0; i < options->jobs; i++) {
+		fprintf(script, "print in%d.t%d\n", i % files, (i % files) % options->types);
+	}
+}
+
+/*
+ * Feeds the script to imprimer, then keeps its input open until the control
+ * pipe is closed, so that it keeps dispatching, and finally quits it.
+ */
+static void feed(char *script_name, int input, int control) {
+	char buffer[4096];
+	FILE *script = fopen(script_name, "r");
+	size_t bytes;
+	while ((bytes = fread(buffer, 1, sizeof(buffer), script)) > 0) {
+		if (write(input, buffer, bytes) != bytes) {
+			_exit(EXIT_FAILURE);
+		}
+	}
+	read(control, buffer, 1);
+	write(input, "quit\n", 5);
+	_exit(EXIT_SUCCESS);
+}
+
+static double event_time(char *line) {
+	while (*line != '\0' && (*line < '0' || *line > '9')) {
+		// Skip the color escape.
+		line += *line == '\033' ? strcspn(line, "m") + 1 : 1;
+	}
+	return atof(line);
+}
+
+/*
+ * Reads imprimer's events until every job has finished or been aborted, and
+ * fills latencies with the submit-to-finish time of each finished job.
+ * Returns the number of finished jobs.
+ */
+static int collect(FILE *events, OPTIONS *options, double *latencies, double *first, double *last) {
+	double *created = calloc(options->jobs, sizeof(double));
+	char line[512], *event;
+	int id, done = 0, finished = 0;
+	while (done < options->jobs && fgets(line, sizeof(line), events) != NULL) {
+		if ((event = strstr(line, "JOB_CREATED [")) != NULL && sscanf(event, "JOB_CREATED [%d", &id) == 1 && id < options->jobs) {
+			created[id] = event_time(line);
+			if (id == 0) *first = created[id];
+		} else if ((event = strstr(line, "JOB_FINISHED [")) != NULL && sscanf(event, "JOB_FINISHED [%d", &id) == 1 && id < options->jobs) {
+			*last = event_time(line);
+			latencies[finished++] = *last - created[id];
+			done++;
+		} else if (strstr(line, "JOB_ABORTED [") != NULL) {
+			done++;
+		}
+	}
+	free(created);
+	return finished;
+}
+
+static void parse_options(int argc, char *argv[], OPTIONS *options) {
+	int option;
+	char *end;
+	while ((option = getopt(argc, argv, "n:m:s:w:c:p")) != -1) {
+		switch (option) {
+		case 'n':
+			options->types = atoi(optarg);
+			break;
+		case 'm':
+			options->jobs = atoi(optarg);
+			break;
+		case 's':
+			options->min_size = options->max_size = strtol(optarg, &end, 10);
+			if (*end == ':') options->max_size = strtol(end + 1, NULL, 10);
+			break;
+		case 'w':
+			options->workers = atoi(optarg);
+			break;
+		case 'c':
+			options->command = optarg;
+			break;
+		case 'p':
+			options->pool = 1;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n types] [-m jobs] [-s min[:max]] [-w workers] [-c command] [-p]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (options->types < 1 || options->jobs < 1 || options->min_size < 0 || options->max_size < options->min_size) {
+		fprintf(stderr, "Invalid options\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	OPTIONS options = {4, 200, 1024, 65536, 0, 0, "cat"};
+	char imprimer[PATH_MAX], workdir[] = "/tmp/imprimer_load_XXXXXX", name[64];
+	char *imprimer_path = getenv("IMPRIMER") != NULL ? getenv("IMPRIMER") : "bin/imprimer";
+	int listeners[256], input[2], output[2], control[2];
+	int printers_pid, finished;
+	double *latencies, first = 0, last = 0, cpu;
+	struct rusage usage, printers_usage;
+	FILE *script, *events;
+	parse_options(argc, argv, &options);
+	prctl(PR_SET_CHILD_SUBREAPER, 1);
+	if (options.types > 256 || realpath(imprimer_path, imprimer) == NULL || mkdtemp(workdir) == NULL || chdir(workdir) == -1) {
+		fprintf(stderr, "Could not set up %s for %s\n", workdir, imprimer_path);
+		return EXIT_FAILURE;
+	}
+	mkdir("spool", 0777);
+	for (int i = 0; i < options.types; i++) {
+		snprintf(name, sizeof(name), "spool/p%d.sock", i);
+		listeners[i] = listen_on(name);
+	}
+	if ((printers_pid = fork()) == 0) {
+		run_printers(listeners, options.types);
+	}
+	for (int i = 0; i < options.types; i++) {
+		close(listeners[i]);
+	}
+	script = fopen("script.imp", "w");
+	write_script(script, &options);
+	fclose(script);
+
+	pipe(input);
+	pipe(output);
+	pipe(control);
+	if (fork() == 0) {
+		dup2(input[0], 0);
+		dup2(output[1], 2);
+		close(input[0]), close(input[1]), close(output[0]), close(output[1]), close(control[0]), close(control[1]);
+		execl(imprimer, imprimer, "-o", "/dev/null", NULL);
+		_exit(EXIT_FAILURE);
+	}
+	if (fork() == 0) {
+		close(input[0]), close(output[0]), close(output[1]), close(control[1]);
+		feed("script.imp", input[1], control[0]);
+	}
+	close(input[0]), close(input[1]), close(output[1]), close(control[0]);
+	events = fdopen(output[0], "r");
+	latencies = calloc(options.jobs, sizeof(double));
+	finished = collect(events, &options, latencies, &first, &last);
+	close(control[1]);
+	while (fgetc(events) != EOF);
+	fclose(events);
+	kill(printers_pid, SIGKILL);
+	wait4(printers_pid, NULL, 0, &printers_usage);
+	// Pool workers that outlive imprimer are reparented here; reap them too.
+	while (wait(NULL) > 0);
+	getrusage(RUSAGE_CHILDREN, &usage);
+
+	cpu = cpu_time(&usage) - cpu_time(&printers_usage);
+	qsort(latencies, finished, sizeof(double), compare_doubles);
+	printf("LOAD: types=%d, jobs=%d, size=%ld:%ld, workers=%d, pool=%s, finished=%d, elapsed=%.3f, jobs_per_sec=%.1f, "
+		"p50=%.6f, p99=%.6f, cpu_per_job=%.6f\n", options.types, options.jobs, options.min_size, options.max_size,
+		options.workers, options.pool ? "on" : "off", finished, last - first,
+		last > first ? finished / (last - first) : 0.0, finished ? latencies[finished / 2] : 0.0,
+		finished ? latencies[(int) (finished * 0.99)] : 0.0, finished ? cpu / finished : 0.0);
+	free(latencies);
+
+	snprintf(name, sizeof(name), "rm -rf %s", workdir);
+	if (chdir("/") == 0) system(name);
+	return finished == options.jobs ? EXIT_SUCCESS : EXIT_FAILURE;
+}
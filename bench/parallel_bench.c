@@ -0,0 +1,124 @@
+/*
+ * Measures how a CPU-bound conversion speeds up when its stage is replicated
+ * with "parallel".  The conversion is this program run with --convert, which
+ * hashes every line a number of times.  Each replicated run is checked
+ * against the output of a single instance.
+ *
+ * Usage: bin/bench_parallel_bench [megabytes] [rounds] [max instances]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "replicate.h"
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * The conversion: every line is prefixed with its FNV-1a hash, computed
+ * rounds times over.
+ */
+static int convert(int rounds) {
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t length;
+	uint32_t hash;
+	while ((length = getline(&line, &size, stdin)) != -1) {
+		hash = 2166136261u;
+		for (int round = 0; round < rounds; round++) {
+			for (ssize_t i = 0; i < length; i++) {
+				hash = (hash ^ (unsigned char) line[i]) * 16777619u;
+			}
+		}
+		printf("%08x %s", hash, line);
+	}
+	free(line);
+	return EXIT_SUCCESS;
+}
+
+static void make_input(char *filename, int megabytes) {
+	FILE *file = fdopen(mkstemp(filename), "w");
+	long bytes = 0;
+	for (int i = 0; bytes < (long) megabytes << 20; i++) {
+		bytes += fprintf(file, "line %d of the parallel conversion bench%s\n", i, i % 7 == 0 ? " with some more words" : "");
+	}
+	fclose(file);
+}
+
+static double run(REPLICATE_RULE *rule, char **cmd_and_args, char *input, char *output) {
+	int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644), pid;
+	double start = now();
+	if (rule == NULL) {
+		pid = spawn_stage(cmd_and_args, input, -1, fd, -1, fd);
+	} else {
+		pid = start_replicated_stage(rule, cmd_and_args, input, -1, fd, -1, fd);
+	}
+	close(fd);
+	waitpid(pid, NULL, 0);
+	return now() - start;
+}
+
+static int same_contents(char *first, char *second) {
+	FILE *a = fopen(first, "r"), *b = fopen(second, "r");
+	int c, same = 1;
+	while (same && (c = getc(a)) != EOF) {
+		same = c == getc(b);
+	}
+	same = same && getc(b) == EOF;
+	fclose(a);
+	fclose(b);
+	return same;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 2 && strcmp(argv[1], "--convert") == 0) {
+		return convert(atoi(argv[2]));
+	}
+	int megabytes = argc > 1 ? atoi(argv[1]) : 32;
+	char *rounds = argc > 2 ? argv[2] : "64";
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_instances = argc > 3 ? atoi(argv[3]) : (cpus < REPLICATE_MAX_INSTANCES ? cpus : REPLICATE_MAX_INSTANCES);
+	char self[4096], input[] = "/tmp/imprimer_parallel_XXXXXX";
+	char expected[] = "/tmp/imprimer_parallel_single", actual[] = "/tmp/imprimer_parallel_replicated";
+	char *cmd_and_args[] = {self, "--convert", rounds, NULL};
+	REPLICATE_RULE rule = {NULL, NULL, 0, 0};
+	ssize_t length;
+	double single, replicated;
+	if ((length = readlink("/proc/self/exe", self, sizeof(self) - 1)) == -1) {
+		return EXIT_FAILURE;
+	}
+	self[length] = '\0';
+	make_input(input, megabytes);
+	printf("%d MB, %s rounds, %ld CPUs\n", megabytes, rounds, cpus);
+	single = run(NULL, cmd_and_args, input, expected);
+	printf("1 instance: %.3f s\n", single);
+	if (max_instances < 2) {
+		max_instances = 2;
+	}
+	// Powers of two, then max_instances itself.
+	for (int instances = 2; instances <= max_instances;
+			instances = instances < max_instances && instances * 2 > max_instances ? max_instances : instances * 2) {
+		rule.instances = instances;
+		replicated = run(&rule, cmd_and_args, input, actual);
+		printf("%d instances: %.3f s, speedup %.2fx%s\n", instances, replicated, single / replicated,
+			same_contents(expected, actual) ? "" : " (OUTPUT DIFFERS)");
+	}
+	unlink(input);
+	unlink(expected);
+	unlink(actual);
+	return EXIT_SUCCESS;
+}
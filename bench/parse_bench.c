@@ -0,0 +1,86 @@
+/*
+ * Times reading a long command script the way "-i" does.  After a few
+ * definitions the script cycles through print, cancel and a handful of
+ * cheap commands, so parsing and dispatch dominate.  Printers stay disabled.
+ *
+ * Usage: bin/bench_parse_bench [lines]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "job_table.h"
+
+extern int sf_suppress_chatter;
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int write_script(char *name, int lines) {
+	FILE *script = fdopen(mkstemp(name), "w");
+	int written = 0, jobs = 0;
+	fprintf(script, "type aaa\ntype bbb\nconversion aaa bbb cat -u\nprinter p1 bbb\nprinter p2 aaa\n");
+	written = 5;
+	while (written < lines) {
+		switch (written % 6) {
+		case 0:
+		case 1:
+			fprintf(script, "print -p %d /tmp/bench%d.aaa p1 p2\n", written % 10, written);
+			jobs++;
+			break;
+		case 2:
+			fprintf(script, "cancel %d\n", jobs - 1);
+			break;
+		case 3:
+			fprintf(script, "pipeline count=off\n");
+			break;
+		case 4:
+			fprintf(script, "retention 3600\n");
+			break;
+		default:
+			fprintf(script, "nonsense command %d\n", written);
+			break;
+		}
+		written++;
+	}
+	fclose(script);
+	return jobs;
+}
+
+int main(int argc, char *argv[]) {
+	int lines = argc > 1 ? atoi(argv[1]) : 1000000;
+	char name[] = "/tmp/imprimer_parse_XXXXXX";
+	FILE *in, *out;
+	double start;
+	int jobs = write_script(name, lines), pid, status;
+	sf_suppress_chatter = 1;
+	sf_init();
+	conversions_init();
+	fflush(stdout);
+	if ((pid = fork()) == 0) {
+		in = fopen(name, "r");
+		out = fopen("/dev/null", "w");
+		start = now();
+		read_commands_from_file(in, out);
+		start = now() - start;
+		printf("%d lines, %d jobs in %.3f s (%.0f lines/s, %.2f us per line)\n", lines, job_table_size(), start, lines / start, start / lines * 1e6);
+		fflush(stdout);
+		_exit(job_table_size() == jobs ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	waitpid(pid, &status, 0);
+	conversions_fini();
+	sf_fini();
+	unlink(name);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
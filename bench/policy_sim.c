@@ -0,0 +1,182 @@
+/*
+ * Replays a job trace against simulated printers of different speeds and
+ * reports the makespan, mean wait and per-printer utilization under each
+ * printer selection policy.  Printers are chosen by the real scheduler code;
+ * only the passage of time is simulated.
+ *
+ * A trace has one job per line: "<arrival seconds> <type> <bytes>", with types
+ * a and b.  Without one, a random trace is generated.
+ *
+ * Usage: bin/bench_policy_sim [trace]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "conversion_cache.h"
+#include "job_table.h"
+#include "selection.h"
+
+#define NUM_PRINTERS 4
+#define CONVERSION_COST 0.05
+
+extern int sf_suppress_chatter;
+
+typedef struct trace_entry {
+	double arrival;
+	char type[8];
+	uint64_t bytes;
+} TRACE_ENTRY;
+
+typedef struct simulated_job {
+	JOB *job;
+	TRACE_ENTRY *entry;
+} SIMULATED_JOB;
+
+static char *printer_names[NUM_PRINTERS] = {"p0", "p1", "p2", "p3"};
+static double printer_speeds[NUM_PRINTERS] = {1e6, 2e6, 1e6, 4e6};
+
+static void define(char *command) {
+	char line[100];
+	strcpy(line, command);
+	parse_command(line, stdin, stdout);
+}
+
+static int read_trace(char *filename, TRACE_ENTRY **trace) {
+	FILE *in = fopen(filename, "r");
+	int count = 0, capacity = 0;
+	TRACE_ENTRY entry;
+	if (in == NULL) {
+		perror(filename);
+		exit(EXIT_FAILURE);
+	}
+	while (fscanf(in, "%lf %7s %lu", &entry.arrival, entry.type, &entry.bytes) == 3) {
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			*trace = realloc(*trace, capacity * sizeof(TRACE_ENTRY));
+		}
+		(*trace)[count++] = entry;
+	}
+	fclose(in);
+	return count;
+}
+
+static int generate_trace(TRACE_ENTRY **trace) {
+	int count = 400;
+	double arrival = 0;
+	srand(1);
+	*trace = malloc(count * sizeof(TRACE_ENTRY));
+	for (int i = 0; i < count; i++) {
+		arrival += (rand() % 600) / 1000.0;
+		(*trace)[i].arrival = arrival;
+		strcpy((*trace)[i].type, rand() % 4 == 0 ? "b" : "a");
+		(*trace)[i].bytes = 10000 + rand() % 2000000;
+	}
+	return count;
+}
+
+static void simulate(TRACE_ENTRY *trace, int count) {
+	PRINTER *printers[NUM_PRINTERS], *printer;
+	SIMULATED_JOB queue[count], running[NUM_PRINTERS] = {{NULL, NULL}}, sim;
+	JOB *job;
+	double busy_until[NUM_PRINTERS], busy[NUM_PRINTERS] = {0}, duration;
+	double now = 0, next, wait = 0;
+	int queued = 0, arrived = 0, active = 0, kept;
+	BITSET eligible;
+	for (int i = 0; i < NUM_PRINTERS; i++) {
+		printers[i] = find_printer(printer_names[i]);
+		memset(&printers[i]->load, 0, sizeof(PRINTER_LOAD));
+	}
+	while (arrived < count || active > 0) {
+		next = arrived < count ? trace[arrived].arrival : -1;
+		for (int i = 0; i < NUM_PRINTERS; i++) {
+			if (running[i].job != NULL && (next < 0 || busy_until[i] < next)) next = busy_until[i];
+		}
+		now = next;
+		for (int i = 0; i < NUM_PRINTERS; i++) {
+			if ((job = running[i].job) != NULL && busy_until[i] <= now) {
+				duration = now - job->started_at;
+				busy[i] += duration;
+				selection_job_finished(printers[i], running[i].entry->bytes, duration);
+				set_printer_status(printers[i], PRINTER_IDLE);
+				job->status = JOB_FINISHED;
+				running[i].job = NULL;
+				active--;
+			}
+		}
+		while (arrived < count && trace[arrived].arrival <= now) {
+			memset(&eligible, 0, sizeof(eligible));
+			get_all_printers(&eligible);
+			start_print_job("trace", find_type(trace[arrived].type), &eligible);
+			queue[queued].job = job_table_get(job_table_size() - 1);
+			queue[queued++].entry = &trace[arrived++];
+		}
+		kept = 0;
+		for (int j = 0; j < queued; j++) {
+			sim = queue[j];
+			job = sim.job;
+			if ((printer = find_printer_for_job(job)) == NULL) {
+				queue[kept++] = sim;
+				continue;
+			}
+			remove_waiting_job(job);
+			job->selected_printer = printer;
+			job->status = JOB_RUNNING;
+			job->started_at = now;
+			wait += now - sim.entry->arrival;
+			set_printer_status(printer, PRINTER_BUSY);
+			selection_job_started(printer);
+			duration = count_links_in_conversion_path(job->conversion_path) * CONVERSION_COST
+				+ sim.entry->bytes / printer_speeds[printer->id];
+			busy_until[printer->id] = now + duration;
+			running[printer->id] = sim;
+			active++;
+		}
+		queued = kept;
+		if (active == 0 && arrived == count) break;
+	}
+	printf("%-12s makespan=%8.2f s, mean wait=%7.2f s, utilization=[", selection_policy_name(), now, wait / count);
+	for (int i = 0; i < NUM_PRINTERS; i++) {
+		printf("%s%s:%.0f%%", i ? " " : "", printer_names[i], 100 * busy[i] / now);
+	}
+	printf("]%s\n", queued > 0 ? " (jobs left unroutable)" : "");
+}
+
+int main(int argc, char *argv[]) {
+	char *policies[] = {"first", "shortest", "lru", "throughput", "round-robin"};
+	char command[100];
+	TRACE_ENTRY *trace = NULL;
+	int count = argc > 1 ? read_trace(argv[1], &trace) : generate_trace(&trace);
+	sf_suppress_chatter = 1;
+	sf_init();
+	conversions_init();
+	define("type a");
+	define("type b");
+	define("type c");
+	define("conversion a b cat");
+	define("conversion b c cat");
+	define("printer p0 c");
+	define("printer p1 b");
+	define("printer p2 a");
+	define("printer p3 c");
+	for (int i = 0; i < NUM_PRINTERS; i++) {
+		sprintf(command, "enable %s", printer_names[i]);
+		define(command);
+	}
+	printf("%d jobs, printer speeds p0:1 p1:2 p2:1 p3:4 MB/s, %.2f s per conversion\n", count, CONVERSION_COST);
+	for (int i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+		set_selection_policy(policies[i]);
+		simulate(trace, count);
+	}
+	free(trace);
+	free_memory();
+	conversions_fini();
+	sf_fini();
+	return EXIT_SUCCESS;
+}
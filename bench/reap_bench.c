@@ -0,0 +1,112 @@
+/*
+ * Reaps thousands of synthetic job leaders through reap_jobs() and reports the
+ * cost per reap, along with the cost of the old linear pid lookup for the same
+ * number of jobs.
+ *
+ * Usage: bin/bench_reap_bench [children]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "job_table.h"
+#include "pid_map.h"
+
+extern int sf_suppress_chatter;
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static JOB *find_job_by_scan(int pid) {
+	JOB *job;
+	for (int i = 0; i < job_table_size(); i++) {
+		if ((job = job_table_get(i)) != NULL && job->pgid == pid) {
+			return job;
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	int children = argc > 1 ? atoi(argv[1]) : 5000;
+	int fds[2], pid, reaped = 0;
+	char setup[] = "type aaa", printer[] = "printer bench aaa";
+	BITSET eligible = {NULL, 0};
+	JOB *job;
+	double start, elapsed;
+	sf_suppress_chatter = 1;
+	sf_init();
+	conversions_init();
+	parse_command(setup, stdin, stdout);
+	parse_command(printer, stdin, stdout);
+	pipe(fds);
+	for (int i = 0; i < children; i++) {
+		bitset_set(&eligible, 0);
+		if (!start_print_job("bench.aaa", find_type("aaa"), &eligible)) {
+			fprintf(stderr, "Could not create job %d\n", i);
+			exit(EXIT_FAILURE);
+		}
+		eligible.words = NULL;
+		eligible.num_words = 0;
+		job = job_table_get(i);
+		if ((pid = fork()) == 0) {
+			char c;
+			close(fds[1]);
+			read(fds[0], &c, 1);
+			_exit(0);
+		}
+		job->status = JOB_RUNNING;
+		job->selected_printer = find_printer("bench");
+		job->pgid = pid;
+		pid_map_put(pid, job);
+	}
+	close(fds[0]);
+
+	start = now();
+	for (int i = 0; i < job_table_size(); i++) {
+		job = job_table_get(i);
+		if (find_job_by_scan(job->pgid) != job) {
+			fprintf(stderr, "Linear lookup failed for job %d\n", i);
+		}
+	}
+	elapsed = now() - start;
+	printf("linear lookup: %d lookups, %.3f us per lookup\n", children, elapsed / children * 1e6);
+
+	start = now();
+	for (int i = 0; i < job_table_size(); i++) {
+		job = job_table_get(i);
+		if (pid_map_get(job->pgid) != job) {
+			fprintf(stderr, "Hashed lookup failed for job %d\n", i);
+		}
+	}
+	elapsed = now() - start;
+	printf("hashed lookup: %d lookups, %.3f us per lookup\n", children, elapsed / children * 1e6);
+
+	// Let every child exit before timing, so only the reaping is measured.
+	close(fds[1]);
+	sleep(1);
+	start = now();
+	reap_jobs();
+	elapsed = now() - start;
+	for (int i = 0; i < job_table_size(); i++) {
+		if (job_table_get(i)->status == JOB_FINISHED) reaped++;
+	}
+	printf("reap_jobs: %d of %d children reaped, %.3f us per reap\n", reaped, children, elapsed / children * 1e6);
+
+	free_memory();
+	conversions_fini();
+	sf_fini();
+	return reaped == children ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,198 @@
+/*
+ * Throughput of daemon mode with many concurrent clients.  bin/imprimer is
+ * run in a scratch directory, listening on a socket, with one disabled
+ * printer so that no job ever starts.  Each client keeps a window of requests
+ * in flight: it submits a job, and cancels every job it is told was
+ * submitted.  Reports requests per second, request latency and imprimer's CPU
+ * time per request.
+ *
+ * Usage: bin/bench_server_bench [-c clients] [-n requests] [-w window]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define SOCKET_NAME "imp.sock"
+#define MAX_WINDOW 1024
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(double *) a, y = *(double *) b;
+	return (x > y) - (x < y);
+}
+
+static int connect_to_server() {
+	struct sockaddr_un address;
+	int fd;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, SOCKET_NAME);
+	for (int i = 0; i < 500; i++) {
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+			return -1;
+		}
+		if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0) {
+			return fd;
+		}
+		close(fd);
+		usleep(10000);
+	}
+	return -1;
+}
+
+/*
+ * Runs one client, recording the latency of each request in latencies.
+ * Returns the number of error replies.
+ */
+static int run_client(int fd, int requests, int window, double *latencies) {
+	double sent_at[MAX_WINDOW];
+	int to_cancel[MAX_WINDOW], num_to_cancel = 0;
+	char output[16384], input[1 << 16];
+	int sent = 0, replied = 0, errors = 0, job, length;
+	size_t buffered = 0;
+	char *line, *newline;
+	ssize_t bytes;
+	while (replied < requests) {
+		length = 0;
+		while (sent < requests && sent - replied < window) {
+			if (num_to_cancel > 0) {
+				length += sprintf(output + length, "cancel %d\n", to_cancel[--num_to_cancel]);
+			} else {
+				length += sprintf(output + length, "print in.aaa\n");
+			}
+			sent_at[sent++ % window] = now();
+		}
+		if (length > 0 && write(fd, output, length) != length) {
+			return -1;
+		}
+		if ((bytes = read(fd, input + buffered, sizeof(input) - buffered - 1)) <= 0) {
+			return -1;
+		}
+		buffered += bytes;
+		input[buffered] = '\0';
+		line = input;
+		while ((newline = strchr(line, '\n')) != NULL) {
+			if (strncmp(line, "OK", 2) == 0 || strncmp(line, "ERROR", 5) == 0) {
+				latencies[replied] = now() - sent_at[replied % window];
+				replied++;
+				if (line[0] == 'E') {
+					errors++;
+				} else if (sscanf(line, "OK job=%d", &job) == 1 && num_to_cancel < MAX_WINDOW) {
+					to_cancel[num_to_cancel++] = job;
+				}
+			}
+			line = newline + 1;
+		}
+		buffered -= line - input;
+		memmove(input, line, buffered);
+	}
+	return errors;
+}
+
+int main(int argc, char *argv[]) {
+	int clients = 8, requests = 20000, window = 16, option, total, errors = 0, status, fd;
+	char imprimer[PATH_MAX], workdir[] = "/tmp/imprimer_server_XXXXXX", command[64];
+	char *imprimer_path = getenv("IMPRIMER") != NULL ? getenv("IMPRIMER") : "bin/imprimer";
+	int start[2], *client_errors, server_pid, null_fd;
+	double *latencies, started, elapsed, cpu;
+	struct rusage usage;
+	FILE *file;
+	while ((option = getopt(argc, argv, "c:n:w:")) != -1) {
+		switch (option) {
+		case 'c':
+			clients = atoi(optarg);
+			break;
+		case 'n':
+			requests = atoi(optarg);
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-c clients] [-n requests] [-w window]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (clients < 1 || requests < 1 || window < 1 || window > MAX_WINDOW) {
+		fprintf(stderr, "Invalid options\n");
+		return EXIT_FAILURE;
+	}
+	if (realpath(imprimer_path, imprimer) == NULL || mkdtemp(workdir) == NULL || chdir(workdir) == -1) {
+		fprintf(stderr, "Could not set up %s for %s\n", workdir, imprimer_path);
+		return EXIT_FAILURE;
+	}
+	file = fopen("in.aaa", "w");
+	fputs("data\n", file);
+	fclose(file);
+	file = fopen("script.imp", "w");
+	fprintf(file, "type aaa\nprinter p1 aaa\nretention 0\nlisten %s\n", SOCKET_NAME);
+	fclose(file);
+
+	if ((server_pid = fork()) == 0) {
+		null_fd = open("/dev/null", O_RDWR);
+		dup2(null_fd, 0), dup2(null_fd, 1), dup2(null_fd, 2);
+		execl(imprimer, imprimer, "-i", "script.imp", NULL);
+		_exit(EXIT_FAILURE);
+	}
+	latencies = mmap(NULL, sizeof(double) * clients * requests, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	client_errors = mmap(NULL, sizeof(int) * clients, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	pipe(start);
+	for (int i = 0; i < clients; i++) {
+		if (fork() == 0) {
+			close(start[1]);
+			fd = connect_to_server();
+			read(start[0], command, 1);
+			client_errors[i] = fd == -1 ? -1 : run_client(fd, requests, window, latencies + (size_t) i * requests);
+			_exit(EXIT_SUCCESS);
+		}
+	}
+	close(start[0]);
+	// Let every client connect before they all start.
+	usleep(200000);
+	started = now();
+	close(start[1]);
+	for (int i = 0; i < clients; i++) {
+		wait(NULL);
+	}
+	elapsed = now() - started;
+
+	if ((fd = connect_to_server()) != -1) {
+		write(fd, "listen off\nquit\n", 16);
+		while (read(fd, command, sizeof(command)) > 0);
+		close(fd);
+	}
+	wait4(server_pid, &status, 0, &usage);
+	cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	for (int i = 0; i < clients; i++) {
+		if (client_errors[i] == -1) {
+			fprintf(stderr, "Client %d lost its connection\n", i);
+			errors = -1;
+			break;
+		}
+		errors += client_errors[i];
+	}
+	total = clients * requests;
+	qsort(latencies, total, sizeof(double), compare_doubles);
+	printf("SERVER: clients=%d, requests=%d, window=%d, errors=%d, elapsed=%.3f, requests_per_sec=%.1f, "
+		"p50=%.6f, p99=%.6f, cpu_per_request=%.6f\n", clients, total, window, errors, elapsed, total / elapsed,
+		latencies[total / 2], latencies[(int) (total * 0.99)], cpu / total);
+
+	snprintf(command, sizeof(command), "rm -rf %s", workdir);
+	if (chdir("/") == 0) system(command);
+	return errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
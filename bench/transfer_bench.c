@@ -0,0 +1,87 @@
+/*
+ * Compares the throughput of sending a file to a printer-like socket with the
+ * old forked cat against transfer_file().
+ *
+ * Usage: bin/bench_transfer_bench [megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "transfer.h"
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Forks a reader that discards everything written to the returned descriptor.
+ */
+static int start_printer(int *reader_pid) {
+	int fds[2];
+	char buffer[1 << 16];
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	if ((*reader_pid = fork()) == 0) {
+		close(fds[0]);
+		while (read(fds[1], buffer, sizeof(buffer)) > 0);
+		_exit(0);
+	}
+	close(fds[1]);
+	return fds[0];
+}
+
+static void send_with_cat(char *filename, int printer) {
+	int pid;
+	if ((pid = fork()) == 0) {
+		int input = open(filename, O_RDONLY);
+		dup2(input, 0);
+		dup2(printer, 1);
+		close(input);
+		close(printer);
+		char *args[] = {"/bin/cat", NULL};
+		execvp(args[0], args);
+		_exit(1);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+static double run(char *filename, int use_transfer) {
+	int reader_pid;
+	double start = now();
+	int printer = start_printer(&reader_pid);
+	if (use_transfer) {
+		transfer_file(filename, printer);
+	} else {
+		send_with_cat(filename, printer);
+	}
+	close(printer);
+	waitpid(reader_pid, NULL, 0);
+	return now() - start;
+}
+
+int main(int argc, char *argv[]) {
+	int megabytes = argc > 1 ? atoi(argv[1]) : 256;
+	char filename[] = "/tmp/imprimer_transfer_XXXXXX";
+	char block[1 << 20];
+	int fd = mkstemp(filename);
+	double cat_time, transfer_time;
+	memset(block, 'x', sizeof(block));
+	for (int i = 0; i < megabytes; i++) {
+		write(fd, block, sizeof(block));
+	}
+	close(fd);
+	cat_time = run(filename, 0);
+	transfer_time = run(filename, 1);
+	printf("cat: %d MB in %.3f s (%.1f MB/s)\n", megabytes, cat_time, megabytes / cat_time);
+	printf("transfer_file: %d MB in %.3f s (%.1f MB/s)\n", megabytes, transfer_time, megabytes / transfer_time);
+	unlink(filename);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,117 @@
+/*
+ * Measures how many jobs per second can be run through the three stage
+ * pdf -> ps -> png -> pcl path from rsrc/imprimer.cmd, with a forked leader per
+ * job and with a pool of pre-forked workers.  The stages are cat, so that the
+ * cost of starting the pipeline dominates, and the printer is /dev/null.
+ *
+ * Usage: bin/bench_worker_bench [jobs] [workers]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "events.h"
+#include "conversion_cache.h"
+#include "job_table.h"
+#include "pid_map.h"
+#include "worker_pool.h"
+
+extern int sf_suppress_chatter;
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void define(char *command) {
+	char line[100];
+	strcpy(line, command);
+	parse_command(line, stdin, stdout);
+}
+
+/*
+ * Runs the jobs one after another, waiting for each to be reaped or reported
+ * by its worker before starting the next.  Returns the number that finished.
+ */
+static int run_jobs(char *filename, int jobs, int printer) {
+	BITSET eligible = {NULL, 0};
+	JOB *job;
+	int pid, finished = 0;
+	for (int i = 0; i < jobs; i++) {
+		bitset_set(&eligible, 0);
+		if (!start_print_job(filename, find_type("pdf"), &eligible)) {
+			fprintf(stderr, "Could not create job %d\n", i);
+			exit(EXIT_FAILURE);
+		}
+		eligible.words = NULL;
+		eligible.num_words = 0;
+		job = job_table_get(job_table_size() - 1);
+		remove_waiting_job(job);
+		job->selected_printer = find_printer("bench");
+		job->conversion_path = cached_conversion_path(job->type, job->selected_printer->type);
+		if ((pid = launch_job(job, printer)) == -1) {
+			fprintf(stderr, "Could not start job %d\n", i);
+			exit(EXIT_FAILURE);
+		}
+		job->status = JOB_RUNNING;
+		job->pgid = pid;
+		pid_map_put(pid, job);
+		while (job->pgid != 0) {
+			events_dispatch(-1);
+		}
+		if (job->status == JOB_FINISHED) finished++;
+	}
+	return finished;
+}
+
+int main(int argc, char *argv[]) {
+	int jobs = argc > 1 ? atoi(argv[1]) : 500;
+	int workers = argc > 2 ? atoi(argv[2]) : 4;
+	int printer = open("/dev/null", O_WRONLY);
+	char filename[] = "/tmp/imprimer_worker_XXXXXX.pdf";
+	int fd = mkstemps(filename, 4), forked, pooled;
+	double forked_time, pooled_time;
+	write(fd, "%PDF-1.4\n", 9);
+	close(fd);
+	sf_suppress_chatter = 1;
+	sf_init();
+	conversions_init();
+	start_event_loop();
+	define("type ps");
+	define("type pdf");
+	define("type png");
+	define("type pcl");
+	define("conversion pdf ps cat");
+	define("conversion ps png cat");
+	define("conversion png pcl cat");
+	define("printer bench pcl");
+
+	forked_time = now();
+	forked = run_jobs(filename, jobs, printer);
+	forked_time = now() - forked_time;
+	printf("forked leaders: %d of %d jobs in %.3f s (%.1f jobs/s)\n", forked, jobs, forked_time, jobs / forked_time);
+
+	set_worker_pool_size(workers);
+	pooled_time = now();
+	pooled = run_jobs(filename, jobs, printer);
+	pooled_time = now() - pooled_time;
+	printf("%d workers: %d of %d jobs in %.3f s (%.1f jobs/s)\n", workers, pooled, jobs, pooled_time, jobs / pooled_time);
+
+	free_memory();
+	events_fini();
+	conversions_fini();
+	sf_fini();
+	unlink(filename);
+	close(printer);
+	return forked == jobs && pooled == jobs ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,28 @@
+#ifndef BITSET_H
+#define BITSET_H
+
+#include <stdint.h>
+
+/*
+ * Growable set of small non-negative integers, used for printer bitmaps.
+ * A zero-initialized BITSET is a valid empty set.
+ */
+typedef struct bitset {
+	uint64_t *words;
+	int num_words;
+} BITSET;
+
+int bitset_set(BITSET *set, int bit);
+void bitset_clear(BITSET *set, int bit);
+int bitset_test(BITSET *set, int bit);
+int bitset_is_empty(BITSET *set);
+int bitset_copy(BITSET *dest, BITSET *source);
+int bitset_or(BITSET *dest, BITSET *source);
+void bitset_and(BITSET *dest, BITSET *source);
+void bitset_reset(BITSET *set);
+void bitset_free(BITSET *set);
+int bitset_next(BITSET *set, int from);
+int bitset_first_common(BITSET *a, BITSET *b, BITSET *c);
+void bitset_print(FILE *out, BITSET *set);
+
+#endif
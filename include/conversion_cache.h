@@ -0,0 +1,25 @@
+#ifndef CONVERSION_CACHE_H
+#define CONVERSION_CACHE_H
+
+/*
+ * Memoizes find_conversion_path() results by (from, to) type index.  The paths
+ * returned are owned by the cache and must not be freed by the caller; one
+ * that must stay valid across an invalidation is held, and released when no
+ * longer needed.
+ */
+CONVERSION **cached_conversion_path(FILE_TYPE *from, FILE_TYPE *to);
+void conversion_path_hold(CONVERSION **path);
+void conversion_path_release(CONVERSION **path);
+void conversion_cache_invalidate();
+void conversion_cache_fini();
+
+/*
+ * Routing table: for every source type, the bitmap of printers whose type can
+ * be reached from it by some conversion path.
+ */
+void routing_add_type(FILE_TYPE *type);
+void routing_add_printer(int id, FILE_TYPE *type);
+BITSET *printers_accepting(FILE_TYPE *type);
+void routing_precompute();
+
+#endif
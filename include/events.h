@@ -0,0 +1,31 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+/*
+ * Callback invoked by the event loop when the descriptor it was registered
+ * with becomes readable, or writable if that was asked for.
+ */
+typedef void event_handler_t (int fd, void *data);
+
+typedef struct event_source {
+	int fd;
+	int is_signal;
+	event_handler_t *handler;
+	void *data;
+	int events;             /* Interest passed to epoll. */
+	int removed;
+	struct event_source *next;
+} EVENT_SOURCE;
+
+int events_init();
+void events_fini();
+
+EVENT_SOURCE *events_add(int fd, event_handler_t *handler, void *data);
+EVENT_SOURCE *events_add_signal(int signum, event_handler_t *handler, void *data);
+int events_set_enabled(EVENT_SOURCE *source, int enabled);
+int events_set_interest(EVENT_SOURCE *source, int input, int output);
+void events_remove(EVENT_SOURCE *source);
+
+int events_dispatch(int timeout);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#define FANOUT_MAX_COPIES 32
+#define FANOUT_CHUNK (1 << 16)  /* Bytes duplicated at a time; no more than a pipe holds. */
+
+/*
+ * Fan-out printing, for jobs submitted with "print --copies-to".  The
+ * conversion paths to the job's printers are merged into a tree on their
+ * common prefixes, so each distinct stage runs once.  Where the output of the
+ * file or of a stage goes to more than one place, a fan process duplicates it
+ * with tee(2) and splice(2), so the data is not copied through user space
+ * unless the kernel refuses.
+ */
+int run_fanout(char *filename, CONVERSION ***paths, int *printer_descriptors, int num_printers);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef JOB_EXPIRY_H
+#define JOB_EXPIRY_H
+
+#define DEFAULT_JOB_RETENTION 10
+
+/*
+ * Finished and aborted jobs in the order they expire.  Every job is kept for
+ * the same retention period, so appending keeps the queue sorted.  A timerfd
+ * armed for the head of the queue wakes the event loop when it is due.
+ */
+void set_job_retention(double seconds);
+double job_retention();
+
+void job_expiry_add(JOB *job);
+JOB *job_expiry_pop_due(double now);
+int job_expiry_timer();
+void job_expiry_arm(double now);
+void job_expiry_fini();
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef JOB_QUEUE_H
+#define JOB_QUEUE_H
+
+#define MAX_PRIORITY 9
+
+/*
+ * Scheduling options, set with the "queue" command.
+ */
+typedef struct queue_options {
+	double aging;       /* Seconds of waiting worth one priority level, or 0 for strict priorities. */
+	int fairshare;      /* Interleave the jobs of different owners. */
+	double quantum;     /* Virtual time charged to an owner per job under fair share. */
+} QUEUE_OPTIONS;
+
+extern QUEUE_OPTIONS queue_options;
+
+int set_queue_option(char *option);
+void print_queue_options(FILE *out);
+
+/*
+ * Waiting jobs, ordered by priority, aging and fair share, in one heap per
+ * class of jobs that can start on the same printers.  Each job's rank is fixed
+ * when it is pushed, so operations are O(log n), and finding the next job to
+ * start also looks once at every class with waiting jobs.
+ */
+char *job_queue_owner(char *name);
+void job_queue_push(JOB *job);
+JOB *job_queue_pop_startable(int (*can_start)(JOB *job));
+void job_queue_remove(JOB *job);
+void job_queue_job_ended(JOB *job);
+void job_queue_defer(JOB *job);
+void job_queue_restore();
+int job_queue_size();
+void job_queue_fini();
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef JOB_TABLE_H
+#define JOB_TABLE_H
+
+#define JOB_SLAB_SIZE 256     /* Number of JOB records allocated at a time. */
+
+/*
+ * Slab allocated store of JOB records.  Job ids index the slabs directly, and
+ * released records are kept on a free list so that ids are reused in O(1).
+ * Every record allocated is given the next submission number, which, unlike
+ * its id, tells it apart from earlier jobs that had the same id.
+ */
+JOB *job_table_alloc();
+void job_table_release(JOB *job);
+int job_table_reserve(int count);
+JOB *job_table_get(int id);
+int job_table_size();
+void job_table_fini();
+
+#endif
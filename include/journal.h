@@ -0,0 +1,55 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_MAGIC "IMPJRNL1"
+#define JOURNAL_SYNC_INTERVAL 0.05      /* Seconds between fdatasync()s while records are pending. */
+#define JOURNAL_BUFFER_SIZE (1 << 16)
+#define JOURNAL_COMPACT_RECORDS 100000  /* Records appended before a snapshot is considered. */
+#define JOURNAL_MAX_JOB_ID (1 << 24)    /* Job records with larger ids are taken as corrupt. */
+
+/*
+ * Append-only journal of definitions and job and printer events.  Records are
+ * buffered and written once per scheduling pass, with fdatasync() batched over
+ * JOURNAL_SYNC_INTERVAL.  Opening a journal replays it, and the journal is
+ * periodically replaced by a compact snapshot of the current state.
+ */
+typedef enum journal_record_kind {
+	JOURNAL_DEFINITION = 1,
+	JOURNAL_PRINTER_STATUS,
+	JOURNAL_JOB_CREATED,
+	JOURNAL_JOB_STATUS,
+	JOURNAL_JOB_COPIES      /* Follows the JOB_CREATED of a job printed with --copies-to. */
+} JOURNAL_RECORD_KIND;
+
+typedef struct journal_record {
+	uint32_t length;        /* Of the whole record, including this header. */
+	uint16_t kind;
+	uint16_t num_words;     /* Bitset words after the strings of a JOB_CREATED. */
+	int32_t id;
+	int32_t value;
+} JOURNAL_RECORD;
+
+typedef struct journal_stats {
+	unsigned long records;
+	unsigned long bytes;
+	unsigned long writes;
+	unsigned long syncs;
+	unsigned long snapshots;
+} JOURNAL_STATS;
+
+int journal_open(char *path, FILE *out);
+int journal_is_open();
+void journal_close();
+void journal_detach();
+void journal_fini();
+int journal_timer();
+void journal_flush();
+void journal_sync();
+void print_journal_status(FILE *out);
+
+void journal_definition(char **words);
+void journal_printer_status(char *name, PRINTER_STATUS status);
+void journal_job_created(JOB *job);
+void journal_job_status(JOB *job);
+
+#endif
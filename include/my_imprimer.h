@@ -1,23 +1,106 @@
 #ifndef MY_IMPRIMER_H
 #define MY_IMPRIMER_H
 
+typedef struct connection_stats {
+	int connects;
+	double total_connect_time;
+	double max_connect_time;
+	int pooled_starts;
+	int direct_starts;
+} CONNECTION_STATS;
+
+typedef struct printer_load {
+	int jobs;
+	unsigned long last_dispatch;
+	uint64_t bytes_printed;
+	double busy_time;
+} PRINTER_LOAD;
+
 typedef struct printer {
 	int id;
 	char *name;
 	FILE_TYPE *type;
 	PRINTER_STATUS status;
+	int ready_descriptor;
+	struct event_source *connect_source;
+	int connect_failed;             /* The last pooled connection failed; the next one is direct. */
+	CONNECTION_STATS connection_stats;
+	PRINTER_LOAD load;
 } PRINTER;
 
 typedef struct job {
 	int id;
 	FILE_TYPE *type;
 	JOB_STATUS status;
-	int eligible;
+	BITSET eligible;
 	char *file;
 	PRINTER *selected_printer;
+	PRINTER *awaited_printer;       /* Whose pooled connection is being opened for the job. */
 	CONVERSION **conversion_path;
+	int pgid;
+	time_t finished_at;
+	double expires_at;
+	struct job *next_expiring;
+	double submitted_at;
+	double started_at;
+	uint64_t *stage_bytes;
+	int num_stage_counters;
+	struct stage_usage *stage_usage;
+	int num_stages;
+	int priority;
+	char *owner;
+	int copies;
+	struct split_job *split;
+	struct job *split_parent;
+	int split_index;        /* From 1 for the chunks of a split job, otherwise 0. */
+	double rank;
+	unsigned long submission;
+	int heap_index;
+	struct job_class *job_class;
+	int unscheduled;
+	int counted_pending;    /* Whether the job is in the pending and running counts. */
+	int counted_running;
+	int allocated;
+	struct job *prev_waiting;
+	struct job *next_waiting;
+	struct job *next_free;
 } JOB;
 
+typedef struct command_reader {
+	FILE *in;
+	FILE *out;
+	char *prompt;
+	char *buffer;
+	size_t length;
+	size_t capacity;
+	int done;
+	int quit;
+} COMMAND_READER;
+
+#define COMMAND_BLOCK_SIZE (1 << 20)    /* Bytes read from a script at a time. */
+#define COMMAND_POLL_LINES 64           /* Script lines run between polls for events. */
+#define MAX_COMMAND_WORDS 64            /* Words parsed without allocating. */
+
+/*
+ * Runs a command.  argv[0] is the command name and argv[argc] is NULL.
+ */
+typedef void command_handler_t (int argc, char **argv, FILE *in, FILE *out);
+
+typedef struct command {
+	char *name;
+	command_handler_t *handler;
+} COMMAND;
+
+/*
+ * Outcome of a command run by run_command().
+ */
+typedef struct command_result {
+	int failed;
+	char *message;
+	int jobs;               /* Jobs submitted. */
+	int last_job;
+} COMMAND_RESULT;
+
 
 void free_memory();
 void free_printers();
@@ -29,64 +112,141 @@ void free_job(JOB *job);
 
 
 int parse_command(char *command, FILE *in, FILE *out);
-
-void readline_callback();
+int run_command(char *command, FILE *in, FILE *out, COMMAND_RESULT *outcome);
+COMMAND *find_command(char *name);
+void command_error(char *message);
+struct event_source *set_command_source(struct event_source *source);
+void display_help(int argc, char **argv, FILE *in, FILE *out);
+
+int start_event_loop();
+void sigchld_callback(int fd, void *data);
+void expiry_callback(int fd, void *data);
+void journal_callback(int fd, void *data);
+void stats_callback(int fd, void *data);
+void reap_jobs();
+void end_job(JOB *job, int exit_status);
+void release_job_resources(JOB *job);
+void retire_job(JOB *job);
+void job_completed(int job_id, int pid, int exit_status);
+void release_printer(PRINTER *printer);
+void wait_for_printer_connection(PRINTER *printer);
+void printer_changed(PRINTER *printer);
+void set_printer_status(PRINTER *printer, PRINTER_STATUS status);
 JOB *find_job_from_pid(int pid);
 void dequeue_finished_jobs();
+void report_job_status(JOB *job);
 void delete_job(JOB *job);
 
-void sigchld_handler();
-
 int read_commands_from_file(FILE *in, FILE *out);
 int read_commands_from_stdin(FILE *in, FILE *out);
+void serve_clients();
+void show_prompt(COMMAND_READER *reader);
+void read_command_input(int fd, void *data);
 
-void process_type(char *command);
+void process_type(int argc, char **argv, FILE *in, FILE *out);
 
-int process_arguments(char *args, char **args_arr, int min_args, int max_args);
+int check_arguments(int argc, int min_args, int max_args);
 
-void process_printer(char *command);
+void process_printer(int argc, char **argv, FILE *in, FILE *out);
 int find_free_printer_id();
 int valid_printer_name(char *name);
 void allocate_and_save_printer(int id, char *name, FILE_TYPE *type);
 
 
 
-void process_conversion(char *command);
-int count_args(char *str);
-void copy_array(char **source, char **dest, int num_elements);
-
-
-void process_print(char *command, FILE *in, FILE *out);
-int get_all_printers();
-int get_eligible_printers(char **names);
-int start_print_job(char *name, FILE_TYPE *type, int bitmap);
-int find_free_job_id();
-
-
-void cancel_job(char *command);
-void pause_job(char *command);
-void resume_job(char *command);
-
-
-
-
-void change_printer_status(char *command, PRINTER_STATUS status);
+void process_conversion(int argc, char **argv, FILE *in, FILE *out);
+
+
+void process_print(int argc, char **argv, FILE *in, FILE *out);
+int process_print_options(char **args, int num_args, int *priority, char **owner, char **copies_to);
+int process_eligible_printers(char **names, int num_names, char *copies_to, BITSET *bitmap);
+void process_print_batch(int argc, char **argv, FILE *in, FILE *out);
+void get_all_printers(BITSET *bitmap);
+int get_eligible_printers(char **names, BITSET *bitmap);
+int get_copies_printers(char *list, BITSET *bitmap);
+int start_print_job(char *name, FILE_TYPE *type, BITSET *bitmap);
+int submit_print_job(char *name, FILE_TYPE *type, BITSET *bitmap, int priority, char *owner, int copies);
+int start_split(JOB *job);
+void end_split(JOB *job, int exit_status);
+int submit_chunk_job(JOB *parent, char *chunk, int index);
+void chunk_ended(JOB *chunk);
+void finish_split(JOB *job);
+int cancel_split(JOB *job);
+void free_split_job(JOB *job);
+void enqueue_waiting_job(JOB *job);
+void remove_waiting_job(JOB *job);
+void unlink_unscheduled_job(JOB *job);
+
+
+void cancel_job(int argc, char **argv, FILE *in, FILE *out);
+void abort_waiting_job(JOB *job);
+void pause_job(int argc, char **argv, FILE *in, FILE *out);
+void resume_job(int argc, char **argv, FILE *in, FILE *out);
+
+
+
+
+void enable_printer(int argc, char **argv, FILE *in, FILE *out);
+void disable_printer(int argc, char **argv, FILE *in, FILE *out);
+void change_printer_status(int argc, char **argv, PRINTER_STATUS status);
+void process_journal(int argc, char **argv, FILE *in, FILE *out);
+void snapshot_state();
+void process_stats(int argc, char **argv, FILE *in, FILE *out);
+void display_stats(FILE *out);
+void process_wait(int argc, char **argv, FILE *in, FILE *out);
+int job_pending(int job_id, unsigned long submission);
+int count_pending_jobs();
+int count_running_jobs();
+int jobs_can_progress();
+void count_job(JOB *job);
+void process_listen(int argc, char **argv, FILE *in, FILE *out);
+void process_cache(int argc, char **argv, FILE *in, FILE *out);
+int parse_int(char *text, int *value);
+int parse_size(char *text, unsigned long long *size);
+void process_split(int argc, char **argv, FILE *in, FILE *out);
+void process_parallel(int argc, char **argv, FILE *in, FILE *out);
+void process_retention(int argc, char **argv, FILE *in, FILE *out);
+void process_queue(int argc, char **argv, FILE *in, FILE *out);
+void process_policy(int argc, char **argv, FILE *in, FILE *out);
+void close_printer_connections();
+void process_workers(int argc, char **argv, FILE *in, FILE *out);
+void process_pool(int argc, char **argv, FILE *in, FILE *out);
 PRINTER *find_printer(char *name);
+FILE_TYPE *lookup_type(char *name);
+FILE_TYPE *infer_type(char *filename);
 
 
+void process_printers(int argc, char **argv, FILE *in, FILE *out);
+void process_jobs(int argc, char **argv, FILE *in, FILE *out);
 void display_printers(FILE *out);
 void display_jobs(FILE *out);
+void display_stage_bytes(FILE *out, JOB *job);
+void display_stage_usage(FILE *out, JOB *job);
+void process_pipeline(int argc, char **argv, FILE *in, FILE *out);
 
 
 
 void run_available_jobs();
+int start_job(JOB *job, PRINTER *printer);
+int job_can_start(JOB *job);
 PRINTER *find_printer_for_job(JOB *job);
-void run_job(JOB *job, PRINTER *printer);
-int unblock_sigterm_sigpipe();
+PRINTER *find_printers_for_copies(JOB *job);
+void set_job_conversion_path(JOB *job, CONVERSION **path);
+int run_job(JOB *job, PRINTER *printer);
+int run_copies_job(JOB *job);
+int fork_copies_leader(JOB *job, int *printer_descriptors, CONVERSION ***paths, int num_printers);
+int launch_job(JOB *job, int printer_descriptor);
+void prepare_stage_accounting(JOB *job);
+int fork_job_leader(JOB *job, int printer_descriptor);
+int unblock_child_signals();
 int count_links_in_conversion_path(CONVERSION **path);
-void print_no_conversion(char *filename, int printer_descriptor);
-void run_conversion_pipeline(char *filename, int printer_descriptor, CONVERSION **conversion_path);
-int reap_children();
+int print_no_conversion(char *filename, int printer_descriptor);
+struct output_cache_fill;
+int run_conversion_pipeline(char *filename, int printer_descriptor, CONVERSION **conversion_path, uint64_t *stage_bytes, struct stage_usage *usage, struct output_cache_fill *fill);
+int stop_pipeline(int *pids, int count, int input);
+int spawn_stage(char **cmd_and_args, char *filename, int input, int output, int unused_read_end, int printer_descriptor);
+void record_input_size(char *filename, uint64_t *stage_bytes);
+int reap_children(struct stage_usage *usage, int num_stages);
 void update_running_job_statuses(JOB *job, PRINTER *printer, CONVERSION **pipeline, int pid);
 void get_command_names(CONVERSION **pipeline, char **command_names);
 
@@ -0,0 +1,24 @@
+#ifndef NAME_INDEX_H
+#define NAME_INDEX_H
+
+/*
+ * Hash index from names to objects.  The index does not copy names, so each
+ * name must stay valid for as long as its entry is in the index.
+ * A zero-initialized NAME_INDEX is a valid empty index.
+ */
+typedef struct name_entry {
+	char *name;
+	void *value;
+} NAME_ENTRY;
+
+typedef struct name_index {
+	NAME_ENTRY *entries;
+	unsigned int capacity;
+	unsigned int count;
+} NAME_INDEX;
+
+int name_index_put(NAME_INDEX *index, char *name, void *value);
+void *name_index_get(NAME_INDEX *index, char *name);
+void name_index_fini(NAME_INDEX *index);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef OUTPUT_CACHE_H
+#define OUTPUT_CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+
+#define OUTPUT_CACHE_MAX_STAGES 16
+#define OUTPUT_CACHE_DEFAULT_LIMIT (256ULL << 20)
+#define OUTPUT_CACHE_LOW_WATER 0.9      /* Eviction stops at this fraction of the limit. */
+#define OUTPUT_CACHE_READ_SIZE (1 << 16)
+
+/*
+ * Opt-in cache of conversion outputs in a directory, set with the "cache"
+ * command.  The output of stage k of a pipeline is stored under a key made
+ * from the hash and size of the job's file and the command lines of stages
+ * 1..k, so a repeated job starts from the longest cached prefix of its
+ * pipeline, or streams the cached final output straight to the printer.
+ * Entries are files named by their key; their modification time is the last
+ * use, and the least recently used are evicted once the total size goes over
+ * the limit.  Settings and counters live in a shared mapping, so job leaders
+ * and pool workers see the same cache.
+ */
+typedef struct output_cache_stats {
+	uint64_t hits;          /* Jobs whose whole pipeline was cached. */
+	uint64_t partial_hits;  /* Jobs that skipped some stages. */
+	uint64_t misses;
+	uint64_t stored;
+	uint64_t evicted;
+	uint64_t bytes;         /* Total size of the entries, as far as is known. */
+} OUTPUT_CACHE_STATS;
+
+/*
+ * A job's use of the cache.  The relays after the stages that run copy their
+ * output to temporary files, which become entries if the pipeline succeeds.
+ */
+typedef struct output_cache_fill {
+	int first_stage;        /* Stages before this one were skipped. */
+	int num_stages;         /* 0 if the cache is not used. */
+	uint64_t keys[OUTPUT_CACHE_MAX_STAGES];
+	char dir[PATH_MAX];
+	char input[PATH_MAX];   /* Entry to read instead of the job's file. */
+} OUTPUT_CACHE_FILL;
+
+int output_cache_init();
+void output_cache_fini();
+int output_cache_enable(char *dir, uint64_t max_bytes);
+void output_cache_disable();
+int output_cache_clear();
+void print_output_cache_status(FILE *out);
+
+int output_cache_start(OUTPUT_CACHE_FILL *fill, char *filename, CONVERSION **path);
+char *output_cache_temp_path(OUTPUT_CACHE_FILL *fill, int stage, char *path);
+void output_cache_finish(OUTPUT_CACHE_FILL *fill, int success);
+
+#endif
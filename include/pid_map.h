@@ -0,0 +1,12 @@
+#ifndef PID_MAP_H
+#define PID_MAP_H
+
+/*
+ * Hash map from the pgid of a running job's leader process to its JOB.
+ */
+int pid_map_put(int pid, JOB *job);
+JOB *pid_map_get(int pid);
+void pid_map_remove(int pid);
+void pid_map_fini();
+
+#endif
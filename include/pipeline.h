@@ -0,0 +1,54 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+
+/*
+ * Tunables for the pipes that connect conversion stages, set with the
+ * "pipeline" command.
+ */
+typedef struct pipeline_options {
+	int pipe_size;      /* F_SETPIPE_SZ for every pipe, or 0 for the default. */
+	int packet;         /* Open pipes in O_DIRECT (packet) mode. */
+	int relay;          /* Splice the last stage's output into the printer. */
+	int count;          /* Relay after every stage and count the bytes moved. */
+} PIPELINE_OPTIONS;
+
+extern PIPELINE_OPTIONS pipeline_options;
+
+int set_pipeline_option(char *option);
+void print_pipeline_options(FILE *out);
+
+int make_pipeline_pipe(int fds[2]);
+int start_relay(int input, int output, int unused_read_end, int printer_descriptor, uint64_t *counter, char *copy_path);
+
+uint64_t *alloc_stage_counters(int num_counters);
+void free_stage_counters(uint64_t *counters, int num_counters);
+
+/*
+ * What one conversion stage used, filled in by the job leader as it reaps the
+ * stage.  Bytes are the stage's read() and write() totals.
+ */
+typedef struct stage_usage {
+	int pid;
+	int reaped;
+	int status;
+	double started_at;
+	double wall_time;
+	double user_time;
+	double system_time;
+	long max_rss;           /* Kilobytes. */
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+} STAGE_USAGE;
+
+struct rusage;
+
+STAGE_USAGE *alloc_stage_usage(int num_stages);
+void free_stage_usage(STAGE_USAGE *usage, int num_stages);
+void stage_started(STAGE_USAGE *stage, int pid);
+STAGE_USAGE *find_stage_usage(STAGE_USAGE *usage, int num_stages, int pid);
+void read_stage_io(STAGE_USAGE *stage);
+void record_stage_exit(STAGE_USAGE *stage, int status, struct rusage *rusage);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef PRINTER_POOL_H
+#define PRINTER_POOL_H
+
+#define POOL_CONNECT_TIMEOUT 10   /* Seconds a helper may take to connect before it is killed. */
+
+/*
+ * Printer connection manager.  When enabled, every enabled printer keeps a
+ * spare connection, opened ahead of time by a helper process (which also
+ * starts the printer daemon if needed) and replaced as soon as a job takes
+ * it, so dispatch never waits for imp_connect_to_printer().
+ */
+void set_connection_pool(int enabled);
+int connection_pool_enabled();
+
+void refill_printer_connection(PRINTER *printer);
+int printer_connection_ready(PRINTER *printer);
+int printer_connection_pending(PRINTER *printer);
+int printer_connections_pending();
+int take_printer_connection(PRINTER *printer);
+void close_printer_connection(PRINTER *printer);
+void display_connection_stats(FILE *out, PRINTER *printer);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef REPLICATE_H
+#define REPLICATE_H
+
+#include <stdio.h>
+
+/*
+ * conversions.h has no include guard, so the types it defines are named by
+ * their tags here and the header can be included before or after it.
+ */
+struct file_type;
+struct conversion;
+
+#define REPLICATE_MAX_INSTANCES 64
+#define REPLICATE_CHUNK (1 << 20)       /* Input given to one instance, rounded up to a record. */
+#define REPLICATE_HELD_LIMIT (4 << 20)  /* Output an instance may hold before it is left to block. */
+
+/*
+ * A conversion whose stage is replicated, set with the "parallel" command.
+ * The stage's input is cut into chunks that end on a record boundary, after
+ * the last newline or, with pages, after the last form feed, and up to
+ * instances copies of the command run at once, each on a chunk of its own.
+ * Their outputs are written in the order of the chunks, so the command must
+ * convert each record without regard to the ones around it.  Empty input is
+ * given to a single instance, so that a command that writes a header or a
+ * trailer still does.
+ */
+typedef struct replicate_rule {
+	struct file_type *from;
+	struct file_type *to;
+	int instances;
+	int pages;              /* Cut after form feeds, else after newlines. */
+} REPLICATE_RULE;
+
+int replicate_set_rule(struct file_type *from, struct file_type *to, int instances, int pages);
+void replicate_clear_rule(struct file_type *from, struct file_type *to);
+REPLICATE_RULE *replicate_rule(struct conversion *conversion);
+int replicate_path(struct conversion **conversion_path);
+void print_replicate_rules(FILE *out);
+void replicate_fini();
+
+int start_replicated_stage(REPLICATE_RULE *rule, char **cmd_and_args, char *filename, int input, int output, int unused_read_end, int printer_descriptor);
+
+#endif
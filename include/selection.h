@@ -0,0 +1,25 @@
+#ifndef SELECTION_H
+#define SELECTION_H
+
+/*
+ * Policies for choosing among the idle printers that can take a job, set with
+ * the "policy" command.
+ */
+typedef enum selection_policy {
+	POLICY_FIRST,           /* Lowest numbered printer. */
+	POLICY_SHORTEST,        /* Fewest conversions to the printer's type. */
+	POLICY_LRU,             /* Printer that has gone longest without a job. */
+	POLICY_THROUGHPUT,      /* Highest measured bytes per second. */
+	POLICY_ROUND_ROBIN      /* Next printer after the last one chosen. */
+} SELECTION_POLICY;
+
+int set_selection_policy(char *name);
+SELECTION_POLICY selection_policy();
+char *selection_policy_name();
+
+int select_printer(JOB *job, BITSET *candidates, PRINTER **printers);
+void selection_job_started(PRINTER *printer);
+void selection_job_finished(PRINTER *printer, uint64_t bytes, double seconds);
+void display_printer_loads(FILE *out, PRINTER **printers, int num_printers);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+
+#define SERVER_BACKLOG 128
+#define SERVER_READ_SIZE (1 << 16)      /* Bytes read from a client at a time. */
+#define SERVER_MAX_PENDING (1 << 20)    /* Unsent reply bytes before a client's input is paused. */
+
+/*
+ * Daemon mode: commands from any number of clients of a Unix domain socket,
+ * served on the event loop.  A request is one command line.  Its reply is
+ * the command's output followed by a status line, which is "OK", "OK job=<id>"
+ * or "OK jobs=<count>" when jobs were submitted, or "ERROR <message>".
+ * Requests may be pipelined; replies come back in order.  "quit" closes the
+ * connection.
+ */
+typedef struct server_stats {
+	unsigned long accepted;
+	unsigned long requests;
+	unsigned long errors;
+	unsigned long bytes_sent;
+} SERVER_STATS;
+
+int server_listen(char *path);
+void server_close();
+int server_active();
+void server_detach();
+void server_fini();
+void print_server_status(FILE *out);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef SPLIT_H
+#define SPLIT_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define SPLIT_DIR_TEMPLATE "imprimer-split-XXXXXX"
+#define SPLIT_CHUNK_FORMAT "chunk-%06d"
+#define SPLIT_MAX_BYTES (1ULL << 30)     /* Largest chunk size. */
+
+/*
+ * How jobs of a type are split into chunks, set with the "split" command.
+ * With a size, a chunk holds up to that many bytes and ends after the last
+ * form feed in it, so that pages stay whole, or failing that after the last
+ * newline.  With a command, the command is run in an empty directory with the
+ * file on its standard input, and every file it leaves there is a chunk, in
+ * name order.
+ */
+typedef struct split_rule {
+	FILE_TYPE *type;
+	uint64_t max_bytes;
+	char **cmd_and_args;    /* NULL when splitting by size. */
+} SPLIT_RULE;
+
+/*
+ * The state of a split job.  Its chunks are submitted as jobs of their own,
+ * which can run at the same time on different printers, once the splitter
+ * has exited; the split job ends when the last of them does.
+ */
+typedef struct split_job {
+	char *dir;
+	int *chunk_ids;
+	int num_chunks;         /* 0 while the splitter runs. */
+	int ended;
+	int status;             /* The first failure, of the splitter or a chunk. */
+	int cancelled;
+	int owner;              /* The process that removes dir if the job is freed early. */
+} SPLIT_JOB;
+
+int split_set_rule(FILE_TYPE *type, uint64_t max_bytes, char **cmd_and_args);
+void split_clear_rule(FILE_TYPE *type);
+SPLIT_RULE *split_rule(FILE_TYPE *type);
+void print_split_rules(FILE *out);
+void split_fini();
+
+int split_needed(SPLIT_RULE *rule, char *filename);
+int split_start(SPLIT_RULE *rule, char *filename, char **dir);
+int split_collect(char *dir, char ***chunks);
+void split_remove(char *dir);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define STATS_BUCKETS 32            /* Bucket i counts latencies below 2^i microseconds. */
+#define STATS_MAX_PROGRAMS 32       /* Conversion programs with their own histogram. */
+#define STATS_PROGRAM_NAME 32
+#define STATS_MAX_STAGES 64         /* Stages one leader can be timing at once. */
+
+/*
+ * Counters and latency histograms for the spooler's hot paths.  They live in a
+ * shared mapping created before anything is forked, and are updated with
+ * relaxed atomics, so job leaders and pool workers can record the runtime of
+ * the stages they spawn without any locking.
+ */
+typedef enum stats_latency {
+	STATS_QUEUE_WAIT,       /* Submission to start. */
+	STATS_CONNECT,          /* imp_connect_to_printer(), pooled or direct. */
+	STATS_JOB_RUN,          /* Start to the job leader being reaped. */
+	STATS_REAP,             /* Handling of one SIGCHLD, including dispatch. */
+	STATS_NUM_LATENCIES
+} STATS_LATENCY;
+
+typedef enum stats_counter {
+	STATS_SUBMITTED,
+	STATS_STARTED,
+	STATS_FINISHED,
+	STATS_ABORTED,
+	STATS_CONNECT_FAILURES,
+	STATS_REAPED,
+	STATS_STAGE_FAILURES,   /* Stages that could not be spawned; failed exits count per program. */
+	STATS_NUM_COUNTERS
+} STATS_COUNTER;
+
+typedef struct stats_histogram {
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t buckets[STATS_BUCKETS];
+} STATS_HISTOGRAM;
+
+int stats_init();
+void stats_fini();
+void stats_reset();
+
+void stats_count(STATS_COUNTER counter);
+void stats_record(STATS_LATENCY latency, double seconds);
+void stats_stage_started(int pid, char *program);
+void stats_stage_exited(int pid, int failed, double cpu_time, long max_rss, uint64_t bytes_written);
+
+int set_stats_dump(char *path, double interval);
+char *stats_dump_path();
+int stats_timer();
+void print_stats(FILE *out);
+
+#endif
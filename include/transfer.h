@@ -0,0 +1,13 @@
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+/*
+ * Copies a whole file to an output descriptor without passing the data
+ * through user space where the kernel allows it.
+ *
+ * @return 1 if every byte was transferred, 0 otherwise.
+ */
+int transfer_file(char *filename, int output);
+int transfer_fd(int input, int output);
+
+#endif
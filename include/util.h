@@ -0,0 +1,34 @@
+#ifndef UTIL_H
+#define UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define COPY_BUFFER_SIZE (1 << 16)
+
+/*
+ * Helpers shared by the modules that time what they do or move bytes between
+ * descriptors.  Reads and writes interrupted by a signal are retried.
+ */
+
+/*
+ * Wall clock time in seconds, with microsecond resolution.
+ */
+double current_time();
+
+/*
+ * @return 1 once every byte has been written, or read before the end of the
+ * input; 0 on an error or, for read_exactly(), an early end of the input.
+ */
+int write_all(int fd, char *data, size_t length);
+int read_exactly(int fd, char *data, size_t length);
+
+/*
+ * Copies everything up to the end of input through a buffer, adding the
+ * number of bytes copied to *counter if it is not NULL.
+ *
+ * @return 1 if the input was copied to its end, 0 otherwise.
+ */
+int copy_all(int input, int output, uint64_t *counter);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+/*
+ * Pre-forked job leaders.  Each worker is a process group of its own that
+ * receives jobs (the file, the conversion commands and the printer
+ * descriptor) over a socket, runs the pipeline and reports the exit status,
+ * so starting a job does not fork the whole imprimer process.
+ */
+#define WORKER_MESSAGE_MAX 65536
+#define WORKER_MAX_STAGES 16     /* Longer pipelines get a forked leader. */
+
+typedef struct worker {
+	int pid;
+	int socket;
+	int job_id;         /* Job being run, or -1 when idle. */
+	int jobs_run;
+	struct event_source *source;
+} WORKER;
+
+void set_worker_pool_size(int size);
+int worker_pool_size();
+int worker_pool_submit(JOB *job, int printer_descriptor);
+void worker_pool_reaped(int pid);
+void worker_pool_close();
+void worker_pool_fini();
+void display_workers(FILE *out);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * Imprimer: growable bitsets
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "bitset.h"
+
+#define WORD_BITS (8 * (int) sizeof(uint64_t))
+
+static int grow_bitset(BITSET *set, int num_words) {
+	uint64_t *words = realloc(set->words, num_words * sizeof(uint64_t));
+	if (words == NULL) {
+		return 0;
+	}
+	memset(words + set->num_words, 0, (num_words - set->num_words) * sizeof(uint64_t));
+	set->words = words;
+	set->num_words = num_words;
+	return 1;
+}
+
+static int lowest_bit(uint64_t word) {
+	int bit = 0;
+	while ((word & 0xffffffffULL) == 0) {
+		word >>= 32;
+		bit += 32;
+	}
+	return bit + ffs((int) (word & 0xffffffffULL)) - 1;
+}
+
+int bitset_set(BITSET *set, int bit) {
+	int word = bit / WORD_BITS;
+	if (word >= set->num_words && !grow_bitset(set, word + 1)) {
+		return 0;
+	}
+	set->words[word] |= (uint64_t) 1 << (bit % WORD_BITS);
+	return 1;
+}
+
+void bitset_clear(BITSET *set, int bit) {
+	int word = bit / WORD_BITS;
+	if (word < set->num_words) {
+		set->words[word] &= ~((uint64_t) 1 << (bit % WORD_BITS));
+	}
+}
+
+int bitset_test(BITSET *set, int bit) {
+	int word = bit / WORD_BITS;
+	return word < set->num_words && (set->words[word] & ((uint64_t) 1 << (bit % WORD_BITS))) != 0;
+}
+
+int bitset_is_empty(BITSET *set) {
+	for (int i = 0; i < set->num_words; i++) {
+		if (set->words[i] != 0) return 0;
+	}
+	return 1;
+}
+
+int bitset_copy(BITSET *dest, BITSET *source) {
+	bitset_reset(dest);
+	return bitset_or(dest, source);
+}
+
+int bitset_or(BITSET *dest, BITSET *source) {
+	if (source->num_words > dest->num_words && !grow_bitset(dest, source->num_words)) {
+		return 0;
+	}
+	for (int i = 0; i < source->num_words; i++) {
+		dest->words[i] |= source->words[i];
+	}
+	return 1;
+}
+
+void bitset_and(BITSET *dest, BITSET *source) {
+	for (int i = 0; i < dest->num_words; i++) {
+		dest->words[i] &= i < source->num_words ? source->words[i] : 0;
+	}
+}
+
+void bitset_reset(BITSET *set) {
+	if (set->num_words > 0) {
+		memset(set->words, 0, set->num_words * sizeof(uint64_t));
+	}
+}
+
+void bitset_free(BITSET *set) {
+	free(set->words);
+	set->words = NULL;
+	set->num_words = 0;
+}
+
+/*
+ * Returns the lowest member that is >= from, or -1 if there is none.
+ */
+int bitset_next(BITSET *set, int from) {
+	int word = from / WORD_BITS;
+	uint64_t bits;
+	if (word >= set->num_words) {
+		return -1;
+	}
+	bits = set->words[word] & (~(uint64_t) 0 << (from % WORD_BITS));
+	while (bits == 0) {
+		if (++word == set->num_words) {
+			return -1;
+		}
+		bits = set->words[word];
+	}
+	return word * WORD_BITS + lowest_bit(bits);
+}
+
+/*
+ * Returns the lowest member of the intersection of the three sets, or -1.
+ */
+int bitset_first_common(BITSET *a, BITSET *b, BITSET *c) {
+	int num_words = a->num_words;
+	uint64_t bits;
+	if (b->num_words < num_words) num_words = b->num_words;
+	if (c->num_words < num_words) num_words = c->num_words;
+	for (int i = 0; i < num_words; i++) {
+		if ((bits = a->words[i] & b->words[i] & c->words[i]) != 0) {
+			return i * WORD_BITS + lowest_bit(bits);
+		}
+	}
+	return -1;
+}
+
+/*
+ * Prints the set as a hexadecimal bitmap of at least 8 digits.
+ */
+void bitset_print(FILE *out, BITSET *set) {
+	int chunk = set->num_words * (WORD_BITS / 32) - 1;
+	unsigned int value;
+	while (chunk > 0 && ((set->words[chunk / 2] >> (32 * (chunk % 2))) & 0xffffffffULL) == 0) {
+		chunk--;
+	}
+	if (chunk < 0) {
+		fprintf(out, "%08x", 0);
+		return;
+	}
+	for (; chunk >= 0; chunk--) {
+		value = (set->words[chunk / 2] >> (32 * (chunk % 2))) & 0xffffffffULL;
+		fprintf(out, "%08x", value);
+	}
+}
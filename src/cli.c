@@ -5,6 +5,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -12,27 +14,60 @@
 #include <time.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <strings.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <glob.h>
 
 
 #include "imprimer.h"
 #include "conversions.h"
-#include "sf_readline.h"
+#include "bitset.h"
 #include "my_imprimer.h"
+#include "events.h"
+#include "conversion_cache.h"
+#include "job_table.h"
+#include "pid_map.h"
+#include "name_index.h"
+#include "transfer.h"
+#include "pipeline.h"
+#include "printer_pool.h"
+#include "worker_pool.h"
+#include "selection.h"
+#include "job_queue.h"
+#include "job_expiry.h"
+#include "journal.h"
+#include "stats.h"
+#include "fanout.h"
+#include "split.h"
+#include "replicate.h"
+#include "server.h"
+#include "output_cache.h"
+#include "util.h"
 #include "debug.h"
 
-static PRINTER *printers[MAX_PRINTERS];
-static JOB *jobs[MAX_JOBS];
-static int job_id_to_pid[MAX_JOBS];
-static time_t times_elapsed[MAX_JOBS];
-sig_atomic_t volatile job_finished;
+static PRINTER **printers;
+static int num_printers, printers_capacity;
+static NAME_INDEX printer_index;
+static NAME_INDEX type_index;
+static JOB *unscheduled_head, *unscheduled_tail;
+static char *default_owner = "stdin";
+static EVENT_SOURCE *command_source;
+static COMMAND_RESULT *result;     /* Of the running command; NULL while it waits on the event loop. */
+static BITSET changed_printers;
+static BITSET idle_printers;
+static BITSET candidate_printers;
+static int num_pending_jobs, num_running_jobs;
 //char *printer_status_names[3] = {"disabled", "idle", "busy"};
 //char *job_status_names[6] = {"created", "running", "paused", "finished", "aborted", "deleted"};
 
 int run_cli(FILE *in, FILE *out)
 {
 	int exit_code;
-	signal(SIGCHLD, sigchld_handler);
-	sf_set_readline_signal_hook(readline_callback);
+	if (!start_event_loop()) {
+		return -1;
+	}
 	if (in == NULL) {
 		exit_code = -1;
 	} else if (in == stdin) {
@@ -43,163 +78,497 @@ int run_cli(FILE *in, FILE *out)
     return exit_code;
 }
 
-void readline_callback() {
-	if (job_finished) {
-		job_finished = 0;
-		int status, pid;
-		JOB *job;
-		while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
-			job = find_job_from_pid(pid);
-			if (WIFEXITED(status)) {
-				if (WEXITSTATUS(status) != 0) {
-					job->status = JOB_ABORTED;
-					sf_job_aborted(job->id, WEXITSTATUS(status));
-				} else {
-					job->status = JOB_FINISHED;
-					sf_job_finished(job->id, WEXITSTATUS(status));
-				}
-				sf_job_status(job->id, job->status);
-				if (job->selected_printer->status != PRINTER_DISABLED) {
-					job->selected_printer->status = PRINTER_IDLE;
-					sf_printer_status(job->selected_printer->name, PRINTER_IDLE);
-				}
-				job_id_to_pid[job->id] = 0;
-				times_elapsed[job->id] = time(NULL);
-			} else if (WIFSTOPPED(status)) {
-				job->status = JOB_PAUSED;
-				sf_job_status(job->id, JOB_PAUSED);
-			} else if (WIFCONTINUED(status)) {
-				job->status = JOB_RUNNING;
-				sf_job_status(job->id, JOB_RUNNING);
-			} else if (WIFSIGNALED(status)) {
-				job->status = JOB_ABORTED;
-				sf_job_aborted(job->id, WTERMSIG(status));
-				sf_job_status(job->id, JOB_ABORTED);
-				if (job->selected_printer->status != PRINTER_DISABLED) {
-					job->selected_printer->status = PRINTER_IDLE;
-					sf_printer_status(job->selected_printer->name, PRINTER_IDLE);
-				};
-				job_id_to_pid[job->id] = 0;
-				times_elapsed[job->id] = time(NULL);
+int start_event_loop() {
+	static EVENT_SOURCE *sigchld_source, *expiry_source, *journal_source, *stats_source;
+	int timer;
+	if (!events_init() || !stats_init() || !output_cache_init()) {
+		return 0;
+	}
+	if (sigchld_source == NULL && (sigchld_source = events_add_signal(SIGCHLD, sigchld_callback, NULL)) == NULL) {
+		return 0;
+	}
+	if (expiry_source == NULL && (timer = job_expiry_timer()) != -1) {
+		expiry_source = events_add(timer, expiry_callback, NULL);
+	}
+	if (journal_source == NULL && (timer = journal_timer()) != -1) {
+		journal_source = events_add(timer, journal_callback, NULL);
+	}
+	if (stats_source == NULL && (timer = stats_timer()) != -1) {
+		stats_source = events_add(timer, stats_callback, NULL);
+	}
+	return 1;
+}
+
+void sigchld_callback(int fd, void *data) {
+	double start = current_time();
+	reap_jobs();
+	run_available_jobs();
+	stats_record(STATS_REAP, current_time() - start);
+}
+
+void expiry_callback(int fd, void *data) {
+	uint64_t expirations;
+	while (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations));
+	dequeue_finished_jobs();
+	journal_flush();
+}
+
+void journal_callback(int fd, void *data) {
+	uint64_t expirations;
+	while (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations));
+	journal_sync();
+}
+
+void stats_callback(int fd, void *data) {
+	uint64_t expirations;
+	FILE *file;
+	while (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations));
+	if (stats_dump_path() == NULL || (file = fopen(stats_dump_path(), "a")) == NULL) {
+		return;
+	}
+	fprintf(file, "DUMP: time=%.6f\n", current_time());
+	display_stats(file);
+	fclose(file);
+}
+
+void reap_jobs() {
+	int status, pid;
+	JOB *job;
+	while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+		if (WIFEXITED(status) || WIFSIGNALED(status)) {
+			stats_count(STATS_REAPED);
+			worker_pool_reaped(pid);
+		}
+		job = find_job_from_pid(pid);
+		if (job == NULL) continue;
+		if (job->split != NULL && (WIFEXITED(status) || WIFSIGNALED(status))) {
+			end_split(job, WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+		} else if (WIFEXITED(status)) {
+			end_job(job, WEXITSTATUS(status));
+		} else if (WIFSTOPPED(status)) {
+			job->status = JOB_PAUSED;
+			report_job_status(job);
+		} else if (WIFCONTINUED(status)) {
+			job->status = JOB_RUNNING;
+			report_job_status(job);
+		} else if (WIFSIGNALED(status)) {
+			job->status = JOB_ABORTED;
+			sf_job_aborted(job->id, WTERMSIG(status));
+			report_job_status(job);
+			release_job_resources(job);
+		}
+	}
+}
+
+/*
+ * Called with the exit status of a job's pipeline, whether it was run by a
+ * forked leader or by a pool worker.
+ */
+void end_job(JOB *job, int exit_status) {
+	struct stat file_stat;
+	if (exit_status != 0) {
+		job->status = JOB_ABORTED;
+		sf_job_aborted(job->id, exit_status);
+	} else {
+		job->status = JOB_FINISHED;
+		sf_job_finished(job->id, exit_status);
+		if (stat(job->file, &file_stat) == 0 && job->copies) {
+			for (int id = bitset_next(&job->eligible, 0); id != -1; id = bitset_next(&job->eligible, id + 1)) {
+				selection_job_finished(printers[id], file_stat.st_size, current_time() - job->started_at);
 			}
+		} else if (stat(job->file, &file_stat) == 0) {
+			selection_job_finished(job->selected_printer, file_stat.st_size, current_time() - job->started_at);
 		}
 	}
-	run_available_jobs();
+	report_job_status(job);
+	release_job_resources(job);
 }
 
-JOB *find_job_from_pid(int pid) {
-	for (int i = 0; i < MAX_JOBS; i++) {
-		if (job_id_to_pid[i] == pid) {
-			return jobs[i];
+void release_job_resources(JOB *job) {
+	stats_count(job->status == JOB_FINISHED ? STATS_FINISHED : STATS_ABORTED);
+	stats_record(STATS_JOB_RUN, current_time() - job->started_at);
+	if (job->copies) {
+		for (int id = bitset_next(&job->eligible, 0); id != -1; id = bitset_next(&job->eligible, id + 1)) {
+			release_printer(printers[id]);
+		}
+	} else {
+		release_printer(job->selected_printer);
+	}
+	pid_map_remove(job->pgid);
+	job->pgid = 0;
+	retire_job(job);
+	chunk_ended(job);
+}
+
+/*
+ * Starts the retention period of a job that has finished or been aborted.
+ */
+void retire_job(JOB *job) {
+	job_queue_job_ended(job);
+	job->finished_at = time(NULL);
+	job_expiry_add(job);
+	job_expiry_arm(current_time());
+}
+
+void job_completed(int job_id, int pid, int exit_status) {
+	JOB *job = job_table_get(job_id);
+	if (job != NULL && job->pgid == pid) {
+		end_job(job, exit_status);
+	}
+}
+
+void release_printer(PRINTER *printer) {
+	if (printer->status != PRINTER_DISABLED) {
+		set_printer_status(printer, PRINTER_IDLE);
+	}
+}
+
+/*
+ * A printer whose pooled connection is being opened is left out of dispatch
+ * until it arrives, when it is offered to the waiting jobs again.
+ */
+void wait_for_printer_connection(PRINTER *printer) {
+	bitset_clear(&idle_printers, printer->id);
+}
+
+void printer_changed(PRINTER *printer) {
+	if (printer->status == PRINTER_IDLE) {
+		bitset_set(&idle_printers, printer->id);
+		bitset_set(&changed_printers, printer->id);
+	}
+}
+
+/*
+ * A printer keeps a spare pooled connection while it is enabled.
+ */
+void set_printer_status(PRINTER *printer, PRINTER_STATUS status) {
+	printer->status = status;
+	sf_printer_status(printer->name, status);
+	if (status == PRINTER_IDLE) {
+		bitset_set(&idle_printers, printer->id);
+		bitset_set(&changed_printers, printer->id);
+		refill_printer_connection(printer);
+	} else {
+		bitset_clear(&idle_printers, printer->id);
+		if (status == PRINTER_DISABLED) {
+			close_printer_connection(printer);
 		}
 	}
-	return NULL;
 }
 
+JOB *find_job_from_pid(int pid) {
+	return pid_map_get(pid);
+}
+
+/*
+ * Deletes the jobs whose retention period is over.  Only the head of the
+ * expiry queue is examined when nothing is due.
+ */
 void dequeue_finished_jobs() {
+	double now = current_time();
 	JOB *job;
-	int seconds;
-	for (int i = 0; i < MAX_JOBS; i++) {
-		job = jobs[i];
-		if (job != NULL && (job->status == JOB_FINISHED || job->status == JOB_ABORTED)) {
-			seconds = time(NULL) - times_elapsed[i];
-			if (seconds >= 10) {
-				delete_job(job);
-				jobs[i] = NULL;
-			}
-		}
+	while ((job = job_expiry_pop_due(now)) != NULL) {
+		delete_job(job);
 	}
+	job_expiry_arm(now);
+}
+
+void report_job_status(JOB *job) {
+	count_job(job);
+	sf_job_status(job->id, job->status);
+	journal_job_status(job);
 }
 
 void delete_job(JOB *job) {
 	job->status = JOB_DELETED;
 	sf_job_deleted(job->id);
-	sf_job_status(job->id, JOB_DELETED);
+	report_job_status(job);
 	free_job(job);
 }
 
 
 
-void sigchld_handler(int sig) {
-	job_finished = 1;
-}
-
+/*
+ * Reads the script in large blocks and runs it a line at a time.  Jobs are
+ * dispatched between lines, so that a job can be cancelled or paused by the
+ * lines after the one that submitted it, but pending events are only polled
+ * every COMMAND_POLL_LINES lines; finished jobs are deleted by the expiry
+ * timer.
+ */
 int read_commands_from_file(FILE *in, FILE *out) {
-	int string_size, res;
-	size_t line_size = 100;
-	char *line = malloc(sizeof(char) * line_size);
-	while ((string_size = getline(&line, &line_size, in)) != -1) {
-		readline_callback();
-		if (line[string_size - 1] == '\n') {
-			line[string_size - 1] = '\0';
+	size_t capacity = COMMAND_BLOCK_SIZE, length = 0, bytes;
+	char *buffer = malloc(capacity + 1), *line, *end, *newline;
+	int at_end = 0;
+	unsigned long lines = 0;
+	default_owner = "script";
+	while (!at_end) {
+		if (length == capacity) {
+			// A line longer than the buffer.
+			capacity *= 2;
+			buffer = realloc(buffer, capacity + 1);
 		}
-		dequeue_finished_jobs();
-		res = parse_command(line, in, out);
-		if (res == -1) {
-			free_memory();
-			free(line);
-			return -1;
+		bytes = fread(buffer + length, 1, capacity - length, in);
+		at_end = bytes == 0;
+		length += bytes;
+		end = buffer + length;
+		line = buffer;
+		while (line < end) {
+			if ((newline = memchr(line, '\n', end - line)) == NULL) {
+				if (!at_end) break;
+				newline = end;
+			}
+			*newline = '\0';
+			if (++lines % COMMAND_POLL_LINES == 0) {
+				events_dispatch(0);
+			}
+			run_available_jobs();
+			if (parse_command(line, in, out) == -1) {
+				free_memory();
+				free(buffer);
+				return -1;
+			}
+			line = newline + 1;
+		}
+		if (line >= end) {
+			length = 0;
+		} else {
+			length = end - line;
+			memmove(buffer, line, length);
 		}
 	}
-	free(line);
+	routing_precompute();
+	events_dispatch(0);
+	run_available_jobs();
+	free(buffer);
 	return 0;
 }
 
+/*
+ * Reads commands from standard input as the event loop finds it readable,
+ * rather than with sf_readline(), which blocks in pselect() until a line is
+ * typed: SIGCHLD now arrives on a signalfd and would not wake it, so jobs
+ * would sit finished until the next line.  Nothing is lost on a terminal.
+ * The "imp>" prompt is shown before each line, under the same condition as
+ * before, and a line is read only once the terminal's own line editing has
+ * delivered it, which is all the editing sf_readline() ever offered.
+ */
 int read_commands_from_stdin(FILE *in, FILE *out) {
-	char *input;
-	int res = 0;
-	char *prompt = (out == stdout ? "imp>" : "");
-    while (res == 0) {
-    	if ((input = sf_readline(prompt)) == NULL) {
-    		break;
-    	}
-    	dequeue_finished_jobs();
-    	res = parse_command(input, in, out);
-    	free(input);
-    }
-    free_memory();
-    return -1;
+	COMMAND_READER reader = {in, out, (out == stdout ? "imp>" : ""), NULL, 0, 0, 0, 0};
+	default_owner = "stdin";
+	EVENT_SOURCE *source = command_source = events_add(fileno(in), read_command_input, &reader);
+	if (source == NULL) {
+		// Regular files cannot be polled, so they are read like a command file.
+		if (read_commands_from_file(in, out) == 0) {
+			serve_clients();
+			free_memory();
+		}
+		return -1;
+	}
+	show_prompt(&reader);
+	while (!reader.done) {
+		if (events_dispatch(-1) == -1) {
+			break;
+		}
+		run_available_jobs();
+	}
+	events_remove(source);
+	command_source = NULL;
+	free(reader.buffer);
+	if (!reader.quit) {
+		serve_clients();
+	}
+	free_memory();
+	return -1;
+}
+
+/*
+ * Keeps serving the daemon's clients once the input has ended, until it stops
+ * listening and its last client hangs up.
+ */
+void serve_clients() {
+	while (server_active()) {
+		if (events_dispatch(-1) == -1) {
+			break;
+		}
+		run_available_jobs();
+	}
+}
+
+void show_prompt(COMMAND_READER *reader) {
+	fputs(reader->prompt, stdout);
+	fflush(stdout);
+}
+
+void read_command_input(int fd, void *data) {
+	COMMAND_READER *reader = data;
+	ssize_t bytes;
+	char *line, *newline;
+	if (reader->length + 1 >= reader->capacity) {
+		reader->capacity = reader->capacity ? reader->capacity * 2 : 256;
+		reader->buffer = realloc(reader->buffer, reader->capacity);
+	}
+	bytes = read(fd, reader->buffer + reader->length, reader->capacity - reader->length - 1);
+	if (bytes <= 0) {
+		reader->buffer[reader->length] = '\0';
+		if (reader->length > 0) {
+			dequeue_finished_jobs();
+			reader->quit = parse_command(reader->buffer, reader->in, reader->out) == -1;
+		}
+		reader->done = 1;
+		return;
+	}
+	reader->length += bytes;
+	reader->buffer[reader->length] = '\0';
+	line = reader->buffer;
+	while (!reader->done && (newline = strchr(line, '\n')) != NULL) {
+		*newline = '\0';
+		dequeue_finished_jobs();
+		if (parse_command(line, reader->in, reader->out) == -1) {
+			reader->done = reader->quit = 1;
+		} else {
+			show_prompt(reader);
+		}
+		line = newline + 1;
+	}
+	reader->length -= line - reader->buffer;
+	memmove(reader->buffer, line, reader->length);
 }
 
 
+/*
+ * Commands by name.  quit has no handler; parse_command() reports it to the
+ * reader instead.
+ */
+static COMMAND commands[] = {
+	{"help", display_help},
+	{"quit", NULL},
+	{"type", process_type},
+	{"printer", process_printer},
+	{"conversion", process_conversion},
+	{"printers", process_printers},
+	{"jobs", process_jobs},
+	{"print", process_print},
+	{"print_batch", process_print_batch},
+	{"cancel", cancel_job},
+	{"pause", pause_job},
+	{"resume", resume_job},
+	{"disable", disable_printer},
+	{"enable", enable_printer},
+	{"pipeline", process_pipeline},
+	{"pool", process_pool},
+	{"workers", process_workers},
+	{"policy", process_policy},
+	{"queue", process_queue},
+	{"retention", process_retention},
+	{"journal", process_journal},
+	{"stats", process_stats},
+	{"wait", process_wait},
+	{"listen", process_listen},
+	{"cache", process_cache},
+	{"split", process_split},
+	{"parallel", process_parallel},
+};
+static NAME_INDEX command_index;
+
+COMMAND *find_command(char *name) {
+	if (command_index.count == 0) {
+		for (int i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+			name_index_put(&command_index, commands[i].name, &commands[i]);
+		}
+	}
+	return name_index_get(&command_index, name);
+}
+
 int parse_command(char *command, FILE *in, FILE *out) {
-	char *token = strtok_r(command, " ", &command);
-	if (token == NULL) {
+	COMMAND_RESULT outcome;
+	return run_command(command, in, out, &outcome);
+}
+
+/*
+ * Splits the command in place on spaces into a NULL-terminated argv, and runs
+ * its handler, filling in outcome.  A command run while another waits on the
+ * event loop has an outcome of its own.  Returns -1 for quit and 0 otherwise.
+ */
+int run_command(char *command, FILE *in, FILE *out, COMMAND_RESULT *outcome) {
+	char *words[MAX_COMMAND_WORDS + 1], **argv = words;
+	int argc = 0, capacity = MAX_COMMAND_WORDS, res = 0;
+	COMMAND_RESULT *previous = result;
+	COMMAND *entry;
+	while (*command != '\0') {
+		if (*command == ' ') {
+			*command++ = '\0';
+			continue;
+		}
+		if (argc == capacity) {
+			capacity *= 2;
+			if (argv == words) {
+				argv = malloc(sizeof(char *) * (capacity + 1));
+				memcpy(argv, words, sizeof(words));
+			} else {
+				argv = realloc(argv, sizeof(char *) * (capacity + 1));
+			}
+		}
+		argv[argc++] = command;
+		while (*command != ' ' && *command != '\0') {
+			command++;
+		}
+	}
+	argv[argc] = NULL;
+	memset(outcome, 0, sizeof(COMMAND_RESULT));
+	if (argc == 0) {
 		return 0;
 	}
-	if (strcmp(token, "help") == 0) {
-		fprintf(out, "Available commands: help, quit, type, printer, conversion, printers, jobs, print, cancel, pause, resume, disable, enable\n");
-		sf_cmd_ok();
-	} else if (strcmp(token, "quit") == 0) {
-		return -1;
-	} else if (strcmp(token, "type") == 0) {
-		process_type(command);
-	} else if (strcmp(token, "printer") == 0) {
-		process_printer(command);
-	} else if (strcmp(token, "conversion") == 0) {
-		process_conversion(command);
-	} else if (strcmp(token, "printers") == 0) {
-		display_printers(out);
-	} else if (strcmp(token, "jobs") == 0) {
-		display_jobs(out);
-	} else if (strcmp(token, "print") == 0) {
-		process_print(command, in, out);
-	} else if (strcmp(token, "cancel") == 0) {
-		cancel_job(command);
-	} else if (strcmp(token, "pause") == 0) {
-		pause_job(command);
-	} else if (strcmp(token, "resume") == 0) {
-		resume_job(command);
-	} else if (strcmp(token, "disable") == 0) {
-		change_printer_status(command, PRINTER_DISABLED);
-	} else if (strcmp(token, "enable") == 0) {
-		change_printer_status(command, PRINTER_IDLE);
-	} else if (strcmp(token, "\0") == 0) {
-		return -2;
+	result = outcome;
+	if ((entry = find_command(argv[0])) == NULL) {
+		command_error("Invalid Command");
+	} else if (entry->handler == NULL) {
+		res = -1;
 	} else {
-		sf_cmd_error("Invalid Command");
+		entry->handler(argc, argv, in, out);
 	}
-	return 0;
+	result = previous;
+	if (argv != words) {
+		free(argv);
+	}
+	return res;
+}
+
+/*
+ * Reports a failed command, and keeps the message for the reply to a client.
+ */
+void command_error(char *message) {
+	if (result != NULL) {
+		result->failed = 1;
+		result->message = message;
+	}
+	sf_cmd_error(message);
+}
+
+/*
+ * Sets the source the current command came from, which is paused while the
+ * command waits on the event loop.  Returns the previous one.
+ */
+EVENT_SOURCE *set_command_source(EVENT_SOURCE *source) {
+	EVENT_SOURCE *previous = command_source;
+	command_source = source;
+	return previous;
+}
+
+void display_help(int argc, char **argv, FILE *in, FILE *out) {
+	fprintf(out, "Available commands:");
+	for (int i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+		fprintf(out, "%s %s", i == 0 ? "" : ",", commands[i].name);
+	}
+	fprintf(out, "\n");
+	sf_cmd_ok();
+}
+
+void process_printers(int argc, char **argv, FILE *in, FILE *out) {
+	display_printers(out);
+}
+
+void process_jobs(int argc, char **argv, FILE *in, FILE *out) {
+	display_jobs(out);
 }
 
 
@@ -208,33 +577,64 @@ int parse_command(char *command, FILE *in, FILE *out) {
 
 
 void free_memory() {
+	journal_fini();
+	stats_fini();
+	worker_pool_fini();
 	free_printers();
 	free_jobs();
+	conversion_cache_fini();
+	server_fini();
+	output_cache_fini();
+	split_fini();
+	replicate_fini();
+	name_index_fini(&command_index);
 }
 
 void free_printers() {
-	for (int i = 0; i < MAX_PRINTERS; i++) {
-		if (printers[i] != NULL) {
-			free(printers[i]->name);
-			free(printers[i]);
-		}
+	close_printer_connections();
+	for (int i = 0; i < num_printers; i++) {
+		free(printers[i]->name);
+		free(printers[i]);
 	}
+	free(printers);
+	name_index_fini(&printer_index);
+	name_index_fini(&type_index);
+	printers = NULL;
+	num_printers = printers_capacity = 0;
+	bitset_free(&changed_printers);
+	bitset_free(&idle_printers);
+	bitset_free(&candidate_printers);
 }
 
 void free_jobs() {
-	for (int i = 0; i < MAX_JOBS; i++) {
-		if (jobs[i] != NULL) {
-			free_job(jobs[i]);
+	JOB *job;
+	for (int i = 0; i < job_table_size(); i++) {
+		if ((job = job_table_get(i)) != NULL) {
+			free_job(job);
 		}
 	}
+	job_table_fini();
+	pid_map_fini();
+	job_queue_fini();
+	job_expiry_fini();
+	unscheduled_head = unscheduled_tail = NULL;
+	num_pending_jobs = num_running_jobs = 0;
 }
 
 void free_job(JOB *job) {
 	free(job->file);
-	if (job->conversion_path != NULL) {
-		free(job->conversion_path);
+	conversion_path_release(job->conversion_path);
+	if (job->stage_bytes != NULL) {
+		free_stage_counters(job->stage_bytes, job->num_stage_counters);
+	}
+	if (job->stage_usage != NULL) {
+		free_stage_usage(job->stage_usage, job->num_stages);
+	}
+	bitset_free(&job->eligible);
+	if (job->split != NULL) {
+		free_split_job(job);
 	}
-	free(job);
+	job_table_release(job);
 }
 
 
@@ -242,94 +642,92 @@ void free_job(JOB *job) {
 
 
 
-void process_type(char *command) {
-	int expected_args = 1;
-	char *args[expected_args];
-	if (!process_arguments(command, args, expected_args, expected_args)) {
-		sf_cmd_error("Incorrect number of args");
+void process_type(int argc, char **argv, FILE *in, FILE *out) {
+	char **args = argv + 1;
+	if (!check_arguments(argc, 1, 1)) {
+		command_error("Incorrect number of args");
 		return;
 	}
 	FILE_TYPE *file_type = define_type(args[0]);
 	if (file_type == NULL) {
-		sf_cmd_error("Could not create file type");
+		command_error("Could not create file type");
 		return;
 	}
+	conversion_cache_invalidate();
+	routing_add_type(file_type);
+	name_index_put(&type_index, file_type->name, file_type);
+	journal_definition(argv);
 	sf_cmd_ok();
 }
 
-int process_arguments(char *args, char **args_arr, int min_args, int max_args) {
-	char *token;
-	int count = 0;
-	while ((token = strtok_r(args, " ", &args))) {
-		count++;
-		if (count > max_args) {
-			return 0;
-		}
-		args_arr[count-1] = token;
-	}
-	if (count < min_args) {
-		return 0;
-	}
-	return 1;
+/*
+ * Checks the number of arguments after the command name; a negative
+ * max_args means there is no upper limit.
+ */
+int check_arguments(int argc, int min_args, int max_args) {
+	return argc - 1 >= min_args && (max_args < 0 || argc - 1 <= max_args);
 }
 
 
 
 
 
-void process_printer(char *command) {
-	int expected_args = 2;
-	char *args[expected_args];
-	if (!process_arguments(command, args, expected_args, expected_args)) {
-		sf_cmd_error("Incorrect number of args");
-		return;
-	}
-	int id = find_free_printer_id();
-	if (id == -1) {
-		sf_cmd_error("Max printers reached");
+void process_printer(int argc, char **argv, FILE *in, FILE *out) {
+	char **args = argv + 1;
+	if (!check_arguments(argc, 2, 2)) {
+		command_error("Incorrect number of args");
 		return;
 	}
 	if (!valid_printer_name(args[0])) {
-		sf_cmd_error("Printer name already used");
+		command_error("Printer name already used");
 		return;
 	}
-	FILE_TYPE *type = find_type(args[1]);
+	FILE_TYPE *type = lookup_type(args[1]);
 	if (type == NULL) {
-		sf_cmd_error("Invalid file type");
+		command_error("Invalid file type");
+		return;
+	}
+	int id = find_free_printer_id();
+	if (id == -1) {
+		command_error("Could not allocate printer");
 		return;
 	}
 	allocate_and_save_printer(id, args[0], type);
 	sf_printer_defined(args[0], args[1]);
+	journal_definition(argv);
 	sf_cmd_ok();
 }
 
 int find_free_printer_id() {
-	for (int i = 0; i < MAX_PRINTERS; i++) {
-		if (printers[i] == NULL) {
-			return i;
+	if (num_printers == printers_capacity) {
+		int new_capacity = printers_capacity ? printers_capacity * 2 : MAX_PRINTERS;
+		PRINTER **new_printers = realloc(printers, new_capacity * sizeof(PRINTER *));
+		if (new_printers == NULL) {
+			return -1;
 		}
+		printers = new_printers;
+		printers_capacity = new_capacity;
 	}
-	return -1;
+	return num_printers;
 }
 
 int valid_printer_name(char *name) {
-	for (int i = 0; i < MAX_PRINTERS; i++) {
-		if (printers[i] != NULL && (strcmp(name, printers[i]->name) == 0)) {
-			return 0;
-		}
-	}
-	return 1;
+	return find_printer(name) == NULL;
 }
 
 void allocate_and_save_printer(int id, char *name, FILE_TYPE *type) {
-	PRINTER *printer = malloc(sizeof(PRINTER));
+	PRINTER *printer = calloc(1, sizeof(PRINTER));
 	char *new_name = malloc(strlen(name) + 1);
 	strcpy(new_name, name);
 	printer->id = id;
+	printer->ready_descriptor = -1;
 	printer->name = new_name;
 	printer->type = type;
 	printer->status = PRINTER_DISABLED;
 	printers[id] = printer;
+	num_printers = id + 1;
+	name_index_put(&printer_index, printer->name, printer);
+	routing_add_printer(id, type);
 }
 
 
@@ -337,64 +735,62 @@ void allocate_and_save_printer(int id, char *name, FILE_TYPE *type) {
 
 
 
-void process_conversion(char *command) {
-	int expected_args = count_args(command);
-	char *args[expected_args];
-	if (!process_arguments(command, args, 3, expected_args)) {
-		sf_cmd_error("Incorrect number of args");
+void process_conversion(int argc, char **argv, FILE *in, FILE *out) {
+	char **args = argv + 1;
+	if (!check_arguments(argc, 3, -1)) {
+		command_error("Incorrect number of args");
 		return;
 	}
-	FILE_TYPE *type_one = find_type(args[0]);
-	FILE_TYPE *type_two = find_type(args[1]);
+	FILE_TYPE *type_one = lookup_type(args[0]);
+	FILE_TYPE *type_two = lookup_type(args[1]);
 	if (type_one == NULL || type_two == NULL) {
-		sf_cmd_error("Invalid file type");
+		command_error("Invalid file type");
 		return;
 	}
-	char *cmd_and_args[expected_args - 1];
-	copy_array(args + 2, cmd_and_args, expected_args - 2);
-	define_conversion(type_one->name, type_two->name, cmd_and_args);
+	define_conversion(type_one->name, type_two->name, args + 2);
+	conversion_cache_invalidate();
+	bitset_or(&changed_printers, &idle_printers);
+	journal_definition(argv);
 	sf_cmd_ok();
 }
 
-int count_args(char *str) {
-	char *p = str;
-	int count = 0;
-	while (*p) {
-		if (*p == ' ') count++;
-		p++;
-	}
-	count++;
-	return count;
-}
-
-void copy_array(char **source, char **dest, int num_elements) {
-	for (int i = 0; i < num_elements; i++) {
-		dest[i] = *source;
-		source++;
-	}
-	dest[num_elements] = '\0';
-}
-
-
-
-
 void display_printers(FILE *out) {
 	PRINTER *printer;
-	for (int i = 0; i < MAX_PRINTERS; i++) {
-		if (printers[i] != NULL) {
-			printer = printers[i];
-			fprintf(out, "PRINTER: id=%d, name=%s, type=%s, status=%s\n", printer->id, printer->name, printer->type->name, printer_status_names[printer->status]);
-		}
+	for (int i = 0; i < num_printers; i++) {
+		printer = printers[i];
+		fprintf(out, "PRINTER: id=%d, name=%s, type=%s, status=%s\n", printer->id, printer->name, printer->type->name, printer_status_names[printer->status]);
 	}
 	sf_cmd_ok();
 }
 
 void display_jobs(FILE *out) {
 	JOB *job;
-	for (int i = 0; i < MAX_JOBS; i++) {
-		if (jobs[i] != NULL) {
-			job = jobs[i];
-			fprintf(out, "JOB: id=%d, type=%s, status=%s, eligible=%08x, file=%s\n", job->id, job->type->name, job_status_names[job->status], job->eligible, job->file);
+	for (int i = 0; i < job_table_size(); i++) {
+		if ((job = job_table_get(i)) != NULL) {
+			fprintf(out, "JOB: id=%d, type=%s, status=%s, eligible=", job->id, job->type->name, job_status_names[job->status]);
+			bitset_print(out, &job->eligible);
+			fprintf(out, ", file=%s", job->file);
+			if (job->priority != 0) {
+				fprintf(out, ", priority=%d", job->priority);
+			}
+			if (job->copies) {
+				fprintf(out, ", copies=%d", job->copies);
+			}
+			if (job->split != NULL) {
+				fprintf(out, ", chunks=%d/%d", job->split->ended, job->split->num_chunks);
+			} else if (job->split_parent != NULL) {
+				fprintf(out, ", parent=%d, chunk=%d/%d", job->split_parent->id, job->split_index, job->split_parent->split->num_chunks);
+			}
+			if (queue_options.fairshare) {
+				fprintf(out, ", owner=%s", job->owner);
+			}
+			if (job->stage_bytes != NULL) {
+				display_stage_bytes(out, job);
+			}
+			if (job->stage_usage != NULL) {
+				display_stage_usage(out, job);
+			}
+			fprintf(out, "\n");
 		}
 	}
 	sf_cmd_ok();
@@ -404,153 +800,594 @@ void display_jobs(FILE *out) {
 
 
 
-void process_print(char *command, FILE *in, FILE *out) {
-	int expected_args = count_args(command);
-	char *args[expected_args];
-	if (!process_arguments(command, args, 1, expected_args)) {
-		sf_cmd_error("Incorrect number of args");
+void display_stage_bytes(FILE *out, JOB *job) {
+	fprintf(out, ", bytes=[file:%llu", (unsigned long long) job->stage_bytes[0]);
+	for (int i = 1; i < job->num_stage_counters; i++) {
+		fprintf(out, " %s:%llu", job->conversion_path[i - 1]->cmd_and_args[0], (unsigned long long) job->stage_bytes[i]);
+	}
+	fprintf(out, "]");
+}
+
+/*
+ * Only stages that have been reaped are shown.
+ */
+void display_stage_usage(FILE *out, JOB *job) {
+	STAGE_USAGE *stage;
+	char *separator = "";
+	fprintf(out, ", usage=[");
+	for (int i = 0; i < job->num_stages; i++) {
+		stage = &job->stage_usage[i];
+		if (!stage->reaped) continue;
+		fprintf(out, "%s%s:wall=%.3f,cpu=%.3f,rss=%ld,read=%llu,written=%llu", separator, job->conversion_path[i]->cmd_and_args[0],
+			stage->wall_time, stage->user_time + stage->system_time, stage->max_rss,
+			(unsigned long long) stage->bytes_read, (unsigned long long) stage->bytes_written);
+		separator = " ";
+	}
+	fprintf(out, "]");
+}
+
+void process_pipeline(int argc, char **argv, FILE *in, FILE *out) {
+	for (int i = 1; i < argc; i++) {
+		if (!set_pipeline_option(argv[i])) {
+			command_error("Invalid pipeline option");
+			return;
+		}
+	}
+	print_pipeline_options(out);
+	sf_cmd_ok();
+}
+
+void process_print(int argc, char **argv, FILE *in, FILE *out) {
+	int num_args = argc - 1;
+	char **args = argv + 1;
+	int first, priority = 0;
+	char *owner = default_owner, *copies_to = NULL;
+	if (!check_arguments(argc, 1, -1)) {
+		command_error("Incorrect number of args");
+		return;
+	}
+	if ((first = process_print_options(args, num_args, &priority, &owner, &copies_to)) == -1) {
 		return;
 	}
-	FILE_TYPE *type = infer_file_type(args[0]);
+	FILE_TYPE *type = infer_type(args[first]);
 	if (type == NULL) {
-		sf_cmd_error("Invalid file type");
+		command_error("Invalid file type");
 		return;
 	}
-	char *eligible_printer_names[expected_args];
-	copy_array(args + 1, eligible_printer_names, expected_args - 1);
-	int eligible_bitmap = ~0;
-	if (expected_args == 1) {
-		eligible_bitmap = get_all_printers();
-	} else {
-		if (!(eligible_bitmap = get_eligible_printers(eligible_printer_names))) {
-			sf_cmd_error("Invalid printer name(s)");
-			return;
-		}
+	BITSET eligible_bitmap = {NULL, 0};
+	if (!process_eligible_printers(args + first + 1, num_args - first - 1, copies_to, &eligible_bitmap)) {
+		return;
 	}
-	if (!start_print_job(args[0], type, eligible_bitmap)) {
-		sf_cmd_error("Job limit reached");
+	if (!submit_print_job(args[first], type, &eligible_bitmap, priority, owner, copies_to != NULL)) {
+		bitset_free(&eligible_bitmap);
+		command_error("Could not allocate job");
 		return;
 	}
 	sf_cmd_ok();
 }
 
-int count_printers() {
-	int count = 0;
-	for (int i = 0; i < MAX_PRINTERS; i++) {
-		if (printers[i] != NULL) {
-			count++;
+/*
+ * Consumes the leading -p, -u and --copies-to options of a print command.
+ * Returns the index of the first remaining argument, or -1 after reporting an
+ * error.
+ */
+int process_print_options(char **args, int num_args, int *priority, char **owner, char **copies_to) {
+	int first = 0;
+	while (first + 1 < num_args && args[first][0] == '-') {
+		if (strcmp(args[first], "-p") == 0) {
+			if (!parse_int(args[first + 1], priority) || *priority < 0 || *priority > MAX_PRIORITY) {
+				command_error("Invalid priority");
+				return -1;
+			}
+		} else if (strcmp(args[first], "-u") == 0) {
+			*owner = args[first + 1];
+		} else if (strcmp(args[first], "--copies-to") == 0) {
+			*copies_to = args[first + 1];
+		} else {
+			command_error("Invalid print option");
+			return -1;
 		}
+		first += 2;
 	}
-	return count;
-}
-
-int get_all_printers() {
-	int bitmap = 0;
-	for (int i = 0; i < MAX_PRINTERS; i++) {
-		if (printers[i] != NULL) {
-			bitmap |= (1 << printers[i]->id);
-		}
+	if (first == num_args) {
+		command_error("Incorrect number of args");
+		return -1;
 	}
-	return bitmap;
+	return first;
 }
 
-int get_eligible_printers(char **names) {
-	int i = 0;
-	int bitmap = 0;
-	PRINTER *printer;
-	while (names[i] != NULL) {
-		printer = find_printer(names[i]);
-		if (printer == NULL) {
+/*
+ * A job printed with --copies-to goes to exactly the printers in its list, so
+ * no printers may be named after the file.
+ */
+int process_eligible_printers(char **names, int num_names, char *copies_to, BITSET *bitmap) {
+	if (copies_to != NULL) {
+		if (num_names > 0 || !get_copies_printers(copies_to, bitmap)) {
+			bitset_free(bitmap);
+			command_error("Invalid printer name(s)");
 			return 0;
 		}
-		bitmap |= (1 << printer->id);
-		i++;
-	}
-	return bitmap;
-}
-
-int start_print_job(char *name, FILE_TYPE *type, int bitmap) {
-	int id = find_free_job_id();
-	if (id == -1) {
+	} else if (num_names == 0) {
+		get_all_printers(bitmap);
+	} else if (!get_eligible_printers(names, bitmap)) {
+		bitset_free(bitmap);
+		command_error("Invalid printer name(s)");
 		return 0;
 	}
-	JOB *job = malloc(sizeof(JOB));
-	char *new_name = malloc(strlen(name) + 1);
-	strcpy(new_name, name);
-	job->id = id;
-	job->type = type;
-	job->status = JOB_CREATED;
-	job->eligible = bitmap;
-	job->file = new_name;
-	job->selected_printer = NULL;
-	job->conversion_path = NULL;
-	jobs[id] = job;
-	sf_job_created(id, new_name, type->name);
 	return 1;
 }
 
-int find_free_job_id() {
-	for (int i = 0; i < MAX_JOBS; i++) {
-		if (jobs[i] == NULL) {
-			return i;
+/*
+ * Fills files from a glob pattern or, for "@name", from the lines of a manifest.
+ * The manifest lines are appended through GLOB_APPEND | GLOB_NOCHECK, so both
+ * cases are released with globfree().
+ */
+static int collect_batch_files(char *source, glob_t *files) {
+	FILE *manifest;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+	int flags = GLOB_NOCHECK | GLOB_NOESCAPE | GLOB_NOMAGIC;
+	memset(files, 0, sizeof(glob_t));
+	if (source[0] != '@') {
+		return glob(source, 0, NULL, files) == 0;
+	}
+	if ((manifest = fopen(source + 1, "r")) == NULL) {
+		return 0;
+	}
+	while ((length = getline(&line, &line_size, manifest)) != -1) {
+		if (length > 0 && line[length - 1] == '\n') {
+			line[--length] = '\0';
 		}
+		if (length == 0) continue;
+		glob(line, flags, NULL, files);
+		flags |= GLOB_APPEND;
 	}
-	return -1;
+	free(line);
+	fclose(manifest);
+	if (files->gl_pathc == 0) {
+		globfree(files);
+		return 0;
+	}
+	return 1;
 }
 
+/*
+ * print_batch [-p priority] [-u owner] <pattern | @manifest> [printers]
+ *
+ * Submits every file matching a glob pattern, or listed one per line in a
+ * manifest, with the same options and printers.  Every file is checked, and
+ * everything its job needs allocated, before any job is created, so a batch
+ * is submitted whole or not at all.  The jobs are scheduled together once the
+ * command returns.
+ */
+void process_print_batch(int argc, char **argv, FILE *in, FILE *out) {
+	int num_args = argc - 1;
+	char **args = argv + 1;
+	int first, priority = 0, num_files, num_submitted = 0, ok;
+	char *owner = default_owner, *copies_to = NULL;
+	BITSET eligible_bitmap = {NULL, 0}, *job_bitmaps;
+	FILE_TYPE **types;
+	glob_t files;
+	if (!check_arguments(argc, 1, -1)) {
+		command_error("Incorrect number of args");
+		return;
+	}
+	if ((first = process_print_options(args, num_args, &priority, &owner, &copies_to)) == -1) {
+		return;
+	}
+	if (!collect_batch_files(args[first], &files)) {
+		command_error("No files to print");
+		return;
+	}
+	num_files = files.gl_pathc;
+	types = malloc(num_files * sizeof(FILE_TYPE *));
+	job_bitmaps = calloc(num_files, sizeof(BITSET));
+	if (types == NULL || job_bitmaps == NULL) {
+		free(types);
+		free(job_bitmaps);
+		globfree(&files);
+		command_error("Could not allocate job");
+		return;
+	}
+	ok = 1;
+	for (int i = 0; i < num_files && ok; i++) {
+		if ((types[i] = infer_type(files.gl_pathv[i])) == NULL) {
+			command_error("Invalid file type");
+			ok = 0;
+		}
+	}
+	if (ok && !process_eligible_printers(args + first + 1, num_args - first - 1, copies_to, &eligible_bitmap)) {
+		ok = 0;
+	}
+	for (int i = 0; i < num_files && ok; i++) {
+		if (!bitset_copy(&job_bitmaps[i], &eligible_bitmap)) {
+			command_error("Could not allocate job");
+			ok = 0;
+		}
+	}
+	if (ok && !job_table_reserve(num_files)) {
+		command_error("Could not allocate job");
+		ok = 0;
+	}
+	if (ok) {
+		for (int i = 0; i < num_files; i++) {
+			num_submitted += submit_print_job(files.gl_pathv[i], types[i], &job_bitmaps[i], priority, owner, copies_to != NULL);
+		}
+		fprintf(out, "BATCH: files=%d, submitted=%d\n", num_files, num_submitted);
+	} else {
+		for (int i = 0; i < num_files; i++) {
+			bitset_free(&job_bitmaps[i]);
+		}
+	}
+	bitset_free(&eligible_bitmap);
+	free(job_bitmaps);
+	free(types);
+	globfree(&files);
+	if (ok) {
+		sf_cmd_ok();
+	}
+}
+
+int count_printers() {
+	return num_printers;
+}
+
+void get_all_printers(BITSET *bitmap) {
+	for (int i = 0; i < num_printers; i++) {
+		bitset_set(bitmap, printers[i]->id);
+	}
+}
+
+int get_eligible_printers(char **names, BITSET *bitmap) {
+	int i = 0;
+	PRINTER *printer;
+	while (names[i] != NULL) {
+		printer = find_printer(names[i]);
+		if (printer == NULL) {
+			return 0;
+		}
+		bitset_set(bitmap, printer->id);
+		i++;
+	}
+	return i > 0;
+}
+
+/*
+ * Parses the comma-separated printer names given to --copies-to.
+ */
+int get_copies_printers(char *list, BITSET *bitmap) {
+	char *name, *saved;
+	PRINTER *printer;
+	int count = 0;
+	for (name = strtok_r(list, ",", &saved); name != NULL; name = strtok_r(NULL, ",", &saved)) {
+		if ((printer = find_printer(name)) == NULL || ++count > FANOUT_MAX_COPIES) {
+			return 0;
+		}
+		bitset_set(bitmap, printer->id);
+	}
+	return count > 0;
+}
+
+/*
+ * On success the job takes ownership of the eligible bitmap.
+ */
+int start_print_job(char *name, FILE_TYPE *type, BITSET *bitmap) {
+	return submit_print_job(name, type, bitmap, 0, default_owner, 0);
+}
+
+/*
+ * If copies is set, the job prints to every printer in its bitmap at once, and
+ * job->copies is the number of printers.
+ */
+int submit_print_job(char *name, FILE_TYPE *type, BITSET *bitmap, int priority, char *owner, int copies) {
+	JOB *job = job_table_alloc();
+	if (job == NULL) {
+		return 0;
+	}
+	char *new_name = malloc(strlen(name) + 1);
+	strcpy(new_name, name);
+	job->type = type;
+	job->status = JOB_CREATED;
+	job->eligible = *bitmap;
+	job->file = new_name;
+	job->selected_printer = NULL;
+	job->conversion_path = NULL;
+	job->priority = priority;
+	job->owner = job_queue_owner(owner);
+	job->copies = 0;
+	if (copies) {
+		for (int id = bitset_next(bitmap, 0); id != -1; id = bitset_next(bitmap, id + 1)) {
+			job->copies++;
+		}
+	}
+	job->submitted_at = current_time();
+	count_job(job);
+	stats_count(STATS_SUBMITTED);
+	journal_job_created(job);
+	sf_job_created(job->id, new_name, type->name);
+	if (!start_split(job)) {
+		enqueue_waiting_job(job);
+	}
+	if (result != NULL) {
+		result->jobs++;
+		result->last_job = job->id;
+	}
+	return 1;
+}
+
+/*
+ * Starts splitting the job if its type has a split rule and the file is more
+ * than one chunk.  The job then runs without a printer until every chunk has
+ * been printed.
+ */
+int start_split(JOB *job) {
+	SPLIT_RULE *rule = split_rule(job->type);
+	char *dir;
+	int pid;
+	if (rule == NULL || job->copies || !split_needed(rule, job->file)) {
+		return 0;
+	}
+	if ((pid = split_start(rule, job->file, &dir)) == -1) {
+		debug("Could not start splitter.");
+		return 0;
+	}
+	job->split = calloc(1, sizeof(SPLIT_JOB));
+	job->split->dir = dir;
+	job->split->owner = getpid();
+	job->pgid = pid;
+	pid_map_put(pid, job);
+	job->started_at = current_time();
+	job->status = JOB_RUNNING;
+	report_job_status(job);
+	return 1;
+}
+
+/*
+ * Called when the splitter exits: submits a job for every chunk, in order,
+ * with the same printers, priority and owner as the split job.
+ */
+void end_split(JOB *job, int exit_status) {
+	SPLIT_JOB *split = job->split;
+	char **chunks = NULL;
+	int num_chunks = 0;
+	pid_map_remove(job->pgid);
+	job->pgid = 0;
+	count_job(job);
+	if (exit_status == 0 && !split->cancelled) {
+		num_chunks = split_collect(split->dir, &chunks);
+	}
+	if (num_chunks > 0) {
+		split->chunk_ids = malloc(num_chunks * sizeof(int));
+	}
+	for (int i = 0; i < num_chunks; i++) {
+		if (split->chunk_ids == NULL || !submit_chunk_job(job, chunks[i], i + 1)) {
+			free(chunks[i]);
+			exit_status = 1;
+		}
+	}
+	free(chunks);
+	split->status = exit_status != 0 ? exit_status : split->cancelled || num_chunks <= 0;
+	if (split->num_chunks == 0) {
+		finish_split(job);
+	}
+}
+
+/*
+ * The chunk job takes ownership of the chunk's path.
+ */
+int submit_chunk_job(JOB *parent, char *chunk, int index) {
+	JOB *job = job_table_alloc();
+	if (job == NULL) {
+		return 0;
+	}
+	if (!bitset_copy(&job->eligible, &parent->eligible)) {
+		job_table_release(job);
+		return 0;
+	}
+	job->type = parent->type;
+	job->status = JOB_CREATED;
+	job->file = chunk;
+	job->priority = parent->priority;
+	job->owner = parent->owner;
+	job->split_parent = parent;
+	job->split_index = index;
+	job->submitted_at = current_time();
+	parent->split->chunk_ids[parent->split->num_chunks++] = job->id;
+	count_job(job);
+	enqueue_waiting_job(job);
+	stats_count(STATS_SUBMITTED);
+	sf_job_created(job->id, chunk, job->type->name);
+	return 1;
+}
+
+/*
+ * Called once a job has finished or been aborted.  A split job ends with the
+ * last of its chunks, and fails if any of them did.
+ */
+void chunk_ended(JOB *chunk) {
+	SPLIT_JOB *split;
+	if (chunk->split_parent == NULL) {
+		return;
+	}
+	split = chunk->split_parent->split;
+	if (chunk->status != JOB_FINISHED && split->status == 0) {
+		split->status = 1;
+	}
+	if (++split->ended == split->num_chunks) {
+		finish_split(chunk->split_parent);
+	}
+}
+
+void finish_split(JOB *job) {
+	if (job->split->status != 0) {
+		job->status = JOB_ABORTED;
+		sf_job_aborted(job->id, job->split->status);
+	} else {
+		job->status = JOB_FINISHED;
+		sf_job_finished(job->id, 0);
+	}
+	report_job_status(job);
+	stats_count(job->status == JOB_FINISHED ? STATS_FINISHED : STATS_ABORTED);
+	stats_record(STATS_JOB_RUN, current_time() - job->started_at);
+	split_remove(job->split->dir);
+	retire_job(job);
+}
+
+/*
+ * Stops the splitter, or else every chunk that has not ended.  The split job
+ * is aborted once they all have.
+ */
+int cancel_split(JOB *job) {
+	SPLIT_JOB *split = job->split;
+	JOB *chunk;
+	int res = 1;
+	split->cancelled = 1;
+	if (job->pgid != 0) {
+		return killpg(job->pgid, SIGTERM) != -1 && (job->status != JOB_PAUSED || killpg(job->pgid, SIGCONT) != -1);
+	}
+	for (int i = 0; i < split->num_chunks; i++) {
+		if ((chunk = job_table_get(split->chunk_ids[i])) == NULL || chunk->split_parent != job) continue;
+		if (chunk->pgid != 0) {
+			res &= killpg(chunk->pgid, SIGTERM) != -1 && (chunk->status != JOB_PAUSED || killpg(chunk->pgid, SIGCONT) != -1);
+		} else if (chunk->status == JOB_CREATED) {
+			abort_waiting_job(chunk);
+		}
+	}
+	return res;
+}
 
+/*
+ * The chunks of a split job outlive it if they are retained longer, so they
+ * are unlinked from it.  If imprimer exits before the job ends, the chunk
+ * files are removed; a journal restores the job whole.
+ */
+void free_split_job(JOB *job) {
+	JOB *chunk;
+	for (int i = 0; i < job->split->num_chunks; i++) {
+		if ((chunk = job_table_get(job->split->chunk_ids[i])) != NULL && chunk->split_parent == job) {
+			chunk->split_parent = NULL;
+		}
+	}
+	if (job->split->owner == getpid() && (job->status == JOB_CREATED || job->status == JOB_RUNNING || job->status == JOB_PAUSED)) {
+		split_remove(job->split->dir);
+	}
+	free(job->split->chunk_ids);
+	free(job->split->dir);
+	free(job->split);
+	job->split = NULL;
+}
 
-void cancel_job(char *command) {
+/*
+ * Waiting jobs live in the job queue.  Jobs that have not yet been offered to
+ * the idle printers are also kept on the unscheduled list, in submission order.
+ * With the pool enabled, each printer the job could use is given a spare
+ * connection if it has none, so that the job does not wait for one.
+ */
+void enqueue_waiting_job(JOB *job) {
+	job_queue_push(job);
+	if (connection_pool_enabled()) {
+		for (int id = bitset_next(&job->eligible, 0); id != -1; id = bitset_next(&job->eligible, id + 1)) {
+			refill_printer_connection(printers[id]);
+		}
+	}
+	job->unscheduled = 1;
+	job->next_waiting = NULL;
+	job->prev_waiting = unscheduled_tail;
+	if (unscheduled_tail != NULL) {
+		unscheduled_tail->next_waiting = job;
+	} else {
+		unscheduled_head = job;
+	}
+	unscheduled_tail = job;
+}
+
+void remove_waiting_job(JOB *job) {
+	job_queue_remove(job);
+	if (job->unscheduled) {
+		unlink_unscheduled_job(job);
+	}
+}
+
+void unlink_unscheduled_job(JOB *job) {
+	if (job->prev_waiting != NULL) {
+		job->prev_waiting->next_waiting = job->next_waiting;
+	} else {
+		unscheduled_head = job->next_waiting;
+	}
+	if (job->next_waiting != NULL) {
+		job->next_waiting->prev_waiting = job->prev_waiting;
+	} else {
+		unscheduled_tail = job->prev_waiting;
+	}
+	job->prev_waiting = job->next_waiting = NULL;
+	job->unscheduled = 0;
+}
+
+
+
+
+void cancel_job(int argc, char **argv, FILE *in, FILE *out) {
 	int job_num;
-	int expected_args = 1;
-	char *args[expected_args];
-	if (!process_arguments(command, args, expected_args, expected_args)) {
-		sf_cmd_error("Incorrect number of args");
+	char **args = argv + 1;
+	if (!check_arguments(argc, 1, 1)) {
+		command_error("Incorrect number of args");
 		return;
 	}
-	if (sscanf(args[0], "%d", &job_num) == -1 || job_num < 0 || job_num >= MAX_JOBS || jobs[job_num] == NULL) {
-		sf_cmd_error("Not a valid job number");
+	JOB *job;
+	if (!parse_int(args[0], &job_num) || (job = job_table_get(job_num)) == NULL) {
+		command_error("Not a valid job number");
 		return;
 	}
-	JOB *job = jobs[job_num];
-	int pid = job_id_to_pid[job_num];
-	if (pid != 0) {
+	int pid = job->pgid;
+	if (job->split != NULL && (job->status == JOB_RUNNING || job->status == JOB_PAUSED)) {
+		if (!cancel_split(job)) {
+			command_error("Job could not be cancelled");
+			return;
+		}
+	} else if (pid != 0) {
 		if (killpg(pid, SIGTERM) == -1) {
-			sf_cmd_error("Job could not be cancelled");
+			command_error("Job could not be cancelled");
 			return;
 		}
 		if (job->status == JOB_PAUSED && killpg(pid, SIGCONT) == -1) {
-			sf_cmd_error("Job could not be cancelled (Could not continue paused process)");
+			command_error("Job could not be cancelled (Could not continue paused process)");
 			return;
 		}
 	} else if (job->status == JOB_CREATED) {
-		job->status = JOB_ABORTED;
-		sf_job_aborted(job->id, 0);
-		sf_job_status(job->id, JOB_ABORTED);
-		times_elapsed[job->id] = time(NULL);
+		abort_waiting_job(job);
 	} else {
-		sf_cmd_error("Job already finished/aborted");
+		command_error("Job already finished/aborted");
 		return;
 	}
 	sf_cmd_ok();
 }
 
+void abort_waiting_job(JOB *job) {
+	remove_waiting_job(job);
+	job->status = JOB_ABORTED;
+	sf_job_aborted(job->id, 0);
+	report_job_status(job);
+	retire_job(job);
+	chunk_ended(job);
+}
+
 
-void pause_job(char *command) {
+void pause_job(int argc, char **argv, FILE *in, FILE *out) {
 	int job_num;
-	int expected_args = 1;
-	char *args[expected_args];
-	if (!process_arguments(command, args, expected_args, expected_args)) {
-		sf_cmd_error("Incorrect number of args");
+	char **args = argv + 1;
+	if (!check_arguments(argc, 1, 1)) {
+		command_error("Incorrect number of args");
 		return;
 	}
-	if (sscanf(args[0], "%d", &job_num) == -1 || job_id_to_pid[job_num] == 0) {
-		sf_cmd_error("Not a valid job number");
+	JOB *job;
+	if (!parse_int(args[0], &job_num) || (job = job_table_get(job_num)) == NULL || job->pgid == 0) {
+		command_error("Not a valid job number");
 		return;
 	}
-	int pid = job_id_to_pid[job_num];
+	int pid = job->pgid;
 	if (killpg(pid, SIGSTOP) == -1) {
-		sf_cmd_error("Job could not be paused");
+		command_error("Job could not be paused");
 		return;
 	}
 	sf_cmd_ok();
@@ -558,21 +1395,21 @@ void pause_job(char *command) {
 
 
 
-void resume_job(char *command) {
+void resume_job(int argc, char **argv, FILE *in, FILE *out) {
 	int job_num;
-	int expected_args = 1;
-	char *args[expected_args];
-	if (!process_arguments(command, args, expected_args, expected_args)) {
-		sf_cmd_error("Incorrect number of args");
+	char **args = argv + 1;
+	if (!check_arguments(argc, 1, 1)) {
+		command_error("Incorrect number of args");
 		return;
 	}
-	if (sscanf(args[0], "%d", &job_num) == -1 || job_id_to_pid[job_num] == 0) {
-		sf_cmd_error("Not a valid job number");
+	JOB *job;
+	if (!parse_int(args[0], &job_num) || (job = job_table_get(job_num)) == NULL || job->pgid == 0) {
+		command_error("Not a valid job number");
 		return;
 	}
-	int pid = job_id_to_pid[job_num];
+	int pid = job->pgid;
 	if (killpg(pid, SIGCONT) == -1) {
-		sf_cmd_error("Job could not be continued");
+		command_error("Job could not be continued");
 		return;
 	}
 	sf_cmd_ok();
@@ -583,164 +1420,984 @@ void resume_job(char *command) {
 
 
 
-void change_printer_status(char *command, PRINTER_STATUS status) {
-	int expected_args = 1;
-	char *args[expected_args];
-	if (!process_arguments(command, args, expected_args, expected_args)) {
-		sf_cmd_error("Incorrect number of args");
+void enable_printer(int argc, char **argv, FILE *in, FILE *out) {
+	change_printer_status(argc, argv, PRINTER_IDLE);
+}
+
+void disable_printer(int argc, char **argv, FILE *in, FILE *out) {
+	change_printer_status(argc, argv, PRINTER_DISABLED);
+}
+
+void change_printer_status(int argc, char **argv, PRINTER_STATUS status) {
+	char **args = argv + 1;
+	if (!check_arguments(argc, 1, 1)) {
+		command_error("Incorrect number of args");
 		return;
 	}
 	PRINTER *printer = find_printer(args[0]);
 	if (printer == NULL) {
-		sf_cmd_error("Could not find printer");
+		command_error("Could not find printer");
 		return;
 	}
 	if (printer->status != status) {
-		printer->status = status;
-		sf_printer_status(args[0], status);
+		set_printer_status(printer, status);
+		journal_printer_status(printer->name, status);
 	}
 	sf_cmd_ok();
 }
 
+void process_journal(int argc, char **argv, FILE *in, FILE *out) {
+	char **args = argv + 1;
+	if (!check_arguments(argc, 0, 1)) {
+		command_error("Incorrect number of args");
+		return;
+	}
+	if (args[0] == NULL) {
+		print_journal_status(out);
+	} else if (strcmp(args[0], "off") == 0) {
+		journal_close();
+	} else if (!journal_open(args[0], out)) {
+		command_error("Could not open journal");
+		return;
+	}
+	sf_cmd_ok();
+}
 
-PRINTER *find_printer(char *name) {
-	for (int i = 0; i < MAX_PRINTERS; i++) {
-		if (printers[i] != NULL && strcmp(printers[i]->name, name) == 0) {
-			return printers[i];
+/*
+ * Writes the enabled printers and unfinished jobs to the journal, for a
+ * snapshot.
+ */
+void snapshot_state() {
+	JOB *job;
+	for (int i = 0; i < num_printers; i++) {
+		if (printers[i]->status != PRINTER_DISABLED) {
+			journal_printer_status(printers[i]->name, PRINTER_IDLE);
+		}
+	}
+	for (int i = 0; i < job_table_size(); i++) {
+		job = job_table_get(i);
+		if (job != NULL && (job->status == JOB_CREATED || job->status == JOB_RUNNING || job->status == JOB_PAUSED)) {
+			journal_job_created(job);
+			if (job->status != JOB_CREATED) {
+				journal_job_status(job);
+			}
 		}
 	}
-	return NULL;
 }
 
+/*
+ * "stats" shows the statistics, "stats reset" clears them, and "stats dump
+ * <path> <seconds>" or "stats dump off" controls the periodic dump.
+ */
+void process_stats(int argc, char **argv, FILE *in, FILE *out) {
+	char **args = argv + 1;
+	double interval;
+	char *end;
+	if (!check_arguments(argc, 0, 3)) {
+		command_error("Incorrect number of args");
+		return;
+	}
+	if (argc == 1) {
+		display_stats(out);
+	} else if (strcmp(args[0], "reset") == 0 && argc == 2) {
+		stats_reset();
+	} else if (strcmp(args[0], "dump") == 0 && argc == 3 && strcmp(args[1], "off") == 0) {
+		set_stats_dump(NULL, 0);
+	} else if (strcmp(args[0], "dump") == 0 && argc == 4) {
+		interval = strtod(args[2], &end);
+		if (*end != '\0' || interval < 0.001) {
+			command_error("Invalid dump interval");
+			return;
+		}
+		if (!set_stats_dump(args[1], interval)) {
+			command_error("Could not start dump");
+			return;
+		}
+	} else {
+		command_error("Usage: stats [reset | dump <path> <seconds> | dump off]");
+		return;
+	}
+	sf_cmd_ok();
+}
 
+/*
+ * The shared statistics, followed by each printer's job count and the time it
+ * has spent on jobs that finished.
+ */
+void display_stats(FILE *out) {
+	PRINTER *printer;
+	print_stats(out);
+	for (int i = 0; i < num_printers; i++) {
+		printer = printers[i];
+		fprintf(out, "UTILIZATION: printer=%s, status=%s, jobs=%d, busy=%.3f\n", printer->name,
+			printer_status_names[printer->status], printer->load.jobs, printer->load.busy_time);
+	}
+}
 
+/*
+ * "wait <job> [seconds]" or "wait all [seconds]" returns once the job, or
+ * every job, has finished or been aborted.  Events are dispatched meanwhile,
+ * but no commands are read, so it fails rather than block forever once
+ * nothing is running.
+ */
+void process_wait(int argc, char **argv, FILE *in, FILE *out) {
+	char **args = argv + 1;
+	double timeout = -1, deadline, remaining;
+	unsigned long submission = 0;
+	char *end;
+	JOB *job = NULL;
+	COMMAND_RESULT *outcome;
+	int job_id = -1, res = 1;
+	if (!check_arguments(argc, 1, 2)) {
+		command_error("Incorrect number of args");
+		return;
+	}
+	if (strcmp(args[0], "all") != 0) {
+		if (!parse_int(args[0], &job_id) || (job = job_table_get(job_id)) == NULL) {
+			command_error("Invalid job id");
+			return;
+		}
+		submission = job->submission;
+	}
+	if (args[1] != NULL && ((timeout = strtod(args[1], &end)) < 0 || *end != '\0')) {
+		command_error("Invalid timeout");
+		return;
+	}
+	if (command_source != NULL) {
+		events_set_enabled(command_source, 0);
+	}
+	// Jobs submitted while waiting, by other clients or split jobs, are not
+	// this command's.
+	outcome = result;
+	result = NULL;
+	run_available_jobs();
+	deadline = current_time() + timeout;
+	while ((job_id == -1 ? count_pending_jobs() > 0 : job_pending(job_id, submission))) {
+		remaining = deadline - current_time();
+		if (!jobs_can_progress() || (timeout >= 0 && remaining <= 0)) {
+			res = 0;
+			break;
+		}
+		if (events_dispatch(timeout >= 0 ? (int) (remaining * 1000) + 1 : -1) == -1) {
+			res = 0;
+			break;
+		}
+		run_available_jobs();
+	}
+	result = outcome;
+	if (command_source != NULL) {
+		events_set_enabled(command_source, 1);
+	}
+	if (!res) {
+		command_error(!jobs_can_progress() ? "Waiting for jobs that cannot run" : "Timed out");
+		return;
+	}
+	if (job != NULL) {
+		job = job_table_get(job_id);
+		fprintf(out, "WAIT: id=%d, status=%s\n", job_id, job != NULL && job->submission == submission ? job_status_names[job->status] : "deleted");
+	}
+	sf_cmd_ok();
+}
+
+/*
+ * A job is pending until it finishes or is aborted, or its id has been
+ * reused.
+ */
+int job_pending(int job_id, unsigned long submission) {
+	JOB *job = job_table_get(job_id);
+	return job != NULL && job->submission == submission &&
+		(job->status == JOB_CREATED || job->status == JOB_RUNNING || job->status == JOB_PAUSED);
+}
+
+int count_pending_jobs() {
+	return num_pending_jobs;
+}
 
+/*
+ * Something will happen to the pending jobs while a job is running, or a
+ * printer connection that waiting jobs may start on is being opened.
+ */
+int jobs_can_progress() {
+	return count_running_jobs() > 0 || printer_connections_pending() > 0;
+}
 
+int count_running_jobs() {
+	return num_running_jobs;
+}
 
+/*
+ * Brings the pending and running counts up to date with a job whose status or
+ * process group has changed.  A split job runs only while its splitter does.
+ */
+void count_job(JOB *job) {
+	int pending = job->status == JOB_CREATED || job->status == JOB_RUNNING || job->status == JOB_PAUSED;
+	int running = job->status == JOB_RUNNING && job->pgid != 0;
+	num_pending_jobs += pending - job->counted_pending;
+	num_running_jobs += running - job->counted_running;
+	job->counted_pending = pending;
+	job->counted_running = running;
+}
 
+void process_listen(int argc, char **argv, FILE *in, FILE *out) {
+	char **args = argv + 1;
+	if (!check_arguments(argc, 0, 1)) {
+		command_error("Incorrect number of args");
+		return;
+	}
+	if (args[0] == NULL) {
+		print_server_status(out);
+	} else if (strcmp(args[0], "off") == 0) {
+		server_close();
+	} else if (!server_listen(args[0])) {
+		command_error("Could not listen on socket");
+		return;
+	}
+	sf_cmd_ok();
+}
+
+/*
+ * Sizes are in bytes, with an optional k, m or g suffix.
+ */
+void process_cache(int argc, char **argv, FILE *in, FILE *out) {
+	char **args = argv + 1;
+	unsigned long long limit = OUTPUT_CACHE_DEFAULT_LIMIT;
+	if (!check_arguments(argc, 0, 2)) {
+		command_error("Incorrect number of args");
+		return;
+	}
+	if (args[0] == NULL) {
+		print_output_cache_status(out);
+	} else if (strcmp(args[0], "off") == 0 && args[1] == NULL) {
+		output_cache_disable();
+	} else if (strcmp(args[0], "clear") == 0 && args[1] == NULL) {
+		if (!output_cache_clear()) {
+			command_error("Cache is off");
+			return;
+		}
+	} else {
+		if (args[1] != NULL && !parse_size(args[1], &limit)) {
+			command_error("Invalid cache size");
+			return;
+		}
+		if (!output_cache_enable(args[0], limit)) {
+			command_error("Could not use cache directory");
+			return;
+		}
+	}
+	sf_cmd_ok();
+}
+
+/*
+ * Parses a whole argument as an int.  Trailing text, such as the x of "3x"
+ * that sscanf("%d") would ignore, and values that do not fit are rejected.
+ */
+int parse_int(char *text, int *value) {
+	char *end;
+	long result;
+	errno = 0;
+	result = strtol(text, &end, 10);
+	if (end == text || *end != '\0' || errno == ERANGE || result < INT_MIN || result > INT_MAX) {
+		return 0;
+	}
+	*value = result;
+	return 1;
+}
+
+/*
+ * Parses a byte count with an optional k, m or g suffix.  Signs, and counts
+ * that do not fit once the suffix is applied, are rejected; strtoull() would
+ * negate the one and saturate or wrap the other.
+ */
+int parse_size(char *text, unsigned long long *size) {
+	char *end;
+	int shift = 0;
+	if (!isdigit((unsigned char) *text)) {
+		return 0;
+	}
+	errno = 0;
+	*size = strtoull(text, &end, 10);
+	if (errno == ERANGE) {
+		return 0;
+	}
+	switch (*end) {
+	case 'g': shift += 10; // fall through
+	case 'm': shift += 10; // fall through
+	case 'k': shift += 10; end++; break;
+	}
+	if (*end != '\0' || *size > ULLONG_MAX >> shift) {
+		return 0;
+	}
+	*size <<= shift;
+	return 1;
+}
+
+/*
+ * "split" shows the split rules.  "split <type> <size>" splits the jobs of a
+ * type into chunks of up to size bytes at page or line boundaries, "split
+ * <type> <command> [args...]" has a command write the chunks, and "split
+ * <type> off" prints its jobs whole again.  The rule applies to jobs submitted
+ * after it is set.
+ */
+void process_split(int argc, char **argv, FILE *in, FILE *out) {
+	char **args = argv + 1;
+	unsigned long long size;
+	FILE_TYPE *type;
+	if (argc == 1) {
+		print_split_rules(out);
+		sf_cmd_ok();
+		return;
+	}
+	if (!check_arguments(argc, 2, -1)) {
+		command_error("Incorrect number of args");
+		return;
+	}
+	if ((type = lookup_type(args[0])) == NULL) {
+		command_error("Invalid file type");
+		return;
+	}
+	if (strcmp(args[1], "off") == 0 && args[2] == NULL) {
+		split_clear_rule(type);
+	} else if (isdigit((unsigned char) args[1][0]) && args[2] == NULL) {
+		if (!parse_size(args[1], &size) || size == 0 || size > SPLIT_MAX_BYTES || !split_set_rule(type, size, NULL)) {
+			command_error("Invalid split size");
+			return;
+		}
+	} else if (!split_set_rule(type, 0, args + 1)) {
+		command_error("Could not set split rule");
+		return;
+	}
+	journal_definition(argv);
+	sf_cmd_ok();
+}
+
+/*
+ * "parallel" shows the replicated conversions.  "parallel <from> <to>
+ * <instances> [lines|pages]" runs up to that many copies of the conversion at
+ * once, on chunks of its input that end on a line or page boundary, and
+ * "parallel <from> <to> off" runs it as one process again.
+ */
+void process_parallel(int argc, char **argv, FILE *in, FILE *out) {
+	char **args = argv + 1;
+	FILE_TYPE *from, *to;
+	int pages = 0;
+	long instances;
+	char *end;
+	if (argc == 1) {
+		print_replicate_rules(out);
+		sf_cmd_ok();
+		return;
+	}
+	if (!check_arguments(argc, 3, 4)) {
+		command_error("Incorrect number of args");
+		return;
+	}
+	if ((from = lookup_type(args[0])) == NULL || (to = lookup_type(args[1])) == NULL) {
+		command_error("Invalid file type");
+		return;
+	}
+	if (strcmp(args[2], "off") == 0 && args[3] == NULL) {
+		replicate_clear_rule(from, to);
+		journal_definition(argv);
+		sf_cmd_ok();
+		return;
+	}
+	instances = strtol(args[2], &end, 10);
+	if (*args[2] == '\0' || *end != '\0' || instances < 1 || instances > REPLICATE_MAX_INSTANCES) {
+		command_error("Invalid number of instances");
+		return;
+	}
+	if (args[3] != NULL && !(pages = strcmp(args[3], "pages") == 0) && strcmp(args[3], "lines") != 0) {
+		command_error("Records must be lines or pages");
+		return;
+	}
+	if (!replicate_set_rule(from, to, instances, pages)) {
+		command_error("Could not set parallel rule");
+		return;
+	}
+	journal_definition(argv);
+	sf_cmd_ok();
+}
+
+void process_retention(int argc, char **argv, FILE *in, FILE *out) {
+	char **args = argv + 1;
+	double seconds;
+	char *end;
+	if (!check_arguments(argc, 0, 1)) {
+		command_error("Incorrect number of args");
+		return;
+	}
+	if (args[0] != NULL) {
+		seconds = strtod(args[0], &end);
+		if (*end != '\0' || seconds < 0) {
+			command_error("Invalid retention");
+			return;
+		}
+		set_job_retention(seconds);
+	}
+	fprintf(out, "RETENTION: %g\n", job_retention());
+	sf_cmd_ok();
+}
+
+void process_queue(int argc, char **argv, FILE *in, FILE *out) {
+	for (int i = 1; i < argc; i++) {
+		if (!set_queue_option(argv[i])) {
+			command_error("Invalid queue option");
+			return;
+		}
+	}
+	print_queue_options(out);
+	sf_cmd_ok();
+}
+
+void process_policy(int argc, char **argv, FILE *in, FILE *out) {
+	char **args = argv + 1;
+	if (!check_arguments(argc, 0, 1)) {
+		command_error("Incorrect number of args");
+		return;
+	}
+	if (args[0] != NULL && !set_selection_policy(args[0])) {
+		command_error("Unknown policy");
+		return;
+	}
+	display_printer_loads(out, printers, num_printers);
+	sf_cmd_ok();
+}
+
+void close_printer_connections() {
+	for (int i = 0; i < num_printers; i++) {
+		close_printer_connection(printers[i]);
+	}
+}
+
+void process_workers(int argc, char **argv, FILE *in, FILE *out) {
+	char **args = argv + 1;
+	int size;
+	if (!check_arguments(argc, 0, 1)) {
+		command_error("Incorrect number of args");
+		return;
+	}
+	if (args[0] != NULL) {
+		if (!parse_int(args[0], &size) || size < 0) {
+			command_error("Invalid number of workers");
+			return;
+		}
+		set_worker_pool_size(size);
+	}
+	display_workers(out);
+	sf_cmd_ok();
+}
+
+void process_pool(int argc, char **argv, FILE *in, FILE *out) {
+	char **args = argv + 1;
+	if (!check_arguments(argc, 0, 1)) {
+		command_error("Incorrect number of args");
+		return;
+	}
+	if (args[0] != NULL) {
+		if (strcmp(args[0], "on") == 0) {
+			set_connection_pool(1);
+			for (int i = 0; i < num_printers; i++) {
+				refill_printer_connection(printers[i]);
+			}
+		} else if (strcmp(args[0], "off") == 0) {
+			set_connection_pool(0);
+			close_printer_connections();
+		} else {
+			command_error("Expected on or off");
+			return;
+		}
+	}
+	for (int i = 0; i < num_printers; i++) {
+		display_connection_stats(out, printers[i]);
+	}
+	sf_cmd_ok();
+}
+
+
+PRINTER *find_printer(char *name) {
+	return name_index_get(&printer_index, name);
+}
+
+/*
+ * Types are indexed as they are defined; the conversions module is only asked
+ * about names the index does not know.
+ */
+FILE_TYPE *lookup_type(char *name) {
+	FILE_TYPE *type = name_index_get(&type_index, name);
+	return type != NULL ? type : find_type(name);
+}
+
+FILE_TYPE *infer_type(char *filename) {
+	char *extension = strrchr(filename, '.');
+	FILE_TYPE *type;
+	if (extension != NULL && (type = name_index_get(&type_index, extension + 1)) != NULL) {
+		return type;
+	}
+	return infer_file_type(filename);
+}
+
+
+
+
+
+
+
+/*
+ * Dispatches only what changed since the last pass.  When printers have become
+ * idle, waiting jobs are taken from the queue in rank order until no idle
+ * printer is left; newly submitted jobs then look for an idle printer.
+ */
 void run_available_jobs() {
-	JOB *job;
+	JOB *job, *next;
 	PRINTER *printer;
-	for (int i = 0; i < MAX_JOBS; i++) {
-		job = jobs[i];
-		if (job != NULL && job->status == JOB_CREATED) {
-			printer = find_printer_for_job(job);
-			if (printer != NULL) {
-				job->selected_printer = printer;
-				run_job(job, printer);
+	if (!bitset_is_empty(&changed_printers)) {
+		bitset_reset(&changed_printers);
+		while (!bitset_is_empty(&idle_printers) && (job = job_queue_pop_startable(job_can_start)) != NULL) {
+			if ((printer = find_printer_for_job(job)) == NULL || !start_job(job, printer)) {
+				job_queue_defer(job);
 			}
 		}
+		job_queue_restore();
+	}
+	for (job = unscheduled_head; job != NULL; job = next) {
+		next = job->next_waiting;
+		if ((printer = find_printer_for_job(job)) != NULL) {
+			start_job(job, printer);
+		}
 	}
+	while (unscheduled_head != NULL) {
+		unlink_unscheduled_job(unscheduled_head);
+	}
+	journal_flush();
+}
+
+int start_job(JOB *job, PRINTER *printer) {
+	job->selected_printer = printer;
+	if (!run_job(job, printer)) {
+		return 0;
+	}
+	remove_waiting_job(job);
+	return 1;
+}
+
+/*
+ * Whether the idle printers can take the job, without choosing one.
+ */
+int job_can_start(JOB *job) {
+	if (job->copies) {
+		return find_printers_for_copies(job) != NULL;
+	}
+	return bitset_first_common(&job->eligible, &idle_printers, printers_accepting(job->type)) != -1;
 }
 
 PRINTER *find_printer_for_job(JOB *job) {
-	char *to_file, *from_file;
 	PRINTER *printer;
-	CONVERSION **conversion_path;
-	from_file = job->type->name;
-	int eligible_bitmap = job->eligible;
-	for (int i = 0; i < MAX_PRINTERS; i++) {
-		if ((eligible_bitmap & (1 << i)) == 0) continue;
-		printer = printers[i];
-		if (printer->status == PRINTER_IDLE) {
-			to_file = printer->type->name;
-			conversion_path = find_conversion_path(from_file, to_file);
-			if (conversion_path != NULL) {
-				job->conversion_path = conversion_path;
-				return printer;
-			}
+	int id;
+	if (job->copies) {
+		return find_printers_for_copies(job);
+	}
+	if (selection_policy() == POLICY_FIRST) {
+		id = bitset_first_common(&job->eligible, &idle_printers, printers_accepting(job->type));
+	} else {
+		bitset_copy(&candidate_printers, &idle_printers);
+		bitset_and(&candidate_printers, &job->eligible);
+		bitset_and(&candidate_printers, printers_accepting(job->type));
+		id = select_printer(job, &candidate_printers, printers);
+	}
+	if (id == -1) {
+		return NULL;
+	}
+	printer = printers[id];
+	set_job_conversion_path(job, cached_conversion_path(job->type, printer->type));
+	return printer;
+}
+
+/*
+ * A job with copies starts only once every one of its printers is idle and
+ * can take its type, whatever the selection policy.  Until then it stays in
+ * the queue, where jobs for any one of those printers can overtake it.
+ * Returns the first of the printers.
+ */
+PRINTER *find_printers_for_copies(JOB *job) {
+	BITSET *accepting = printers_accepting(job->type);
+	int first = bitset_next(&job->eligible, 0);
+	for (int id = first; id != -1; id = bitset_next(&job->eligible, id + 1)) {
+		if (!bitset_test(&idle_printers, id) || !bitset_test(accepting, id)) {
+			return NULL;
 		}
 	}
-	return NULL;
+	if (first == -1) {
+		return NULL;
+	}
+	set_job_conversion_path(job, cached_conversion_path(job->type, printers[first]->type));
+	return printers[first];
+}
+
+/*
+ * The job holds its path until it is freed, since the jobs command reports
+ * on it even after the job has finished.
+ */
+void set_job_conversion_path(JOB *job, CONVERSION **path) {
+	conversion_path_hold(path);
+	conversion_path_release(job->conversion_path);
+	job->conversion_path = path;
 }
 
 
-void run_job(JOB *job, PRINTER *printer) {
+int run_job(JOB *job, PRINTER *printer) {
 	int pid;
-	CONVERSION **conversion_path = job->conversion_path;
-	int printer_descriptor = imp_connect_to_printer(printer->name, printer->type->name, PRINTER_NORMAL);
+	if (job->copies) {
+		return run_copies_job(job);
+	}
+	// A job that is waiting for one printer's spare connection keeps to that
+	// printer, rather than also requesting another's.
+	if (job->awaited_printer != NULL && job->awaited_printer != printer && printer_connection_pending(job->awaited_printer)) {
+		return 0;
+	}
+	if (!printer_connection_ready(printer)) {
+		job->awaited_printer = printer;
+		wait_for_printer_connection(printer);
+		return 0;
+	}
+	int printer_descriptor = take_printer_connection(printer);
 	if (printer_descriptor == -1) {
 		debug("Could not connect to printer.");
-		return;
+		return 0;
+	}
+	pid = launch_job(job, printer_descriptor);
+	close(printer_descriptor);
+	if (pid == -1) {
+		debug("Could not start job leader.");
+		return 0;
+	}
+	job->pgid = pid;
+	pid_map_put(pid, job);
+	update_running_job_statuses(job, printer, job->conversion_path, pid);
+	selection_job_started(printer);
+	job->started_at = current_time();
+	stats_record(STATS_QUEUE_WAIT, job->started_at - job->submitted_at);
+	stats_count(STATS_STARTED);
+	return 1;
+}
+
+/*
+ * Connects to each of the job's printers and forks a leader that prints to
+ * them all.  The job is reported as started on every printer.
+ */
+int run_copies_job(JOB *job) {
+	int descriptors[FANOUT_MAX_COPIES], ids[FANOUT_MAX_COPIES];
+	CONVERSION **paths[FANOUT_MAX_COPIES];
+	int count = 0, pid = -1, ready = 1;
+	// Connections are taken only once every printer has one ready, so that
+	// none is held while the job waits for the others.
+	for (int id = bitset_next(&job->eligible, 0); id != -1; id = bitset_next(&job->eligible, id + 1)) {
+		if (!printer_connection_ready(printers[id])) {
+			wait_for_printer_connection(printers[id]);
+			ready = 0;
+		}
+	}
+	if (!ready) {
+		return 0;
 	}
+	for (int id = bitset_next(&job->eligible, 0); id != -1 && count < FANOUT_MAX_COPIES; id = bitset_next(&job->eligible, id + 1)) {
+		if ((descriptors[count] = take_printer_connection(printers[id])) == -1) {
+			debug("Could not connect to printer.");
+			break;
+		}
+		paths[count] = cached_conversion_path(job->type, printers[id]->type);
+		ids[count++] = id;
+	}
+	if (count == job->copies) {
+		pid = fork_copies_leader(job, descriptors, paths, count);
+	}
+	for (int i = 0; i < count; i++) {
+		close(descriptors[i]);
+	}
+	if (pid == -1) {
+		debug("Could not start job leader.");
+		return 0;
+	}
+	for (int i = 0; i < count; i++) {
+		char *command_names[count_links_in_conversion_path(paths[i]) + 1];
+		get_command_names(paths[i], command_names);
+		sf_job_started(job->id, printers[ids[i]]->name, pid, command_names);
+		set_printer_status(printers[ids[i]], PRINTER_BUSY);
+		selection_job_started(printers[ids[i]]);
+	}
+	job->pgid = pid;
+	pid_map_put(pid, job);
+	job->status = JOB_RUNNING;
+	report_job_status(job);
+	job->started_at = current_time();
+	stats_record(STATS_QUEUE_WAIT, job->started_at - job->submitted_at);
+	stats_count(STATS_STARTED);
+	return 1;
+}
+
+/*
+ * Hands the job to an idle pool worker if there is one, otherwise forks a
+ * leader for it.  Workers do not share the stage counters, so counted jobs
+ * always get their own leader, and neither do they know which conversions
+ * are replicated.  Returns the pid of the job's process group.
+ */
+int launch_job(JOB *job, int printer_descriptor) {
+	int pid;
+	prepare_stage_accounting(job);
+	if (job->stage_bytes == NULL && !replicate_path(job->conversion_path) && (pid = worker_pool_submit(job, printer_descriptor)) > 0) {
+		return pid;
+	}
+	return fork_job_leader(job, printer_descriptor);
+}
+
+/*
+ * Sizes the shared mappings the job's leader reports its stages in for the
+ * job's current path.  A job launched again, after a failed start, reuses the
+ * mappings it has when they are the right size, and unmaps them otherwise.
+ */
+void prepare_stage_accounting(JOB *job) {
+	int num_stages = count_links_in_conversion_path(job->conversion_path);
+	if (job->stage_usage != NULL && job->num_stages != num_stages) {
+		free_stage_usage(job->stage_usage, job->num_stages);
+		job->stage_usage = NULL;
+	}
+	job->num_stages = num_stages;
+	if (job->stage_usage == NULL && num_stages > 0) {
+		job->stage_usage = alloc_stage_usage(num_stages);
+	}
+	if (job->stage_bytes != NULL && (!pipeline_options.count || job->num_stage_counters != num_stages + 1)) {
+		free_stage_counters(job->stage_bytes, job->num_stage_counters);
+		job->stage_bytes = NULL;
+	}
+	if (pipeline_options.count && job->stage_bytes == NULL) {
+		job->num_stage_counters = num_stages + 1;
+		job->stage_bytes = alloc_stage_counters(job->num_stage_counters);
+	} else if (job->stage_bytes != NULL) {
+		memset(job->stage_bytes, 0, job->num_stage_counters * sizeof(uint64_t));
+	}
+}
+
+int fork_job_leader(JOB *job, int printer_descriptor) {
+	int pid;
+	CONVERSION **conversion_path = job->conversion_path;
 	if ((pid = fork()) == 0) {
 		setpgid(0, 0);
-		if (!unblock_sigterm_sigpipe()) {
+		close_printer_connections();
+		worker_pool_close();
+		journal_detach();
+		server_detach();
+		if (!unblock_child_signals()) {
 			exit(-1);
 		}
+		int exit_status = 0;
+		OUTPUT_CACHE_FILL fill = {0};
+		record_input_size(job->file, job->stage_bytes);
 		if (conversion_path[0] == NULL) {
-			print_no_conversion(job->file, printer_descriptor);
+			exit_status = print_no_conversion(job->file, printer_descriptor);
 		} else {
-			run_conversion_pipeline(job->file, printer_descriptor, conversion_path);
+			exit_status = run_conversion_pipeline(job->file, printer_descriptor, conversion_path, job->stage_bytes, job->stage_usage, &fill);
 		}
 		close(printer_descriptor);
-		int exit_status = reap_children();
+		int pipeline_status = reap_children(job->stage_usage, job->num_stages);
+		if (pipeline_status != 0) {
+			exit_status = pipeline_status;
+		}
+		output_cache_finish(&fill, exit_status == 0);
 		free_memory();
+		events_fini();
 		conversions_fini();
 		exit(exit_status);
 	}
-	setpgid(pid, pid);
-	close(printer_descriptor);
-	update_running_job_statuses(job, printer, conversion_path, pid);
-	job_id_to_pid[job->id] = pid;
+	if (pid != -1) {
+		setpgid(pid, pid);
+	}
+	return pid;
 }
 
-int unblock_sigterm_sigpipe() {
+/*
+ * The leader of a job with copies never goes to a pool worker, and its stages
+ * are not counted.
+ */
+int fork_copies_leader(JOB *job, int *printer_descriptors, CONVERSION ***paths, int num_printers) {
+	int pid;
+	if ((pid = fork()) == 0) {
+		setpgid(0, 0);
+		close_printer_connections();
+		worker_pool_close();
+		journal_detach();
+		server_detach();
+		if (!unblock_child_signals()) {
+			exit(-1);
+		}
+		int exit_status = run_fanout(job->file, paths, printer_descriptors, num_printers);
+		int pipeline_status = reap_children(NULL, 0);
+		if (pipeline_status != 0) {
+			exit_status = pipeline_status;
+		}
+		free_memory();
+		events_fini();
+		conversions_fini();
+		exit(exit_status);
+	}
+	if (pid != -1) {
+		setpgid(pid, pid);
+	}
+	return pid;
+}
+
+int unblock_child_signals() {
 	sigset_t old_mask, sigterm_mask;
 	sigemptyset(&sigterm_mask);
 	sigaddset(&sigterm_mask, SIGTERM);
 	sigaddset(&sigterm_mask, SIGPIPE);
+	sigaddset(&sigterm_mask, SIGCHLD);
 	if (sigprocmask(0, NULL, &old_mask) == -1 || sigprocmask(SIG_UNBLOCK, &sigterm_mask, &old_mask) == -1) {
 		return 0;
 	}
 	return 1;
 }
 
-void print_no_conversion(char *filename, int printer_descriptor) {
-	if (fork() == 0) {
-		int input = open(filename, O_RDONLY);
-		debug("file desc: %d", input);
-		if (input == -1) exit(1);
-		dup2(input, 0);
-		dup2(printer_descriptor, 1);
-		close(input);
-		close(printer_descriptor);
-		char *args[] = {"/bin/cat", NULL};
-		execvp(args[0], args);
-		exit(1);
-	}
+/*
+ * Runs in the job's leader process: the file is sent straight to the printer
+ * rather than through a forked cat.
+ */
+int print_no_conversion(char *filename, int printer_descriptor) {
+	return transfer_file(filename, printer_descriptor) ? 0 : 1;
 }
 
-void run_conversion_pipeline(char *filename, int printer_descriptor, CONVERSION **conversion_path) {
-	char **cmd_and_args;
-	int input, output, fds[2];
+/*
+ * Starts one process per conversion, or a replicated stage for a conversion
+ * with a "parallel" rule.  Depending on pipeline_options, the last
+ * stage writes into a relay that splices into the printer, and with counting
+ * enabled every stage is followed by a relay that records the bytes it output
+ * in stage_bytes[index + 1].  If usage is not NULL, usage[index] is started
+ * for every stage.  If fill is not NULL and the output cache is on, stages
+ * whose output is cached are skipped and the relays after the others store
+ * their output; the caller passes fill to output_cache_finish() once the
+ * stages are reaped.  Returns nonzero if a stage could not be started.  If a
+ * pipe cannot be made, the stages and relays already started are stopped.
+ */
+int run_conversion_pipeline(char *filename, int printer_descriptor, CONVERSION **conversion_path, uint64_t *stage_bytes, STAGE_USAGE *usage, OUTPUT_CACHE_FILL *fill) {
+	int input = -1, output, fds[2], relay_fds[2], pid;
+	int error = 0;
 	CONVERSION *conversion;
-	int index = 0;
+	int index = 0, first = 0;
+	REPLICATE_RULE *rule;
 	int num_links = count_links_in_conversion_path(conversion_path);
+	int caching = 0, relay_last, last;
+	int started[2 * num_links], num_started = 0;
+	char copy_path[PATH_MAX], *copy;
+	if (fill != NULL && (first = index = output_cache_start(fill, filename, conversion_path)) > 0) {
+		filename = fill->input;
+		if (first == num_links) {
+			return print_no_conversion(filename, printer_descriptor);
+		}
+	}
+	caching = fill != NULL && fill->num_stages > 0;
+	relay_last = pipeline_options.relay || stage_bytes != NULL || caching;
 	while ((conversion = conversion_path[index]) != NULL) {
-		pipe(fds);
-		output = fds[1];
-		if (fork() == 0) {
-			if (index == 0) input = open(filename, O_RDONLY);
-			if (input == -1) exit(1);
-			if (index == (num_links - 1)) close(fds[1]), output = printer_descriptor;
-			dup2(input, 0);
-			dup2(output, 1);
-			close(fds[0]);
-			close(input);
-			close(output);
-			if (index != (num_links - 1)) close(printer_descriptor);
-			cmd_and_args = conversion->cmd_and_args;
-			execvp(cmd_and_args[0], cmd_and_args);
-			exit(1);
+		last = index == (num_links - 1);
+		if (!last || relay_last) {
+			if (!make_pipeline_pipe(fds)) {
+				return stop_pipeline(started, num_started, index != first ? input : -1);
+			}
+			output = fds[1];
+		} else {
+			output = printer_descriptor;
+		}
+		if ((rule = replicate_rule(conversion)) != NULL) {
+			pid = start_replicated_stage(rule, conversion->cmd_and_args, index == first ? filename : NULL, input, output,
+				output != printer_descriptor ? fds[0] : -1, printer_descriptor);
+		} else {
+			pid = spawn_stage(conversion->cmd_and_args, index == first ? filename : NULL, input, output, output != printer_descriptor ? fds[0] : -1, printer_descriptor);
+		}
+		if (pid == -1) {
+			error = 1;
+		} else {
+			started[num_started++] = pid;
+			if (usage != NULL) {
+				stage_started(&usage[index], pid);
+			}
 		}
-		if (index != 0) close(input);
+		if (index != first) close(input);
+		if (output == printer_descriptor) break;
 		close(output);
 		input = fds[0];
+		copy = caching ? output_cache_temp_path(fill, index, copy_path) : NULL;
+		if (last) {
+			pid = start_relay(input, printer_descriptor, -1, printer_descriptor, stage_bytes != NULL ? &stage_bytes[index + 1] : NULL, copy);
+		} else if (stage_bytes != NULL || caching) {
+			if (!make_pipeline_pipe(relay_fds)) {
+				return stop_pipeline(started, num_started, input);
+			}
+			pid = start_relay(input, relay_fds[1], relay_fds[0], printer_descriptor, stage_bytes != NULL ? &stage_bytes[index + 1] : NULL, copy);
+			close(relay_fds[1]);
+			close(input);
+			input = relay_fds[0];
+		} else {
+			pid = 0;
+		}
+		if (pid == -1) {
+			error = 1;
+		} else if (pid != 0) {
+			started[num_started++] = pid;
+		}
 		index++;
 	}
-	close(input);
+	if (relay_last) close(input);
+	return error;
+}
 
+/*
+ * Closes the read end the pipeline had reached, if any, and terminates what
+ * it had started, for the leader to reap.  Returns the leader's exit status.
+ */
+int stop_pipeline(int *pids, int count, int input) {
+	if (input != -1) {
+		close(input);
+	}
+	for (int i = 0; i < count; i++) {
+		kill(pids[i], SIGTERM);
+	}
+	return 1;
+}
+
+/*
+ * Starts a stage with posix_spawn, which avoids copying the leader's page
+ * tables.  The stage reads filename if it is given and input otherwise.
+ * Returns the pid of the stage, or -1 if it could not be started.
+ */
+int spawn_stage(char **cmd_and_args, char *filename, int input, int output, int unused_read_end, int printer_descriptor) {
+	posix_spawn_file_actions_t actions;
+	int error, pid;
+	posix_spawn_file_actions_init(&actions);
+	if (filename != NULL) {
+		posix_spawn_file_actions_addopen(&actions, 0, filename, O_RDONLY, 0);
+	} else {
+		posix_spawn_file_actions_adddup2(&actions, input, 0);
+		posix_spawn_file_actions_addclose(&actions, input);
+	}
+	posix_spawn_file_actions_adddup2(&actions, output, 1);
+	if (output != printer_descriptor) {
+		posix_spawn_file_actions_addclose(&actions, unused_read_end);
+		posix_spawn_file_actions_addclose(&actions, output);
+	}
+	posix_spawn_file_actions_addclose(&actions, printer_descriptor);
+	error = posix_spawnp(&pid, cmd_and_args[0], &actions, NULL, cmd_and_args, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (error != 0) {
+		debug("Could not start %s: %s", cmd_and_args[0], strerror(error));
+		stats_count(STATS_STAGE_FAILURES);
+		return -1;
+	}
+	stats_stage_started(pid, cmd_and_args[0]);
+	return pid;
+}
+
+void record_input_size(char *filename, uint64_t *stage_bytes) {
+	struct stat file_stat;
+	if (stage_bytes != NULL && stat(filename, &file_stat) == 0) {
+		stage_bytes[0] = file_stat.st_size;
+	}
 }
 
 int count_links_in_conversion_path(CONVERSION **path) {
@@ -757,9 +2414,8 @@ void update_running_job_statuses(JOB *job, PRINTER *printer, CONVERSION **pipeli
 	get_command_names(pipeline, command_names);
 	sf_job_started(job->id, printer->name, pid, command_names);
 	job->status = JOB_RUNNING;
-	sf_job_status(job->id, JOB_RUNNING);
-	printer->status = PRINTER_BUSY;
-	sf_printer_status(printer->name, PRINTER_BUSY);
+	report_job_status(job);
+	set_printer_status(printer, PRINTER_BUSY);
 }
 
 void get_command_names(CONVERSION **pipeline, char **command_names) {
@@ -772,11 +2428,30 @@ void get_command_names(CONVERSION **pipeline, char **command_names) {
 	command_names[index] = NULL;
 }
 
-int reap_children() {
+/*
+ * Reaps every child of a job leader.  Each child is first waited for without
+ * reaping it, so that the I/O counters of a stage can still be read.
+ */
+int reap_children(STAGE_USAGE *usage, int num_stages) {
+	siginfo_t info;
+	struct rusage rusage;
+	STAGE_USAGE *stage;
 	int status, pid;
 	int error = 0;
-	while ((pid = wait(&status)) > 0) {
+	while (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) == 0) {
+		if ((stage = find_stage_usage(usage, num_stages, info.si_pid)) != NULL) {
+			read_stage_io(stage);
+		}
+		if ((pid = wait4(info.si_pid, &status, 0, &rusage)) <= 0) {
+			break;
+		}
 		debug("Child %d exiting with status %d\n", pid, status);
+		if (stage != NULL) {
+			record_stage_exit(stage, status, &rusage);
+			stats_stage_exited(pid, status != 0, stage->user_time + stage->system_time, stage->max_rss, stage->bytes_written);
+		} else {
+			stats_stage_exited(pid, status != 0, 0, 0, 0);
+		}
 		if (WIFSIGNALED(status)) {
 			error = WTERMSIG(status);
 		} else if (WIFEXITED(status) && (WEXITSTATUS(status) != 0)) {
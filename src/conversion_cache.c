@@ -0,0 +1,259 @@
+/*
+ * Imprimer: conversion path cache
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "conversion_cache.h"
+#include "debug.h"
+
+/*
+ * A cached path, with the links the caller sees at the end.  Invalidated
+ * paths may still be referenced by jobs, so they are freed only once the last
+ * of those releases them.
+ */
+typedef struct cached_path {
+	int references;
+	int retired;
+	CONVERSION *links[];
+} CACHED_PATH;
+
+#define PATH_HEADER(path) ((CACHED_PATH *) ((char *) (path) - offsetof(CACHED_PATH, links)))
+
+/*
+ * paths[from * capacity + to] is NULL until the pair has been searched, and
+ * points at no_path when the search found nothing.  filled holds the indices
+ * of the entries that are not NULL, so that invalidating the cache does not
+ * scan all of it.
+ */
+static CONVERSION ***paths;
+static int capacity;
+static CONVERSION *no_path[1];
+static int *filled;
+static int num_filled, filled_capacity;
+
+/*
+ * accepting[type] is only meaningful when accepting_valid[type] is set; both
+ * are indexed by FILE_TYPE.index and sized like the path cache.
+ */
+static BITSET *accepting;
+static char *accepting_valid;
+static FILE_TYPE **types;
+static int num_types, types_capacity;
+static FILE_TYPE **printer_types;
+static int num_printers, printers_capacity;
+
+static int grow_cache(int min_capacity) {
+	int new_capacity = capacity ? capacity : 8;
+	while (new_capacity <= min_capacity) {
+		new_capacity *= 2;
+	}
+	CONVERSION ***new_paths = calloc(new_capacity * new_capacity, sizeof(CONVERSION **));
+	BITSET *new_accepting = calloc(new_capacity, sizeof(BITSET));
+	char *new_accepting_valid = calloc(new_capacity, sizeof(char));
+	if (new_paths == NULL || new_accepting == NULL || new_accepting_valid == NULL) {
+		free(new_paths);
+		free(new_accepting);
+		free(new_accepting_valid);
+		return 0;
+	}
+	for (int from = 0; from < capacity; from++) {
+		memcpy(new_paths + from * new_capacity, paths + from * capacity, capacity * sizeof(CONVERSION **));
+	}
+	for (int i = 0; i < num_filled; i++) {
+		filled[i] = filled[i] / capacity * new_capacity + filled[i] % capacity;
+	}
+	if (capacity > 0) {
+		memcpy(new_accepting, accepting, capacity * sizeof(BITSET));
+		memcpy(new_accepting_valid, accepting_valid, capacity * sizeof(char));
+	}
+	free(paths);
+	free(accepting);
+	free(accepting_valid);
+	paths = new_paths;
+	accepting = new_accepting;
+	accepting_valid = new_accepting_valid;
+	capacity = new_capacity;
+	return 1;
+}
+
+/*
+ * Moves the path find_conversion_path() returned behind a header.
+ */
+static CONVERSION **cache_path(CONVERSION **path) {
+	CACHED_PATH *cached;
+	int length = 0;
+	while (path[length] != NULL) {
+		length++;
+	}
+	if ((cached = malloc(sizeof(CACHED_PATH) + (length + 1) * sizeof(CONVERSION *))) == NULL) {
+		free(path);
+		return NULL;
+	}
+	cached->references = 0;
+	cached->retired = 0;
+	memcpy(cached->links, path, (length + 1) * sizeof(CONVERSION *));
+	free(path);
+	return cached->links;
+}
+
+static void retire_path(CONVERSION **path) {
+	CACHED_PATH *cached = PATH_HEADER(path);
+	if (cached->references == 0) {
+		free(cached);
+	} else {
+		cached->retired = 1;
+	}
+}
+
+CONVERSION **cached_conversion_path(FILE_TYPE *from, FILE_TYPE *to) {
+	CONVERSION ***entry;
+	CONVERSION **path;
+	int max_index = from->index > to->index ? from->index : to->index;
+	if (max_index >= capacity && !grow_cache(max_index)) {
+		return NULL;
+	}
+	entry = &paths[from->index * capacity + to->index];
+	if (*entry == NULL) {
+		if (num_filled == filled_capacity) {
+			filled_capacity = filled_capacity ? filled_capacity * 2 : 64;
+			filled = realloc(filled, filled_capacity * sizeof(int));
+		}
+		path = find_conversion_path(from->name, to->name);
+		*entry = path != NULL ? cache_path(path) : NULL;
+		if (*entry == NULL) {
+			*entry = no_path;
+		}
+		filled[num_filled++] = entry - paths;
+	}
+	return *entry == no_path ? NULL : *entry;
+}
+
+/*
+ * A job holds the path it runs, so that the path outlives an invalidation
+ * of the cache for as long as the job may report on it.
+ */
+void conversion_path_hold(CONVERSION **path) {
+	if (path != NULL) {
+		PATH_HEADER(path)->references++;
+	}
+}
+
+void conversion_path_release(CONVERSION **path) {
+	CACHED_PATH *cached;
+	if (path == NULL) {
+		return;
+	}
+	cached = PATH_HEADER(path);
+	if (--cached->references == 0 && cached->retired) {
+		free(cached);
+	}
+}
+
+void conversion_cache_invalidate() {
+	CONVERSION ***entry;
+	for (int i = 0; i < num_filled; i++) {
+		entry = &paths[filled[i]];
+		if (*entry != no_path) {
+			retire_path(*entry);
+		}
+		*entry = NULL;
+	}
+	num_filled = 0;
+	if (capacity > 0) {
+		memset(accepting_valid, 0, capacity * sizeof(char));
+	}
+}
+
+void conversion_cache_fini() {
+	conversion_cache_invalidate();
+	for (int i = 0; i < capacity; i++) {
+		bitset_free(&accepting[i]);
+	}
+	free(paths);
+	free(filled);
+	free(accepting);
+	free(accepting_valid);
+	free(types);
+	free(printer_types);
+	paths = NULL;
+	filled = NULL;
+	num_filled = filled_capacity = 0;
+	accepting = NULL;
+	accepting_valid = NULL;
+	capacity = 0;
+	types = NULL;
+	num_types = types_capacity = 0;
+	printer_types = NULL;
+	num_printers = printers_capacity = 0;
+}
+
+void routing_add_type(FILE_TYPE *type) {
+	for (int i = 0; i < num_types; i++) {
+		if (types[i] == type) return;
+	}
+	if (num_types == types_capacity) {
+		types_capacity = types_capacity ? types_capacity * 2 : 16;
+		types = realloc(types, types_capacity * sizeof(FILE_TYPE *));
+	}
+	types[num_types++] = type;
+}
+
+void routing_add_printer(int id, FILE_TYPE *type) {
+	if (id >= printers_capacity) {
+		int new_capacity = printers_capacity ? printers_capacity : MAX_PRINTERS;
+		while (new_capacity <= id) {
+			new_capacity *= 2;
+		}
+		printer_types = realloc(printer_types, new_capacity * sizeof(FILE_TYPE *));
+		printers_capacity = new_capacity;
+	}
+	printer_types[id] = type;
+	if (id >= num_printers) {
+		num_printers = id + 1;
+	}
+	if (capacity > 0) {
+		memset(accepting_valid, 0, capacity * sizeof(char));
+	}
+}
+
+/*
+ * The bitmap is looked up again after every path, since finding one for a
+ * printer of a newer type grows the cache and moves accepting.
+ */
+BITSET *printers_accepting(FILE_TYPE *type) {
+	static BITSET none;
+	if (type->index >= capacity && !grow_cache(type->index)) {
+		return &none;
+	}
+	if (accepting_valid[type->index]) {
+		return &accepting[type->index];
+	}
+	bitset_reset(&accepting[type->index]);
+	for (int id = 0; id < num_printers; id++) {
+		if (cached_conversion_path(type, printer_types[id]) != NULL) {
+			bitset_set(&accepting[type->index], id);
+		}
+	}
+	accepting_valid[type->index] = 1;
+	return &accepting[type->index];
+}
+
+/*
+ * Runs the search for every pair of defined types, so that the scheduler never
+ * has to search for a path once the definitions have been loaded.
+ */
+void routing_precompute() {
+	for (int from = 0; from < num_types; from++) {
+		for (int to = 0; to < num_types; to++) {
+			cached_conversion_path(types[from], types[to]);
+		}
+		printers_accepting(types[from]);
+	}
+}
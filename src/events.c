@@ -0,0 +1,173 @@
+/*
+ * Imprimer: epoll based event loop
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+
+#include "events.h"
+#include "debug.h"
+
+#define MAX_EVENTS 32
+
+static int epoll_fd = -1;
+static EVENT_SOURCE *sources;
+static int dispatch_depth;      /* Handlers such as "wait" dispatch from inside a dispatch. */
+
+int events_init() {
+	if (epoll_fd != -1) {
+		return 1;
+	}
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Only closes descriptors, since the epoll instance may be shared with a forked
+ * parent whose interest list must not be touched.
+ */
+void events_fini() {
+	EVENT_SOURCE *source;
+	while ((source = sources) != NULL) {
+		sources = source->next;
+		if (source->is_signal) {
+			close(source->fd);
+		}
+		free(source);
+	}
+	if (epoll_fd != -1) {
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+}
+
+EVENT_SOURCE *events_add(int fd, event_handler_t *handler, void *data) {
+	struct epoll_event event;
+	EVENT_SOURCE *source = malloc(sizeof(EVENT_SOURCE));
+	if (source == NULL) {
+		return NULL;
+	}
+	source->fd = fd;
+	source->is_signal = 0;
+	source->handler = handler;
+	source->data = data;
+	source->removed = 0;
+	source->events = EPOLLIN;
+	event.events = EPOLLIN;
+	event.data.ptr = source;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+		free(source);
+		return NULL;
+	}
+	source->next = sources;
+	sources = source;
+	return source;
+}
+
+EVENT_SOURCE *events_add_signal(int signum, event_handler_t *handler, void *data) {
+	sigset_t mask;
+	int fd;
+	EVENT_SOURCE *source;
+	sigemptyset(&mask);
+	sigaddset(&mask, signum);
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+		return NULL;
+	}
+	if ((fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+		return NULL;
+	}
+	if ((source = events_add(fd, handler, data)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	source->is_signal = 1;
+	return source;
+}
+
+/*
+ * Stops or resumes polling a source without freeing it.  The descriptor is
+ * taken out of the interest list, since hangups are reported even with no
+ * events requested.
+ */
+int events_set_enabled(EVENT_SOURCE *source, int enabled) {
+	struct epoll_event event;
+	if (!enabled) {
+		return epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL) == 0;
+	}
+	event.events = source->events;
+	event.data.ptr = source;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->fd, &event) == 0;
+}
+
+/*
+ * Chooses whether the handler runs when the descriptor is readable, writable
+ * or both, so that a source with output waiting to be sent can stop taking
+ * input until it drains.  Only for enabled sources.
+ */
+int events_set_interest(EVENT_SOURCE *source, int input, int output) {
+	struct epoll_event event;
+	source->events = event.events = (input ? EPOLLIN : 0) | (output ? EPOLLOUT : 0);
+	event.data.ptr = source;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, source->fd, &event) == 0;
+}
+
+void events_remove(EVENT_SOURCE *source) {
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+	if (source->is_signal) {
+		close(source->fd);
+	}
+	source->removed = 1;
+}
+
+static void drain_signal_fd(int fd) {
+	struct signalfd_siginfo info;
+	while (read(fd, &info, sizeof(info)) == sizeof(info));
+}
+
+static void free_removed_sources() {
+	EVENT_SOURCE **link = &sources;
+	EVENT_SOURCE *source;
+	while ((source = *link) != NULL) {
+		if (source->removed) {
+			*link = source->next;
+			free(source);
+		} else {
+			link = &source->next;
+		}
+	}
+}
+
+/*
+ * Waits up to timeout milliseconds (-1 blocks) and runs the handler of every
+ * ready source.  Returns the number of sources handled, or -1 on error.
+ * Removed sources are freed only when the outermost dispatch returns, since
+ * an enclosing dispatch may still hold events that point at them.
+ */
+int events_dispatch(int timeout) {
+	struct epoll_event events[MAX_EVENTS];
+	EVENT_SOURCE *source;
+	int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+	if (ready == -1) {
+		return errno == EINTR ? 0 : -1;
+	}
+	dispatch_depth++;
+	for (int i = 0; i < ready; i++) {
+		source = events[i].data.ptr;
+		if (source->removed) continue;
+		if (source->is_signal) {
+			drain_signal_fd(source->fd);
+		}
+		source->handler(source->fd, source->data);
+	}
+	if (--dispatch_depth == 0) {
+		free_removed_sources();
+	}
+	return ready;
+}
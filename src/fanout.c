@@ -0,0 +1,317 @@
+/*
+ * Imprimer: one job printed to several printers
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "pipeline.h"
+#include "transfer.h"
+#include "fanout.h"
+#include "util.h"
+#include "debug.h"
+
+/*
+ * A node is the output of one stage, or of the file at the root.  Its
+ * consumers are the stages below it and the printers whose path ends there.
+ */
+typedef struct fan_node {
+	CONVERSION *conversion;
+	struct fan_node *first_child;
+	struct fan_node *next_sibling;
+	int num_children;
+	int printers[FANOUT_MAX_COPIES];
+	int num_printers;
+} FAN_NODE;
+
+typedef struct fanout {
+	FAN_NODE *nodes;
+	int num_nodes;
+	int *fds;               /* Every descriptor the leader holds open. */
+	int num_fds;
+	int fds_capacity;
+	int error;
+} FANOUT;
+
+static void track_fd(FANOUT *fanout, int fd) {
+	int *fds;
+	if (fanout->num_fds == fanout->fds_capacity) {
+		fanout->fds_capacity = fanout->fds_capacity ? fanout->fds_capacity * 2 : 16;
+		if ((fds = realloc(fanout->fds, fanout->fds_capacity * sizeof(int))) == NULL) {
+			fanout->error = 1;
+			return;
+		}
+		fanout->fds = fds;
+	}
+	fanout->fds[fanout->num_fds++] = fd;
+}
+
+/*
+ * Every pipe is close-on-exec, so that the stages only get the ends that are
+ * passed to them.
+ */
+static int make_fan_pipe(FANOUT *fanout, int fds[2]) {
+	if (pipe2(fds, O_CLOEXEC) == -1) {
+		fanout->error = 1;
+		return 0;
+	}
+	if (pipeline_options.pipe_size > 0 && fcntl(fds[1], F_SETPIPE_SZ, pipeline_options.pipe_size) == -1) {
+		debug("Could not resize pipe to %d bytes", pipeline_options.pipe_size);
+	}
+	track_fd(fanout, fds[0]);
+	track_fd(fanout, fds[1]);
+	return 1;
+}
+
+static FAN_NODE *find_child(FANOUT *fanout, FAN_NODE *parent, CONVERSION *conversion) {
+	FAN_NODE *child;
+	for (child = parent->first_child; child != NULL; child = child->next_sibling) {
+		if (child->conversion == conversion) {
+			return child;
+		}
+	}
+	child = &fanout->nodes[fanout->num_nodes++];
+	memset(child, 0, sizeof(FAN_NODE));
+	child->conversion = conversion;
+	child->next_sibling = parent->first_child;
+	parent->first_child = child;
+	parent->num_children++;
+	return child;
+}
+
+/*
+ * Moves length bytes out of the pipe input, copying them through buffer if
+ * output does not take a splice.
+ */
+static int move_bytes(int input, int output, size_t length, char *buffer) {
+	ssize_t moved;
+	while (length > 0) {
+		moved = splice(input, NULL, output, NULL, length, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (moved == -1 && errno == EINTR) continue;
+		if (moved == -1 && errno == EINVAL) {
+			moved = length < FANOUT_CHUNK ? length : FANOUT_CHUNK;
+			if (!read_exactly(input, buffer, moved) || !write_all(output, buffer, moved)) {
+				return 0;
+			}
+		} else if (moved <= 0) {
+			return 0;
+		}
+		length -= moved;
+	}
+	return 1;
+}
+
+/*
+ * Reads the next chunk of a file into the pipe.  Returns its length, 0 at the
+ * end of the file or -1.
+ */
+static ssize_t fill_pipe(int input, int output, char *buffer) {
+	ssize_t bytes;
+	while ((bytes = splice(input, NULL, output, NULL, FANOUT_CHUNK, SPLICE_F_MOVE)) == -1 && errno == EINTR);
+	if (bytes == -1 && errno == EINVAL) {
+		while ((bytes = read(input, buffer, FANOUT_CHUNK)) == -1 && errno == EINTR);
+		if (bytes > 0 && !write_all(output, buffer, bytes)) {
+			return -1;
+		}
+	}
+	return bytes;
+}
+
+/*
+ * Writes everything read from input to each of the outputs.  A chunk in the
+ * source pipe is teed into a scratch pipe and spliced out once for every
+ * output but the last, which gets the chunk itself.  If tee(2) cannot
+ * duplicate a whole chunk, the rest of it is copied through user space.
+ */
+static int fan_out(int input, int *outputs, int num_outputs) {
+	char buffer[FANOUT_CHUNK];
+	int source[2], scratch[2], from = input, k;
+	ssize_t length, teed;
+	struct stat info;
+	if (num_outputs == 1) {
+		return transfer_fd(input, outputs[0]);
+	}
+	if (fstat(input, &info) == -1) {
+		return 0;
+	}
+	if (!S_ISFIFO(info.st_mode)) {
+		if (pipe(source) == -1) {
+			return 0;
+		}
+		from = source[0];
+	}
+	if (pipe(scratch) == -1) {
+		return 0;
+	}
+	while (1) {
+		if (from != input) {
+			if ((length = fill_pipe(input, source[1], buffer)) <= 0) {
+				return length == 0;
+			}
+			teed = tee(from, scratch[1], length, 0);
+		} else {
+			// The first tee waits for data and sizes the chunk.
+			if ((teed = tee(from, scratch[1], FANOUT_CHUNK, 0)) == -1 && errno == EINTR) continue;
+			if (teed <= 0) {
+				return teed == 0;
+			}
+			length = teed;
+		}
+		for (k = 0; k < num_outputs - 1; k++) {
+			if (k > 0) {
+				teed = tee(from, scratch[1], length, 0);
+			}
+			if (teed < length) break;
+			if (!move_bytes(scratch[0], outputs[k], length, buffer)) {
+				return 0;
+			}
+		}
+		if (k == num_outputs - 1) {
+			if (!move_bytes(from, outputs[k], length, buffer)) {
+				return 0;
+			}
+			continue;
+		}
+		if (teed < 0) {
+			teed = 0;
+		}
+		if ((teed > 0 && !move_bytes(scratch[0], outputs[k], teed, buffer)) || !read_exactly(from, buffer, length)
+			|| !write_all(outputs[k], buffer + teed, length - teed)) {
+			return 0;
+		}
+		for (k++; k < num_outputs; k++) {
+			if (!write_all(outputs[k], buffer, length)) {
+				return 0;
+			}
+		}
+	}
+}
+
+/*
+ * Forks a fan process, which first closes whatever the leader holds apart
+ * from its own descriptors.
+ */
+static void start_fan(FANOUT *fanout, int input, int *outputs, int num_outputs) {
+	int pid, keep;
+	if ((pid = fork()) == 0) {
+		for (int i = 0; i < fanout->num_fds; i++) {
+			keep = fanout->fds[i] == input;
+			for (int j = 0; j < num_outputs; j++) {
+				keep |= fanout->fds[i] == outputs[j];
+			}
+			if (!keep) close(fanout->fds[i]);
+		}
+		_exit(fan_out(input, outputs, num_outputs) ? 0 : 1);
+	}
+	if (pid == -1) {
+		fanout->error = 1;
+	}
+}
+
+static void start_consumers(FANOUT *fanout, FAN_NODE *node, char *filename, int input);
+
+/*
+ * Starts the stage of node, reading filename if it is given and input
+ * otherwise.  A stage with a single printer writes straight to it.
+ */
+static void start_stage(FANOUT *fanout, FAN_NODE *node, char *filename, int input) {
+	int fds[2], output, direct = node->num_children == 0 && node->num_printers == 1;
+	if (direct) {
+		output = node->printers[0];
+	} else if (make_fan_pipe(fanout, fds)) {
+		output = fds[1];
+	} else {
+		return;
+	}
+	if (spawn_stage(node->conversion->cmd_and_args, filename, input, output, -1, output) == -1) {
+		fanout->error = 1;
+	}
+	if (!direct) {
+		start_consumers(fanout, node, NULL, fds[0]);
+	}
+}
+
+/*
+ * Starts everything that reads the output of node, which is the file if
+ * filename is given and the pipe input otherwise.
+ */
+static void start_consumers(FANOUT *fanout, FAN_NODE *node, char *filename, int input) {
+	int outputs[FANOUT_MAX_COPIES], inputs[FANOUT_MAX_COPIES], fds[2], num_outputs = 0;
+	FAN_NODE *child;
+	if (node->num_printers == 0 && node->num_children == 1) {
+		start_stage(fanout, node->first_child, filename, input);
+		return;
+	}
+	for (child = node->first_child; child != NULL; child = child->next_sibling) {
+		if (!make_fan_pipe(fanout, fds)) {
+			return;
+		}
+		inputs[num_outputs] = fds[0];
+		outputs[num_outputs++] = fds[1];
+	}
+	for (int i = 0; i < node->num_printers; i++) {
+		outputs[num_outputs++] = node->printers[i];
+	}
+	if (filename != NULL) {
+		if ((input = open(filename, O_RDONLY | O_CLOEXEC)) == -1) {
+			fanout->error = 1;
+			return;
+		}
+		track_fd(fanout, input);
+	}
+	start_fan(fanout, input, outputs, num_outputs);
+	child = node->first_child;
+	for (int i = 0; child != NULL; i++, child = child->next_sibling) {
+		start_stage(fanout, child, NULL, inputs[i]);
+	}
+}
+
+/*
+ * Runs in the job's leader process.  paths[i] is the conversion path to the
+ * printer connected on printer_descriptors[i].  Starts the stages and fan
+ * processes, then closes the leader's descriptors, so the caller only has to
+ * reap its children.  Returns nonzero if something could not be started.
+ */
+int run_fanout(char *filename, CONVERSION ***paths, int *printer_descriptors, int num_printers) {
+	FANOUT fanout;
+	FAN_NODE root, *node;
+	int num_nodes = 0;
+	if (num_printers < 1 || num_printers > FANOUT_MAX_COPIES) {
+		return 1;
+	}
+	memset(&fanout, 0, sizeof(fanout));
+	memset(&root, 0, sizeof(root));
+	for (int i = 0; i < num_printers; i++) {
+		num_nodes += count_links_in_conversion_path(paths[i]);
+	}
+	if (num_nodes > 0 && (fanout.nodes = malloc(num_nodes * sizeof(FAN_NODE))) == NULL) {
+		return 1;
+	}
+	for (int i = 0; i < num_printers; i++) {
+		fcntl(printer_descriptors[i], F_SETFD, FD_CLOEXEC);
+		track_fd(&fanout, printer_descriptors[i]);
+		node = &root;
+		for (int j = 0; paths[i][j] != NULL; j++) {
+			node = find_child(&fanout, node, paths[i][j]);
+		}
+		node->printers[node->num_printers++] = printer_descriptors[i];
+	}
+	debug("Fan-out of %s to %d printers through %d stages", filename, num_printers, fanout.num_nodes);
+	start_consumers(&fanout, &root, filename, -1);
+	for (int i = 0; i < fanout.num_fds; i++) {
+		close(fanout.fds[i]);
+	}
+	free(fanout.fds);
+	free(fanout.nodes);
+	return fanout.error;
+}
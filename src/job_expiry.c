@@ -0,0 +1,101 @@
+/*
+ * Imprimer: expiry of finished jobs
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "job_expiry.h"
+#include "util.h"
+
+static JOB *expiry_head, *expiry_tail;
+static double retention = DEFAULT_JOB_RETENTION;
+static int timer_fd = -1;
+
+/*
+ * Only applies to jobs that finish after the change.
+ */
+void set_job_retention(double seconds) {
+	retention = seconds;
+}
+
+double job_retention() {
+	return retention;
+}
+
+void job_expiry_add(JOB *job) {
+	job->expires_at = current_time() + retention;
+	job->next_expiring = NULL;
+	if (expiry_tail != NULL && expiry_tail->expires_at > job->expires_at) {
+		// The retention was shortened; keep the queue sorted.
+		JOB **link = &expiry_head;
+		while ((*link)->expires_at <= job->expires_at) {
+			link = &(*link)->next_expiring;
+		}
+		job->next_expiring = *link;
+		*link = job;
+		return;
+	}
+	if (expiry_tail != NULL) {
+		expiry_tail->next_expiring = job;
+	} else {
+		expiry_head = job;
+	}
+	expiry_tail = job;
+}
+
+JOB *job_expiry_pop_due(double now) {
+	JOB *job = expiry_head;
+	if (job == NULL || job->expires_at > now) {
+		return NULL;
+	}
+	if ((expiry_head = job->next_expiring) == NULL) {
+		expiry_tail = NULL;
+	}
+	job->next_expiring = NULL;
+	return job;
+}
+
+int job_expiry_timer() {
+	if (timer_fd == -1) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	}
+	return timer_fd;
+}
+
+/*
+ * Arms the timer for the head of the queue, or disarms it if the queue is
+ * empty.
+ */
+void job_expiry_arm(double now) {
+	struct itimerspec timer;
+	double delay;
+	if (timer_fd == -1) {
+		return;
+	}
+	memset(&timer, 0, sizeof(timer));
+	if (expiry_head != NULL) {
+		delay = expiry_head->expires_at - now;
+		if (delay < 1e-6) {
+			delay = 1e-6;
+		}
+		timer.it_value.tv_sec = (time_t) delay;
+		timer.it_value.tv_nsec = (long) ((delay - timer.it_value.tv_sec) * 1e9);
+		if (timer.it_value.tv_sec == 0 && timer.it_value.tv_nsec == 0) {
+			timer.it_value.tv_nsec = 1;
+		}
+	}
+	timerfd_settime(timer_fd, 0, &timer, NULL);
+}
+
+void job_expiry_fini() {
+	expiry_head = expiry_tail = NULL;
+}
@@ -0,0 +1,374 @@
+/*
+ * Imprimer: waiting job queue
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "name_index.h"
+#include "job_queue.h"
+#include "util.h"
+
+/*
+ * Per owner state for fair share: the virtual time at which the owner's next
+ * job starts, and how many of the owner's jobs have been queued and not yet
+ * ended.
+ */
+typedef struct owner {
+	char *name;
+	double next_start;
+	int active;
+} OWNER;
+
+/*
+ * Waiting jobs with the same type, eligible printers and copies can start on
+ * exactly the same printers, so they share a class with a heap of its own.
+ * A dispatch pass only looks at the head of each class, and a class whose
+ * head cannot start is skipped for the rest of the pass, so jobs that no
+ * idle printer can take cost nothing.
+ */
+typedef struct job_class {
+	char *key;
+	JOB **heap;
+	int size;
+	int capacity;
+	int active_index;       /* In active_classes, or -1 while empty. */
+	unsigned long blocked_pass;
+} JOB_CLASS;
+
+QUEUE_OPTIONS queue_options = {60, 0, 1};
+
+static NAME_INDEX class_index;
+static JOB_CLASS **classes;
+static int num_classes;
+static JOB_CLASS **active_classes;
+static int num_active_classes;
+static int num_waiting;
+static unsigned long pass = 1;
+static JOB **deferred;
+static int num_deferred, deferred_capacity;
+static NAME_INDEX owner_index;
+static OWNER **owners;
+static int num_owners;
+
+static int parse_seconds(char *value, double *result) {
+	char *end;
+	double seconds = strtod(value, &end);
+	if (*value == '\0' || *end != '\0' || seconds < 0) {
+		return 0;
+	}
+	*result = seconds;
+	return 1;
+}
+
+static void set_aging(double aging);
+
+/*
+ * Accepts one "name=value" option.
+ *
+ * @return 1 if the option was recognized and applied, 0 otherwise.
+ */
+int set_queue_option(char *option) {
+	char *value = strchr(option, '=');
+	double aging;
+	if (value == NULL) {
+		return 0;
+	}
+	*value++ = '\0';
+	if (strcmp(option, "aging") == 0) {
+		if (!parse_seconds(value, &aging)) {
+			return 0;
+		}
+		set_aging(aging);
+		return 1;
+	} else if (strcmp(option, "quantum") == 0) {
+		return parse_seconds(value, &queue_options.quantum);
+	} else if (strcmp(option, "fairshare") == 0) {
+		if (strcmp(value, "on") == 0) {
+			queue_options.fairshare = 1;
+		} else if (strcmp(value, "off") == 0) {
+			queue_options.fairshare = 0;
+		} else {
+			return 0;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+void print_queue_options(FILE *out) {
+	fprintf(out, "QUEUE: waiting=%d, aging=%g, fairshare=%s, quantum=%g\n", num_waiting, queue_options.aging,
+		queue_options.fairshare ? "on" : "off", queue_options.quantum);
+}
+
+/*
+ * Returns the interned name of an owner, so jobs can share it.
+ */
+char *job_queue_owner(char *name) {
+	OWNER *owner = name_index_get(&owner_index, name);
+	if (owner != NULL) {
+		return owner->name;
+	}
+	owner = malloc(sizeof(OWNER));
+	owner->name = malloc(strlen(name) + 1);
+	strcpy(owner->name, name);
+	owner->next_start = 0;
+	owner->active = 0;
+	owners = realloc(owners, (num_owners + 1) * sizeof(OWNER *));
+	owners[num_owners++] = owner;
+	name_index_put(&owner_index, owner->name, owner);
+	return owner->name;
+}
+
+/*
+ * A job's base is its submission time, or under fair share the later of that
+ * and the owner's virtual time.  Each priority level is worth queue_options.aging
+ * seconds of waiting, so low priority jobs are not starved.  An owner whose
+ * jobs have all ended starts again from the present, so a burst of jobs is
+ * not held against it once they are done.
+ */
+static void assign_rank(JOB *job) {
+	double now = current_time();
+	double base = now;
+	OWNER *owner;
+	if (job->owner != NULL && (owner = name_index_get(&owner_index, job->owner)) != NULL) {
+		if (owner->active++ == 0) {
+			owner->next_start = now;
+		}
+		if (queue_options.fairshare) {
+			if (owner->next_start > base) {
+				base = owner->next_start;
+			}
+			owner->next_start = base + queue_options.quantum;
+		}
+	}
+	job->rank = base - job->priority * queue_options.aging;
+}
+
+/*
+ * Called when a job that was queued has finished or been aborted.
+ */
+void job_queue_job_ended(JOB *job) {
+	OWNER *owner;
+	if (job->job_class != NULL && job->owner != NULL && (owner = name_index_get(&owner_index, job->owner)) != NULL
+			&& owner->active > 0) {
+		owner->active--;
+	}
+}
+
+static int before(JOB *a, JOB *b) {
+	if (queue_options.aging == 0 && a->priority != b->priority) {
+		return a->priority > b->priority;
+	}
+	if (a->rank != b->rank) {
+		return a->rank < b->rank;
+	}
+	return a->submission < b->submission;
+}
+
+static void place(JOB_CLASS *class, JOB *job, int index) {
+	class->heap[index] = job;
+	job->heap_index = index;
+}
+
+static void sift_up(JOB_CLASS *class, int index) {
+	JOB *job = class->heap[index];
+	int parent;
+	while (index > 0 && before(job, class->heap[parent = (index - 1) / 2])) {
+		place(class, class->heap[parent], index);
+		index = parent;
+	}
+	place(class, job, index);
+}
+
+static void sift_down(JOB_CLASS *class, int index) {
+	JOB *job = class->heap[index];
+	int child;
+	while ((child = 2 * index + 1) < class->size) {
+		if (child + 1 < class->size && before(class->heap[child + 1], class->heap[child])) {
+			child++;
+		}
+		if (!before(class->heap[child], job)) {
+			break;
+		}
+		place(class, class->heap[child], index);
+		index = child;
+	}
+	place(class, job, index);
+}
+
+/*
+ * Ranks are fixed when a job is queued, using the aging setting of the time,
+ * so a new setting re-ranks the waiting jobs and rebuilds every heap.  Zero
+ * aging also changes the order itself, to strict priority.
+ */
+static void set_aging(double aging) {
+	JOB_CLASS *class;
+	for (int i = 0; i < num_active_classes; i++) {
+		class = active_classes[i];
+		for (int j = 0; j < class->size; j++) {
+			class->heap[j]->rank += class->heap[j]->priority * (queue_options.aging - aging);
+		}
+	}
+	for (int i = 0; i < num_deferred; i++) {
+		deferred[i]->rank += deferred[i]->priority * (queue_options.aging - aging);
+	}
+	queue_options.aging = aging;
+	for (int i = 0; i < num_active_classes; i++) {
+		class = active_classes[i];
+		for (int j = class->size / 2 - 1; j >= 0; j--) {
+			sift_down(class, j);
+		}
+	}
+}
+
+/*
+ * The key is the type's index, the copies flag and the eligible bitmap.
+ */
+static JOB_CLASS *find_class(JOB *job) {
+	JOB_CLASS *class;
+	char *key;
+	size_t length;
+	FILE *stream = open_memstream(&key, &length);
+	fprintf(stream, "%d,%d,", job->type->index, job->copies != 0);
+	bitset_print(stream, &job->eligible);
+	fclose(stream);
+	if ((class = name_index_get(&class_index, key)) != NULL) {
+		free(key);
+		return class;
+	}
+	class = calloc(1, sizeof(JOB_CLASS));
+	class->key = key;
+	class->active_index = -1;
+	classes = realloc(classes, (num_classes + 1) * sizeof(JOB_CLASS *));
+	classes[num_classes++] = class;
+	active_classes = realloc(active_classes, num_classes * sizeof(JOB_CLASS *));
+	name_index_put(&class_index, class->key, class);
+	return class;
+}
+
+static void insert(JOB *job) {
+	JOB_CLASS *class = job->job_class;
+	if (class->size == class->capacity) {
+		class->capacity = class->capacity ? class->capacity * 2 : 64;
+		class->heap = realloc(class->heap, class->capacity * sizeof(JOB *));
+	}
+	if (class->size == 0) {
+		class->active_index = num_active_classes;
+		active_classes[num_active_classes++] = class;
+	}
+	place(class, job, class->size++);
+	sift_up(class, job->heap_index);
+	num_waiting++;
+}
+
+void job_queue_push(JOB *job) {
+	assign_rank(job);
+	job->job_class = find_class(job);
+	insert(job);
+}
+
+void job_queue_remove(JOB *job) {
+	JOB_CLASS *class = job->job_class;
+	int index = job->heap_index;
+	if (class == NULL || index < 0 || index >= class->size || class->heap[index] != job) {
+		return;
+	}
+	job->heap_index = -1;
+	num_waiting--;
+	if (index != --class->size) {
+		JOB *moved = class->heap[class->size];
+		place(class, moved, index);
+		sift_down(class, index);
+		sift_up(class, moved->heap_index);
+	}
+	if (class->size == 0) {
+		active_classes[class->active_index] = active_classes[--num_active_classes];
+		active_classes[class->active_index]->active_index = class->active_index;
+		class->active_index = -1;
+	}
+}
+
+/*
+ * Pops the first job, in queue order, for which can_start() holds.  Only the
+ * head of each class is offered to can_start(), and a class whose head is
+ * refused is not offered again until job_queue_restore() ends the pass.
+ * Costs one call per class with waiting jobs, plus O(log n) for the pop.
+ */
+JOB *job_queue_pop_startable(int (*can_start)(JOB *job)) {
+	JOB_CLASS *class, *best = NULL;
+	JOB *job;
+	for (int i = 0; i < num_active_classes; i++) {
+		class = active_classes[i];
+		if (class->blocked_pass == pass || (best != NULL && !before(class->heap[0], best->heap[0]))) {
+			continue;
+		}
+		if (!can_start(class->heap[0])) {
+			class->blocked_pass = pass;
+			continue;
+		}
+		best = class;
+	}
+	if (best == NULL) {
+		return NULL;
+	}
+	job = best->heap[0];
+	job_queue_remove(job);
+	return job;
+}
+
+/*
+ * Sets aside a popped job that could not be started, keeping its rank, until
+ * job_queue_restore() is called.
+ */
+void job_queue_defer(JOB *job) {
+	if (num_deferred == deferred_capacity) {
+		deferred_capacity = deferred_capacity ? deferred_capacity * 2 : 64;
+		deferred = realloc(deferred, deferred_capacity * sizeof(JOB *));
+	}
+	deferred[num_deferred++] = job;
+}
+
+/*
+ * Puts the deferred jobs back and ends the dispatch pass.
+ */
+void job_queue_restore() {
+	for (int i = 0; i < num_deferred; i++) {
+		insert(deferred[i]);
+	}
+	num_deferred = 0;
+	pass++;
+}
+
+int job_queue_size() {
+	return num_waiting;
+}
+
+void job_queue_fini() {
+	for (int i = 0; i < num_classes; i++) {
+		free(classes[i]->key);
+		free(classes[i]->heap);
+		free(classes[i]);
+	}
+	free(classes);
+	free(active_classes);
+	free(deferred);
+	classes = active_classes = NULL;
+	deferred = NULL;
+	num_classes = num_active_classes = num_waiting = num_deferred = deferred_capacity = 0;
+	name_index_fini(&class_index);
+	for (int i = 0; i < num_owners; i++) {
+		free(owners[i]->name);
+		free(owners[i]);
+	}
+	free(owners);
+	owners = NULL;
+	num_owners = 0;
+	name_index_fini(&owner_index);
+}
@@ -0,0 +1,106 @@
+/*
+ * Imprimer: job table
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "job_table.h"
+
+static JOB **slabs;
+static int num_slabs, slabs_capacity;
+static int next_unused_id;
+static JOB *free_jobs_head;
+static int num_free_jobs;
+static unsigned long submissions;
+
+static int add_slab() {
+	JOB *slab;
+	if (num_slabs == slabs_capacity) {
+		int new_capacity = slabs_capacity ? slabs_capacity * 2 : 4;
+		JOB **new_slabs = realloc(slabs, new_capacity * sizeof(JOB *));
+		if (new_slabs == NULL) {
+			return 0;
+		}
+		slabs = new_slabs;
+		slabs_capacity = new_capacity;
+	}
+	if ((slab = calloc(JOB_SLAB_SIZE, sizeof(JOB))) == NULL) {
+		return 0;
+	}
+	slabs[num_slabs++] = slab;
+	return 1;
+}
+
+JOB *job_table_alloc() {
+	JOB *job;
+	int id;
+	if (free_jobs_head != NULL) {
+		job = free_jobs_head;
+		free_jobs_head = job->next_free;
+		num_free_jobs--;
+		id = job->id;
+	} else {
+		if (next_unused_id == num_slabs * JOB_SLAB_SIZE && !add_slab()) {
+			return NULL;
+		}
+		id = next_unused_id++;
+		job = &slabs[id / JOB_SLAB_SIZE][id % JOB_SLAB_SIZE];
+	}
+	memset(job, 0, sizeof(JOB));
+	job->id = id;
+	job->submission = ++submissions;
+	job->allocated = 1;
+	return job;
+}
+
+void job_table_release(JOB *job) {
+	job->allocated = 0;
+	job->next_free = free_jobs_head;
+	free_jobs_head = job;
+	num_free_jobs++;
+}
+
+/*
+ * Makes sure that the next count allocations will not need more memory.
+ */
+int job_table_reserve(int count) {
+	while (num_free_jobs + num_slabs * JOB_SLAB_SIZE - next_unused_id < count) {
+		if (!add_slab()) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+JOB *job_table_get(int id) {
+	JOB *job;
+	if (id < 0 || id >= next_unused_id) {
+		return NULL;
+	}
+	job = &slabs[id / JOB_SLAB_SIZE][id % JOB_SLAB_SIZE];
+	return job->allocated ? job : NULL;
+}
+
+/*
+ * Upper bound (exclusive) on the ids currently in use.
+ */
+int job_table_size() {
+	return next_unused_id;
+}
+
+void job_table_fini() {
+	for (int i = 0; i < num_slabs; i++) {
+		free(slabs[i]);
+	}
+	free(slabs);
+	slabs = NULL;
+	num_slabs = slabs_capacity = next_unused_id = num_free_jobs = 0;
+	free_jobs_head = NULL;
+}
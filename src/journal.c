@@ -0,0 +1,531 @@
+/*
+ * Imprimer: event journal and crash recovery
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "journal.h"
+#include "util.h"
+#include "debug.h"
+
+/*
+ * A job seen during replay, restored at the end unless it finished.
+ */
+typedef struct replayed_job {
+	char *file;
+	char *type;
+	char *owner;
+	int priority;
+	int copies;
+	BITSET eligible;
+	int was_running;
+	int live;
+} REPLAYED_JOB;
+
+static int journal_fd = -1;
+static int timer_fd = -1;
+static char *journal_path;
+static char *buffer;
+static size_t buffered;
+static int dirty, replaying;
+static double last_sync;
+static unsigned long records_since_snapshot;
+static JOURNAL_STATS stats;
+static char **definitions;
+static int num_definitions, definitions_capacity;
+
+static void write_buffer() {
+	if (buffered == 0) {
+		return;
+	}
+	if (!write_all(journal_fd, buffer, buffered)) {
+		debug("Could not write journal: %s", strerror(errno));
+	}
+	stats.bytes += buffered;
+	stats.writes++;
+	buffered = 0;
+	dirty = 1;
+}
+
+static void append(JOURNAL_RECORD_KIND kind, int id, int value, char **strings, int num_strings, uint64_t *words, int num_words) {
+	JOURNAL_RECORD record;
+	size_t length = sizeof(record) + num_words * sizeof(uint64_t);
+	char *p;
+	if (journal_fd == -1 || replaying) {
+		return;
+	}
+	for (int i = 0; i < num_strings; i++) {
+		length += strlen(strings[i]) + 1;
+	}
+	if (buffered + length > JOURNAL_BUFFER_SIZE) {
+		write_buffer();
+	}
+	if (length > JOURNAL_BUFFER_SIZE) {
+		debug("Journal record of %lu bytes dropped", (unsigned long) length);
+		return;
+	}
+	record.length = length;
+	record.kind = kind;
+	record.num_words = num_words;
+	record.id = id;
+	record.value = value;
+	p = buffer + buffered;
+	memcpy(p, &record, sizeof(record));
+	p += sizeof(record);
+	for (int i = 0; i < num_strings; i++) {
+		memcpy(p, strings[i], strlen(strings[i]) + 1);
+		p += strlen(strings[i]) + 1;
+	}
+	memcpy(p, words, num_words * sizeof(uint64_t));
+	buffered += length;
+	stats.records++;
+	records_since_snapshot++;
+}
+
+/*
+ * Definitions are remembered even while no journal is open, so that a
+ * snapshot can always reproduce them.
+ */
+void journal_definition(char **words) {
+	size_t length = 0;
+	char *text;
+	for (int i = 0; words[i] != NULL; i++) {
+		length += strlen(words[i]) + 1;
+	}
+	text = malloc(length + 1);
+	text[0] = '\0';
+	for (int i = 0; words[i] != NULL; i++) {
+		if (i > 0) strcat(text, " ");
+		strcat(text, words[i]);
+	}
+	for (int i = 0; i < num_definitions; i++) {
+		if (strcmp(definitions[i], text) == 0) {
+			// A repeated definition, such as one replayed from the journal
+			// itself, is kept once, in its latest position.
+			free(definitions[i]);
+			memmove(&definitions[i], &definitions[i + 1], (num_definitions - i - 1) * sizeof(char *));
+			num_definitions--;
+			break;
+		}
+	}
+	if (num_definitions == definitions_capacity) {
+		definitions_capacity = definitions_capacity ? definitions_capacity * 2 : 32;
+		definitions = realloc(definitions, definitions_capacity * sizeof(char *));
+	}
+	definitions[num_definitions++] = text;
+	append(JOURNAL_DEFINITION, 0, 0, &text, 1, NULL, 0);
+}
+
+void journal_printer_status(char *name, PRINTER_STATUS status) {
+	append(JOURNAL_PRINTER_STATUS, 0, status, &name, 1, NULL, 0);
+}
+
+/*
+ * The chunks of a split job are not recorded; a restored split job is split
+ * again.
+ */
+void journal_job_created(JOB *job) {
+	if (job->split_index != 0) {
+		return;
+	}
+	char *strings[] = {job->file, job->type->name, job->owner != NULL ? job->owner : ""};
+	append(JOURNAL_JOB_CREATED, job->id, job->priority, strings, 3, job->eligible.words, job->eligible.num_words);
+	if (job->copies) {
+		append(JOURNAL_JOB_COPIES, job->id, job->copies, NULL, 0, NULL, 0);
+	}
+}
+
+/*
+ * Pauses and resumes are not recorded; a job that was paused when imprimer
+ * stopped is restored like one that was running.
+ */
+void journal_job_status(JOB *job) {
+	if (job->split_index != 0) {
+		return;
+	}
+	switch (job->status) {
+	case JOB_RUNNING:
+	case JOB_FINISHED:
+	case JOB_ABORTED:
+	case JOB_DELETED:
+		append(JOURNAL_JOB_STATUS, job->id, job->status, NULL, 0, NULL, 0);
+		break;
+	default:
+		break;
+	}
+}
+
+int journal_timer() {
+	if (timer_fd == -1) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	}
+	return timer_fd;
+}
+
+static void arm_timer(double delay) {
+	struct itimerspec timer;
+	if (timer_fd == -1) {
+		return;
+	}
+	memset(&timer, 0, sizeof(timer));
+	timer.it_value.tv_sec = (time_t) delay;
+	timer.it_value.tv_nsec = (long) ((delay - timer.it_value.tv_sec) * 1e9) + 1;
+	timerfd_settime(timer_fd, 0, &timer, NULL);
+}
+
+void journal_sync() {
+	if (journal_fd == -1) {
+		return;
+	}
+	write_buffer();
+	if (dirty) {
+		fdatasync(journal_fd);
+		stats.syncs++;
+		dirty = 0;
+	}
+	last_sync = current_time();
+}
+
+static int sync_directory(char *path) {
+	char *copy = strdup(path);
+	int fd = open(dirname(copy), O_RDONLY | O_CLOEXEC);
+	free(copy);
+	if (fd == -1) {
+		return 0;
+	}
+	fsync(fd);
+	close(fd);
+	return 1;
+}
+
+/*
+ * Replaces the journal with the definitions, enabled printers and unfinished
+ * jobs as they are now.
+ */
+static int write_snapshot() {
+	char *temporary = malloc(strlen(journal_path) + 5);
+	int fd, old_fd = journal_fd;
+	sprintf(temporary, "%s.tmp", journal_path);
+	if ((fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+		free(temporary);
+		return 0;
+	}
+	write_buffer();
+	journal_fd = fd;
+	buffered = 0;
+	write_all(fd, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC));
+	for (int i = 0; i < num_definitions; i++) {
+		append(JOURNAL_DEFINITION, 0, 0, &definitions[i], 1, NULL, 0);
+	}
+	snapshot_state();
+	write_buffer();
+	if (fdatasync(fd) == -1 || rename(temporary, journal_path) == -1) {
+		close(fd);
+		unlink(temporary);
+		journal_fd = old_fd;
+		free(temporary);
+		return 0;
+	}
+	sync_directory(journal_path);
+	if (old_fd != -1) {
+		close(old_fd);
+	}
+	free(temporary);
+	dirty = 0;
+	last_sync = current_time();
+	records_since_snapshot = 0;
+	stats.snapshots++;
+	return 1;
+}
+
+/*
+ * Called once per scheduling pass: writes what was appended, and syncs it if
+ * the last sync was long enough ago, or arms the timer to sync it later.
+ */
+void journal_flush() {
+	double since;
+	if (journal_fd == -1) {
+		return;
+	}
+	write_buffer();
+	if (records_since_snapshot >= JOURNAL_COMPACT_RECORDS) {
+		write_snapshot();
+		return;
+	}
+	if (dirty) {
+		since = current_time() - last_sync;
+		if (since >= JOURNAL_SYNC_INTERVAL) {
+			journal_sync();
+		} else {
+			arm_timer(JOURNAL_SYNC_INTERVAL - since);
+		}
+	}
+}
+
+static void replay_definition(char *text, FILE *out) {
+	char command[strlen(text) + 1];
+	strcpy(command, text);
+	parse_command(command, NULL, out);
+}
+
+static void replay_printer_status(char *name, int status, FILE *out) {
+	char command[strlen(name) + 10];
+	sprintf(command, "%s %s", status == PRINTER_DISABLED ? "disable" : "enable", name);
+	parse_command(command, NULL, out);
+}
+
+/*
+ * Checks that a record holds the strings its kind has, each terminated within
+ * the record, followed by exactly its bitset words, and that a job record's
+ * id is one a job table could have given out.
+ */
+static int valid_record(JOURNAL_RECORD *record, char *strings) {
+	size_t size = record->length - sizeof(*record), words = record->num_words * sizeof(uint64_t);
+	int count, job = 1;
+	char *end;
+	switch (record->kind) {
+	case JOURNAL_DEFINITION:
+	case JOURNAL_PRINTER_STATUS:
+		count = 1;
+		job = 0;
+		break;
+	case JOURNAL_JOB_CREATED:
+		count = 3;
+		break;
+	case JOURNAL_JOB_STATUS:
+	case JOURNAL_JOB_COPIES:
+		count = 0;
+		break;
+	default:
+		return 0;
+	}
+	if (job && (record->id < 0 || record->id >= JOURNAL_MAX_JOB_ID)) {
+		return 0;
+	}
+	if (words > size) {
+		return 0;
+	}
+	size -= words;
+	for (int i = 0; i < count; i++) {
+		if ((end = memchr(strings, '\0', size)) == NULL) {
+			return 0;
+		}
+		size -= end + 1 - strings;
+		strings = end + 1;
+	}
+	return size == 0;
+}
+
+/*
+ * Applies the records in data.  Replay stops at the first record that is
+ * truncated or malformed, since nothing after it can be trusted.  Jobs are
+ * collected in jobs, in the order they were created, with by_id mapping their
+ * old ids.  Returns 0 if memory ran out, when the journal must not be replaced
+ * by a snapshot of what was replayed.
+ */
+static int replay_records(char *data, size_t length, FILE *out, REPLAYED_JOB **jobs, int *num_jobs, int *replayed) {
+	JOURNAL_RECORD record;
+	REPLAYED_JOB *job, *grown_jobs;
+	int *by_id = NULL, *grown, capacity = 0;
+	size_t offset = strlen(JOURNAL_MAGIC), by_id_size = 0, size;
+	char *strings;
+	while (offset + sizeof(record) <= length) {
+		memcpy(&record, data + offset, sizeof(record));
+		if (record.length < sizeof(record) || record.length > length - offset) {
+			break;
+		}
+		strings = data + offset + sizeof(record);
+		if (!valid_record(&record, strings)) {
+			debug("Journal replay stopped at a bad record at offset %lu", (unsigned long) offset);
+			break;
+		}
+		if (record.kind == JOURNAL_DEFINITION) {
+			replay_definition(strings, out);
+		} else if (record.kind == JOURNAL_PRINTER_STATUS) {
+			replay_printer_status(strings, record.value, out);
+		} else if (record.kind == JOURNAL_JOB_CREATED) {
+			if (*num_jobs == capacity) {
+				capacity = capacity ? capacity * 2 : 256;
+				if ((grown_jobs = realloc(*jobs, capacity * sizeof(REPLAYED_JOB))) == NULL) {
+					free(by_id);
+					return 0;
+				}
+				*jobs = grown_jobs;
+			}
+			if ((size_t) record.id >= by_id_size) {
+				size = ((size_t) record.id + 1) * 2;
+				if ((grown = realloc(by_id, size * sizeof(int))) == NULL) {
+					free(by_id);
+					return 0;
+				}
+				by_id = grown;
+				for (size_t i = by_id_size; i < size; i++) by_id[i] = -1;
+				by_id_size = size;
+			}
+			job = &(*jobs)[*num_jobs];
+			memset(job, 0, sizeof(REPLAYED_JOB));
+			job->file = strings;
+			job->type = job->file + strlen(job->file) + 1;
+			job->owner = job->type + strlen(job->type) + 1;
+			job->priority = record.value;
+			for (int i = 0; i < record.num_words; i++) {
+				uint64_t word;
+				memcpy(&word, job->owner + strlen(job->owner) + 1 + i * sizeof(uint64_t), sizeof(word));
+				for (int bit = 0; bit < 64; bit++) {
+					if (word & ((uint64_t) 1 << bit)) bitset_set(&job->eligible, i * 64 + bit);
+				}
+			}
+			job->live = 1;
+			by_id[record.id] = (*num_jobs)++;
+		} else if (record.kind == JOURNAL_JOB_COPIES && (size_t) record.id < by_id_size && by_id[record.id] != -1) {
+			(*jobs)[by_id[record.id]].copies = record.value;
+		} else if (record.kind == JOURNAL_JOB_STATUS && (size_t) record.id < by_id_size && by_id[record.id] != -1) {
+			job = &(*jobs)[by_id[record.id]];
+			if (record.value == JOB_RUNNING) {
+				job->was_running = 1;
+			} else {
+				job->live = 0;
+				by_id[record.id] = -1;
+			}
+		}
+		offset += record.length;
+		(*replayed)++;
+	}
+	free(by_id);
+	return 1;
+}
+
+static int read_file(char *path, char **data, size_t *length) {
+	struct stat file_stat;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	ssize_t bytes;
+	size_t total = 0;
+	if (fd == -1) {
+		return errno == ENOENT ? 1 : 0;
+	}
+	if (fstat(fd, &file_stat) == -1) {
+		close(fd);
+		return 0;
+	}
+	if ((*data = malloc(file_stat.st_size + 1)) == NULL) {
+		close(fd);
+		return 0;
+	}
+	while (total < file_stat.st_size && (bytes = read(fd, *data + total, file_stat.st_size - total)) > 0) {
+		total += bytes;
+	}
+	close(fd);
+	(*data)[total] = '\0';
+	*length = total;
+	return 1;
+}
+
+/*
+ * Replays the journal at path, if there is one, then starts a new one holding
+ * a snapshot of the restored state.  Jobs that had not finished are submitted
+ * again, with new ids.
+ */
+int journal_open(char *path, FILE *out) {
+	char *data = NULL;
+	size_t length = 0;
+	REPLAYED_JOB *jobs = NULL;
+	int num_jobs = 0, replayed = 0, restored = 0, interrupted = 0;
+	FILE_TYPE *type;
+	if (journal_fd != -1 || !read_file(path, &data, &length)) {
+		return 0;
+	}
+	if (data != NULL && (length < strlen(JOURNAL_MAGIC) || memcmp(data, JOURNAL_MAGIC, strlen(JOURNAL_MAGIC)) != 0)) {
+		free(data);
+		return 0;
+	}
+	if (buffer == NULL) {
+		buffer = malloc(JOURNAL_BUFFER_SIZE);
+	}
+	replaying = 1;
+	if (data != NULL && !replay_records(data, length, out, &jobs, &num_jobs, &replayed)) {
+		debug("Out of memory replaying journal %s", path);
+		for (int i = 0; i < num_jobs; i++) {
+			bitset_free(&jobs[i].eligible);
+		}
+		replaying = 0;
+		free(jobs);
+		free(data);
+		return 0;
+	}
+	for (int i = 0; i < num_jobs; i++) {
+		if (jobs[i].live && (type = lookup_type(jobs[i].type)) != NULL
+			&& submit_print_job(jobs[i].file, type, &jobs[i].eligible, jobs[i].priority, jobs[i].owner, jobs[i].copies)) {
+			restored++;
+			interrupted += jobs[i].was_running;
+		} else {
+			bitset_free(&jobs[i].eligible);
+		}
+	}
+	replaying = 0;
+	free(jobs);
+	free(data);
+	journal_path = strdup(path);
+	if (!write_snapshot()) {
+		free(journal_path);
+		journal_path = NULL;
+		return 0;
+	}
+	fprintf(out, "JOURNAL: path=%s, replayed=%d, restored=%d, interrupted=%d\n", path, replayed, restored, interrupted);
+	return 1;
+}
+
+int journal_is_open() {
+	return journal_fd != -1;
+}
+
+void print_journal_status(FILE *out) {
+	fprintf(out, "JOURNAL: path=%s, records=%lu, bytes=%lu, writes=%lu, syncs=%lu, snapshots=%lu\n",
+		journal_path != NULL ? journal_path : "none", stats.records, stats.bytes, stats.writes, stats.syncs, stats.snapshots);
+}
+
+void journal_close() {
+	if (journal_fd != -1) {
+		journal_sync();
+		close(journal_fd);
+		journal_fd = -1;
+	}
+	free(journal_path);
+	journal_path = NULL;
+}
+
+/*
+ * Called in forked job leaders, so that they neither write the parent's
+ * buffered records nor hold the journal open.
+ */
+void journal_detach() {
+	if (journal_fd != -1) {
+		close(journal_fd);
+		journal_fd = -1;
+	}
+	buffered = 0;
+}
+
+void journal_fini() {
+	journal_close();
+	for (int i = 0; i < num_definitions; i++) {
+		free(definitions[i]);
+	}
+	free(definitions);
+	definitions = NULL;
+	num_definitions = definitions_capacity = 0;
+	free(buffer);
+	buffer = NULL;
+}
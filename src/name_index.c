@@ -0,0 +1,75 @@
+/*
+ * Imprimer: name index
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "name_index.h"
+
+static unsigned int hash_name(char *name) {
+	unsigned int hash = 2166136261U;
+	while (*name) {
+		hash ^= (unsigned char) *name++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static int resize(NAME_INDEX *index, unsigned int new_capacity) {
+	NAME_ENTRY *old_entries = index->entries;
+	unsigned int old_capacity = index->capacity;
+	NAME_ENTRY *new_entries = calloc(new_capacity, sizeof(NAME_ENTRY));
+	if (new_entries == NULL) {
+		return 0;
+	}
+	index->entries = new_entries;
+	index->capacity = new_capacity;
+	index->count = 0;
+	for (unsigned int i = 0; i < old_capacity; i++) {
+		if (old_entries[i].name != NULL) {
+			name_index_put(index, old_entries[i].name, old_entries[i].value);
+		}
+	}
+	free(old_entries);
+	return 1;
+}
+
+int name_index_put(NAME_INDEX *index, char *name, void *value) {
+	unsigned int slot;
+	if (2 * (index->count + 1) > index->capacity && !resize(index, index->capacity ? index->capacity * 2 : 64)) {
+		return 0;
+	}
+	slot = hash_name(name) & (index->capacity - 1);
+	while (index->entries[slot].name != NULL && strcmp(index->entries[slot].name, name) != 0) {
+		slot = (slot + 1) & (index->capacity - 1);
+	}
+	if (index->entries[slot].name == NULL) {
+		index->count++;
+	}
+	index->entries[slot].name = name;
+	index->entries[slot].value = value;
+	return 1;
+}
+
+void *name_index_get(NAME_INDEX *index, char *name) {
+	unsigned int slot;
+	if (index->count == 0) {
+		return NULL;
+	}
+	slot = hash_name(name) & (index->capacity - 1);
+	while (index->entries[slot].name != NULL) {
+		if (strcmp(index->entries[slot].name, name) == 0) {
+			return index->entries[slot].value;
+		}
+		slot = (slot + 1) & (index->capacity - 1);
+	}
+	return NULL;
+}
+
+void name_index_fini(NAME_INDEX *index) {
+	free(index->entries);
+	index->entries = NULL;
+	index->capacity = index->count = 0;
+}
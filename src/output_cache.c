@@ -0,0 +1,328 @@
+/*
+ * Imprimer: content-addressed cache of conversion outputs
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "output_cache.h"
+#include "debug.h"
+
+#define KEY_LENGTH 16
+#define LOCK_NAME ".lock"
+
+typedef struct cache_region {
+	int enabled;
+	uint64_t limit;
+	char dir[PATH_MAX];
+	OUTPUT_CACHE_STATS stats;
+} CACHE_REGION;
+
+typedef struct cache_entry {
+	char name[KEY_LENGTH + 1];
+	struct timespec used;
+	uint64_t size;
+} CACHE_ENTRY;
+
+static CACHE_REGION *region;
+
+/*
+ * Must be called before the first fork, like stats_init().
+ */
+int output_cache_init() {
+	void *mapping;
+	if (region != NULL) {
+		return 1;
+	}
+	mapping = mmap(NULL, sizeof(CACHE_REGION), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED) {
+		return 0;
+	}
+	region = mapping;
+	return 1;
+}
+
+void output_cache_fini() {
+	if (region != NULL) {
+		munmap(region, sizeof(CACHE_REGION));
+		region = NULL;
+	}
+}
+
+static uint64_t mix(uint64_t hash, uint64_t value) {
+	hash ^= value * 0x9e3779b97f4a7c15ULL;
+	hash = (hash << 31 | hash >> 33) * 0xbf58476d1ce4e5b9ULL;
+	return hash;
+}
+
+static uint64_t finalize(uint64_t hash) {
+	hash ^= hash >> 30;
+	hash *= 0xbf58476d1ce4e5b9ULL;
+	hash ^= hash >> 27;
+	hash *= 0x94d049bb133111ebULL;
+	return hash ^ (hash >> 31);
+}
+
+static uint64_t hash_bytes(uint64_t hash, char *data, size_t length) {
+	uint64_t word;
+	size_t i;
+	for (i = 0; i + sizeof(word) <= length; i += sizeof(word)) {
+		memcpy(&word, data + i, sizeof(word));
+		hash = mix(hash, word);
+	}
+	if (i < length) {
+		word = 0;
+		memcpy(&word, data + i, length - i);
+		hash = mix(hash, word);
+	}
+	return hash;
+}
+
+/*
+ * Hashes the contents and size of the file.  Returns 0 if it cannot be read.
+ */
+static int hash_file(char *filename, uint64_t *hash) {
+	char buffer[OUTPUT_CACHE_READ_SIZE];
+	uint64_t size = 0;
+	ssize_t bytes;
+	int fd = open(filename, O_RDONLY);
+	if (fd == -1) {
+		return 0;
+	}
+	*hash = 0;
+	while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) {
+		// Reads of a regular file return whole blocks until the end.
+		*hash = hash_bytes(*hash, buffer, bytes);
+		size += bytes;
+	}
+	close(fd);
+	if (bytes == -1) {
+		return 0;
+	}
+	*hash = finalize(mix(*hash, size));
+	return 1;
+}
+
+static uint64_t stage_key(uint64_t previous, char **cmd_and_args) {
+	uint64_t hash = previous;
+	for (int i = 0; cmd_and_args[i] != NULL; i++) {
+		// The terminating null separates the words.
+		hash = hash_bytes(hash, cmd_and_args[i], strlen(cmd_and_args[i]) + 1);
+	}
+	return finalize(hash);
+}
+
+/*
+ * Directories are checked to leave room for the names when the cache is
+ * enabled, so the paths are never truncated.
+ */
+static char *entry_path(char *dir, uint64_t key, char *path) {
+	if (snprintf(path, PATH_MAX, "%s/%016llx", dir, (unsigned long long) key) >= PATH_MAX) {
+		path[0] = '\0';
+	}
+	return path;
+}
+
+char *output_cache_temp_path(OUTPUT_CACHE_FILL *fill, int stage, char *path) {
+	if (snprintf(path, PATH_MAX, "%s/.tmp-%016llx-%d", fill->dir, (unsigned long long) fill->keys[stage], getpid()) >= PATH_MAX) {
+		path[0] = '\0';
+	}
+	return path;
+}
+
+static int is_entry_name(char *name) {
+	if (strlen(name) != KEY_LENGTH) {
+		return 0;
+	}
+	for (int i = 0; i < KEY_LENGTH; i++) {
+		if (!((name[i] >= '0' && name[i] <= '9') || (name[i] >= 'a' && name[i] <= 'f'))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int compare_entries(const void *a, const void *b) {
+	const CACHE_ENTRY *x = a, *y = b;
+	if (x->used.tv_sec != y->used.tv_sec) {
+		return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+	}
+	return (x->used.tv_nsec > y->used.tv_nsec) - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+/*
+ * Recounts the entries in dir and, if they are over limit, removes the least
+ * recently used down to OUTPUT_CACHE_LOW_WATER of it.  Does nothing if another
+ * process is already at it.
+ */
+static void evict(char *dir, uint64_t limit) {
+	CACHE_ENTRY *entries = NULL, *grown;
+	int count = 0, capacity = 0, lock_fd;
+	uint64_t total = 0, evicted = 0;
+	char path[PATH_MAX];
+	struct dirent *dirent;
+	struct stat info;
+	DIR *stream;
+	if (snprintf(path, sizeof(path), "%s/%s", dir, LOCK_NAME) >= sizeof(path)) {
+		return;
+	}
+	if ((lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+		return;
+	}
+	if (flock(lock_fd, LOCK_EX | LOCK_NB) == -1 || (stream = opendir(dir)) == NULL) {
+		close(lock_fd);
+		return;
+	}
+	while ((dirent = readdir(stream)) != NULL) {
+		if (!is_entry_name(dirent->d_name) || fstatat(dirfd(stream), dirent->d_name, &info, 0) == -1) continue;
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			if ((grown = realloc(entries, capacity * sizeof(CACHE_ENTRY))) == NULL) break;
+			entries = grown;
+		}
+		strcpy(entries[count].name, dirent->d_name);
+		entries[count].used = info.st_mtim;
+		entries[count].size = info.st_size;
+		total += info.st_size;
+		count++;
+	}
+	if (total > limit) {
+		qsort(entries, count, sizeof(CACHE_ENTRY), compare_entries);
+		for (int i = 0; i < count && total > limit * OUTPUT_CACHE_LOW_WATER; i++) {
+			if (unlinkat(dirfd(stream), entries[i].name, 0) == 0) {
+				total -= entries[i].size;
+				evicted++;
+			}
+		}
+	}
+	closedir(stream);
+	close(lock_fd);
+	free(entries);
+	__atomic_fetch_add(&region->stats.evicted, evicted, __ATOMIC_RELAXED);
+	__atomic_store_n(&region->stats.bytes, total, __ATOMIC_RELAXED);
+}
+
+int output_cache_enable(char *dir, uint64_t max_bytes) {
+	char path[PATH_MAX];
+	if (region == NULL || max_bytes == 0) {
+		return 0;
+	}
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		return 0;
+	}
+	if (realpath(dir, path) == NULL || strlen(path) > PATH_MAX - KEY_LENGTH - 32) {
+		return 0;
+	}
+	strcpy(region->dir, path);
+	region->limit = max_bytes;
+	memset(&region->stats, 0, sizeof(region->stats));
+	evict(region->dir, region->limit);
+	__atomic_store_n(&region->enabled, 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+void output_cache_disable() {
+	if (region != NULL) {
+		__atomic_store_n(&region->enabled, 0, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Removes every entry, keeping the cache enabled.
+ */
+int output_cache_clear() {
+	if (region == NULL || !region->enabled) {
+		return 0;
+	}
+	evict(region->dir, 0);
+	return 1;
+}
+
+void print_output_cache_status(FILE *out) {
+	OUTPUT_CACHE_STATS *stats;
+	if (region == NULL) {
+		return;
+	}
+	stats = &region->stats;
+	fprintf(out, "CACHE: dir=%s, limit=%llu, bytes=%llu, hits=%llu, partial_hits=%llu, misses=%llu, stored=%llu, evicted=%llu\n",
+		region->enabled ? region->dir : "off", (unsigned long long) region->limit, (unsigned long long) stats->bytes,
+		(unsigned long long) stats->hits, (unsigned long long) stats->partial_hits, (unsigned long long) stats->misses,
+		(unsigned long long) stats->stored, (unsigned long long) stats->evicted);
+}
+
+/*
+ * Looks up the outputs of the pipeline for the file.  Returns the number of
+ * leading stages whose output is cached; the last of those entries is named
+ * in fill->input and is marked as used.  The stages after it will be stored
+ * if fill->num_stages is not 0.
+ */
+int output_cache_start(OUTPUT_CACHE_FILL *fill, char *filename, CONVERSION **path) {
+	char entry[PATH_MAX];
+	uint64_t key;
+	int num_stages = 0, cached = 0;
+	fill->num_stages = fill->first_stage = 0;
+	if (region == NULL || !__atomic_load_n(&region->enabled, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	while (path[num_stages] != NULL) {
+		num_stages++;
+	}
+	if (num_stages == 0 || num_stages > OUTPUT_CACHE_MAX_STAGES || !hash_file(filename, &key)) {
+		return 0;
+	}
+	strcpy(fill->dir, region->dir);
+	for (int i = 0; i < num_stages; i++) {
+		key = fill->keys[i] = stage_key(key, path[i]->cmd_and_args);
+	}
+	for (int i = num_stages - 1; i >= 0; i--) {
+		// Marking the entry used puts it last in line for eviction.
+		if (access(entry_path(fill->dir, fill->keys[i], entry), R_OK) == 0 && utimensat(AT_FDCWD, entry, NULL, 0) == 0) {
+			strcpy(fill->input, entry);
+			cached = i + 1;
+			break;
+		}
+	}
+	__atomic_fetch_add(cached == num_stages ? &region->stats.hits : cached > 0 ? &region->stats.partial_hits : &region->stats.misses, 1, __ATOMIC_RELAXED);
+	fill->first_stage = cached;
+	fill->num_stages = num_stages;
+	return cached;
+}
+
+/*
+ * Turns the stage outputs written during a successful pipeline into entries,
+ * or discards them, and evicts if the cache has grown over its limit.  A
+ * relay removes its file if it could not write all of it.
+ */
+void output_cache_finish(OUTPUT_CACHE_FILL *fill, int success) {
+	char temp[PATH_MAX], entry[PATH_MAX];
+	struct stat info;
+	uint64_t added = 0, total;
+	for (int i = fill->first_stage; i < fill->num_stages; i++) {
+		output_cache_temp_path(fill, i, temp);
+		if (!success || stat(temp, &info) == -1) {
+			unlink(temp);
+			continue;
+		}
+		if (rename(temp, entry_path(fill->dir, fill->keys[i], entry)) == 0) {
+			added += info.st_size;
+			__atomic_fetch_add(&region->stats.stored, 1, __ATOMIC_RELAXED);
+		} else {
+			unlink(temp);
+		}
+	}
+	total = __atomic_add_fetch(&region->stats.bytes, added, __ATOMIC_RELAXED);
+	if (added > 0 && total > region->limit && strcmp(fill->dir, region->dir) == 0) {
+		evict(fill->dir, region->limit);
+	}
+}
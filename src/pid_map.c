@@ -0,0 +1,116 @@
+/*
+ * Imprimer: pid to job map
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "pid_map.h"
+
+/*
+ * Open addressing with linear probing.  A pid of 0 marks an empty slot, and
+ * removal shifts later entries back so that no tombstones are needed.
+ */
+typedef struct pid_entry {
+	int pid;
+	JOB *job;
+} PID_ENTRY;
+
+static PID_ENTRY *entries;
+static unsigned int capacity;
+static unsigned int count;
+
+static unsigned int hash_pid(int pid) {
+	return ((unsigned int) pid * 2654435761U) & (capacity - 1);
+}
+
+static int resize(unsigned int new_capacity) {
+	PID_ENTRY *old_entries = entries;
+	unsigned int old_capacity = capacity;
+	if ((entries = calloc(new_capacity, sizeof(PID_ENTRY))) == NULL) {
+		entries = old_entries;
+		return 0;
+	}
+	capacity = new_capacity;
+	count = 0;
+	for (unsigned int i = 0; i < old_capacity; i++) {
+		if (old_entries[i].pid != 0) {
+			pid_map_put(old_entries[i].pid, old_entries[i].job);
+		}
+	}
+	free(old_entries);
+	return 1;
+}
+
+int pid_map_put(int pid, JOB *job) {
+	unsigned int slot;
+	if (2 * (count + 1) > capacity && !resize(capacity ? capacity * 2 : 64)) {
+		return 0;
+	}
+	slot = hash_pid(pid);
+	while (entries[slot].pid != 0 && entries[slot].pid != pid) {
+		slot = (slot + 1) & (capacity - 1);
+	}
+	if (entries[slot].pid == 0) {
+		count++;
+	}
+	entries[slot].pid = pid;
+	entries[slot].job = job;
+	return 1;
+}
+
+JOB *pid_map_get(int pid) {
+	unsigned int slot;
+	if (count == 0) {
+		return NULL;
+	}
+	slot = hash_pid(pid);
+	while (entries[slot].pid != 0) {
+		if (entries[slot].pid == pid) {
+			return entries[slot].job;
+		}
+		slot = (slot + 1) & (capacity - 1);
+	}
+	return NULL;
+}
+
+void pid_map_remove(int pid) {
+	unsigned int slot, next, home;
+	if (count == 0) {
+		return;
+	}
+	slot = hash_pid(pid);
+	while (entries[slot].pid != pid) {
+		if (entries[slot].pid == 0) {
+			return;
+		}
+		slot = (slot + 1) & (capacity - 1);
+	}
+	entries[slot].pid = 0;
+	count--;
+	next = slot;
+	while (1) {
+		next = (next + 1) & (capacity - 1);
+		if (entries[next].pid == 0) {
+			break;
+		}
+		home = hash_pid(entries[next].pid);
+		// Move the entry back if its home slot is not cyclically within (slot, next].
+		if ((next > slot && (home <= slot || home > next)) || (next < slot && home <= slot && home > next)) {
+			entries[slot] = entries[next];
+			entries[next].pid = 0;
+			slot = next;
+		}
+	}
+}
+
+void pid_map_fini() {
+	free(entries);
+	entries = NULL;
+	capacity = count = 0;
+}
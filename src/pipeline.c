@@ -0,0 +1,223 @@
+/*
+ * Imprimer: conversion pipeline plumbing
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "pipeline.h"
+#include "util.h"
+#include "debug.h"
+
+#define RELAY_CHUNK (1 << 20)
+
+PIPELINE_OPTIONS pipeline_options;
+
+static int parse_switch(char *value, int *result) {
+	if (strcmp(value, "on") == 0) {
+		*result = 1;
+	} else if (strcmp(value, "off") == 0) {
+		*result = 0;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Accepts one "name=value" option.
+ *
+ * @return 1 if the option was recognized and applied, 0 otherwise.
+ */
+int set_pipeline_option(char *option) {
+	char *value = strchr(option, '=');
+	char *end;
+	long size;
+	if (value == NULL) {
+		return 0;
+	}
+	*value++ = '\0';
+	if (strcmp(option, "pipe_size") == 0) {
+		size = strtol(value, &end, 10);
+		if (*value == '\0' || *end != '\0' || size < 0 || size > (1 << 30)) {
+			return 0;
+		}
+		pipeline_options.pipe_size = size;
+		return 1;
+	} else if (strcmp(option, "packet") == 0) {
+		return parse_switch(value, &pipeline_options.packet);
+	} else if (strcmp(option, "relay") == 0) {
+		return parse_switch(value, &pipeline_options.relay);
+	} else if (strcmp(option, "count") == 0) {
+		return parse_switch(value, &pipeline_options.count);
+	}
+	return 0;
+}
+
+void print_pipeline_options(FILE *out) {
+	fprintf(out, "PIPELINE: pipe_size=%d, packet=%s, relay=%s, count=%s\n", pipeline_options.pipe_size,
+		pipeline_options.packet ? "on" : "off", pipeline_options.relay ? "on" : "off", pipeline_options.count ? "on" : "off");
+}
+
+int make_pipeline_pipe(int fds[2]) {
+	if (pipe2(fds, pipeline_options.packet ? O_DIRECT : 0) == -1) {
+		return 0;
+	}
+	if (pipeline_options.pipe_size > 0 && fcntl(fds[1], F_SETPIPE_SZ, pipeline_options.pipe_size) == -1) {
+		debug("Could not resize pipe to %d bytes", pipeline_options.pipe_size);
+	}
+	return 1;
+}
+
+static int relay(int input, int output, uint64_t *counter) {
+	ssize_t bytes;
+	while ((bytes = splice(input, NULL, output, NULL, RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) != 0) {
+		if (bytes == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EINVAL) {
+				return copy_all(input, output, counter);
+			}
+			return 0;
+		}
+		if (counter != NULL) *counter += bytes;
+	}
+	return 1;
+}
+
+/*
+ * Like copy_all(), but also writes everything to the file at copy_path.  The
+ * copy is removed if it cannot be completed, without failing the relay.
+ */
+static int relay_and_copy(int input, int output, uint64_t *counter, char *copy_path) {
+	char buffer[COPY_BUFFER_SIZE];
+	ssize_t bytes;
+	int copy = open(copy_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	while ((bytes = read(input, buffer, sizeof(buffer))) != 0) {
+		if (bytes == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		if (!write_all(output, buffer, bytes)) {
+			bytes = -1;
+			break;
+		}
+		if (counter != NULL) *counter += bytes;
+		if (copy != -1 && !write_all(copy, buffer, bytes)) {
+			close(copy);
+			unlink(copy_path);
+			copy = -1;
+		}
+	}
+	if (copy != -1 && (bytes != 0 || close(copy) == -1)) {
+		unlink(copy_path);
+	}
+	return bytes == 0;
+}
+
+/*
+ * Forks a process that moves everything from input to output, adding the
+ * number of bytes moved to *counter if it is not NULL, and copying them to a
+ * new file at copy_path if it is not NULL.  Like a stage, the relay closes
+ * the read end of its output pipe, if it has one, and the printer connection
+ * unless it writes there, so that it sees EPIPE if the next stage exits.
+ *
+ * @return the pid of the relay, or -1 if it could not be started.
+ */
+int start_relay(int input, int output, int unused_read_end, int printer_descriptor, uint64_t *counter, char *copy_path) {
+	int pid = fork();
+	if (pid == 0) {
+		if (unused_read_end != -1) {
+			close(unused_read_end);
+		}
+		if (output != printer_descriptor) {
+			close(printer_descriptor);
+		}
+		if (copy_path != NULL) {
+			exit(relay_and_copy(input, output, counter, copy_path) ? 0 : 1);
+		}
+		exit(relay(input, output, counter) ? 0 : 1);
+	}
+	return pid;
+}
+
+/*
+ * Counters live in shared memory so that the relays of a job's pipeline can
+ * update them and the spooler can read them.
+ */
+uint64_t *alloc_stage_counters(int num_counters) {
+	void *counters = mmap(NULL, num_counters * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	return counters == MAP_FAILED ? NULL : counters;
+}
+
+void free_stage_counters(uint64_t *counters, int num_counters) {
+	munmap(counters, num_counters * sizeof(uint64_t));
+}
+
+/*
+ * Shared like the stage counters, so that a forked leader can fill it in.
+ */
+STAGE_USAGE *alloc_stage_usage(int num_stages) {
+	void *usage = mmap(NULL, num_stages * sizeof(STAGE_USAGE), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	return usage == MAP_FAILED ? NULL : usage;
+}
+
+void free_stage_usage(STAGE_USAGE *usage, int num_stages) {
+	munmap(usage, num_stages * sizeof(STAGE_USAGE));
+}
+
+static double seconds(struct timeval *tv) {
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void stage_started(STAGE_USAGE *stage, int pid) {
+	memset(stage, 0, sizeof(STAGE_USAGE));
+	stage->pid = pid;
+	stage->started_at = current_time();
+}
+
+STAGE_USAGE *find_stage_usage(STAGE_USAGE *usage, int num_stages, int pid) {
+	for (int i = 0; usage != NULL && i < num_stages; i++) {
+		if (usage[i].pid == pid && !usage[i].reaped) {
+			return &usage[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Must be called while the stage is a zombie, before it is reaped, since its
+ * I/O counters go with it.
+ */
+void read_stage_io(STAGE_USAGE *stage) {
+	char path[32], line[64];
+	unsigned long long value;
+	FILE *io;
+	snprintf(path, sizeof(path), "/proc/%d/io", stage->pid);
+	if ((io = fopen(path, "r")) == NULL) {
+		return;
+	}
+	while (fgets(line, sizeof(line), io) != NULL) {
+		if (sscanf(line, "rchar: %llu", &value) == 1) {
+			stage->bytes_read = value;
+		} else if (sscanf(line, "wchar: %llu", &value) == 1) {
+			stage->bytes_written = value;
+		}
+	}
+	fclose(io);
+}
+
+void record_stage_exit(STAGE_USAGE *stage, int status, struct rusage *rusage) {
+	stage->wall_time = current_time() - stage->started_at;
+	stage->user_time = seconds(&rusage->ru_utime);
+	stage->system_time = seconds(&rusage->ru_stime);
+	stage->max_rss = rusage->ru_maxrss;
+	stage->status = status;
+	stage->reaped = 1;
+}
@@ -0,0 +1,227 @@
+/*
+ * Imprimer: printer connection pool
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "events.h"
+#include "printer_pool.h"
+#include "stats.h"
+#include "util.h"
+#include "debug.h"
+
+static int pool_enabled;
+static int num_preparing;
+
+static void record_connect(PRINTER *printer, double seconds) {
+	CONNECTION_STATS *stats = &printer->connection_stats;
+	stats_record(STATS_CONNECT, seconds);
+	stats->connects++;
+	stats->total_connect_time += seconds;
+	if (seconds > stats->max_connect_time) {
+		stats->max_connect_time = seconds;
+	}
+}
+
+void set_connection_pool(int enabled) {
+	pool_enabled = enabled;
+}
+
+int connection_pool_enabled() {
+	return pool_enabled;
+}
+
+/*
+ * Runs in the helper process: connects, then passes the descriptor and the
+ * time the connection took back over the socket.  A helper that hangs is
+ * killed by the alarm, and the parent sees the socket close.
+ */
+static void connect_and_send(PRINTER *printer, int sock) {
+	struct msghdr message;
+	struct iovec iov;
+	struct cmsghdr *control;
+	char control_buffer[CMSG_SPACE(sizeof(int))];
+	double start = current_time(), elapsed;
+	int fd;
+	signal(SIGALRM, SIG_DFL);
+	alarm(POOL_CONNECT_TIMEOUT);
+	close_printer_connections();
+	fd = imp_connect_to_printer(printer->name, printer->type->name, PRINTER_NORMAL);
+	elapsed = current_time() - start;
+	memset(&message, 0, sizeof(message));
+	iov.iov_base = &elapsed;
+	iov.iov_len = sizeof(elapsed);
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	if (fd != -1) {
+		message.msg_control = control_buffer;
+		message.msg_controllen = sizeof(control_buffer);
+		control = CMSG_FIRSTHDR(&message);
+		control->cmsg_level = SOL_SOCKET;
+		control->cmsg_type = SCM_RIGHTS;
+		control->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(control), &fd, sizeof(int));
+	}
+	sendmsg(sock, &message, 0);
+}
+
+/*
+ * Called from the event loop once the helper has sent its result or exited.
+ * Either way the printer can be offered to the waiting jobs again; after a
+ * failure the next job connects directly, as without the pool.  A connection
+ * that is no longer wanted, because the pool was turned off or the printer
+ * disabled meanwhile, is closed.
+ */
+static void receive_connection(int sock, void *data) {
+	PRINTER *printer = data;
+	struct msghdr message;
+	struct iovec iov;
+	struct cmsghdr *control;
+	char control_buffer[CMSG_SPACE(sizeof(int))];
+	double elapsed;
+	int fd = -1;
+	memset(&message, 0, sizeof(message));
+	iov.iov_base = &elapsed;
+	iov.iov_len = sizeof(elapsed);
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control_buffer;
+	message.msg_controllen = sizeof(control_buffer);
+	if (recvmsg(sock, &message, MSG_CMSG_CLOEXEC | MSG_DONTWAIT) == sizeof(elapsed)) {
+		record_connect(printer, elapsed);
+		control = CMSG_FIRSTHDR(&message);
+		if (control != NULL && control->cmsg_type == SCM_RIGHTS) {
+			memcpy(&fd, CMSG_DATA(control), sizeof(int));
+		}
+	}
+	events_remove(printer->connect_source);
+	printer->connect_source = NULL;
+	num_preparing--;
+	close(sock);
+	if (fd == -1) {
+		debug("Could not pre-connect to printer %s", printer->name);
+		stats_count(STATS_CONNECT_FAILURES);
+		printer->connect_failed = 1;
+	} else if (printer->ready_descriptor != -1 || !pool_enabled || printer->status == PRINTER_DISABLED) {
+		close(fd);
+	} else {
+		printer->ready_descriptor = fd;
+	}
+	printer_changed(printer);
+}
+
+static void request_connection(PRINTER *printer) {
+	int socks[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) == -1) {
+		printer->connect_failed = 1;
+		return;
+	}
+	if (fork() == 0) {
+		close(socks[0]);
+		connect_and_send(printer, socks[1]);
+		_exit(0);
+	}
+	close(socks[1]);
+	if ((printer->connect_source = events_add(socks[0], receive_connection, printer)) == NULL) {
+		close(socks[0]);
+		printer->connect_failed = 1;
+		return;
+	}
+	num_preparing++;
+}
+
+/*
+ * With the pool enabled, an enabled printer keeps a spare connection open, or
+ * on the way from a helper, so that a job dispatched to it starts on one that
+ * already exists.  The printer spools a file for every connection, even one
+ * that is never used, so the spare left when imprimer exits shows up as an
+ * empty file; that is the price of the pool, which is off by default.
+ */
+void refill_printer_connection(PRINTER *printer) {
+	if (pool_enabled && printer->status != PRINTER_DISABLED && printer->ready_descriptor == -1
+			&& printer->connect_source == NULL && !printer->connect_failed) {
+		request_connection(printer);
+	}
+}
+
+/*
+ * Whether a job can be given a connection to the printer right away.  With
+ * the pool enabled it waits while the spare connection is on its way.
+ */
+int printer_connection_ready(PRINTER *printer) {
+	if (printer->ready_descriptor != -1) {
+		return 1;
+	}
+	if (printer->connect_source != NULL) {
+		return 0;
+	}
+	if (!pool_enabled || printer->connect_failed) {
+		return 1;
+	}
+	refill_printer_connection(printer);
+	return printer->connect_failed;
+}
+
+int printer_connection_pending(PRINTER *printer) {
+	return printer->connect_source != NULL;
+}
+
+int printer_connections_pending() {
+	return num_preparing;
+}
+
+/*
+ * Returns a connection for a job that is about to start: the spare if there
+ * is one, which is then replaced, otherwise a new one opened here.
+ */
+int take_printer_connection(PRINTER *printer) {
+	double start;
+	int fd;
+	if ((fd = printer->ready_descriptor) != -1) {
+		printer->ready_descriptor = -1;
+		printer->connection_stats.pooled_starts++;
+		refill_printer_connection(printer);
+		return fd;
+	}
+	start = current_time();
+	fd = imp_connect_to_printer(printer->name, printer->type->name, PRINTER_NORMAL);
+	printer->connect_failed = 0;
+	if (fd != -1) {
+		record_connect(printer, current_time() - start);
+		printer->connection_stats.direct_starts++;
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		refill_printer_connection(printer);
+	} else {
+		stats_count(STATS_CONNECT_FAILURES);
+	}
+	return fd;
+}
+
+/*
+ * Also called in forked job leaders and connection helpers, so that they do
+ * not hold other printers' connections open.
+ */
+void close_printer_connection(PRINTER *printer) {
+	if (printer->ready_descriptor != -1) {
+		close(printer->ready_descriptor);
+		printer->ready_descriptor = -1;
+	}
+}
+
+void display_connection_stats(FILE *out, PRINTER *printer) {
+	CONNECTION_STATS *stats = &printer->connection_stats;
+	fprintf(out, "POOL: printer=%s, ready=%d, connects=%d, avg_connect=%.6f, max_connect=%.6f, pooled_starts=%d, direct_starts=%d\n",
+		printer->name, printer->ready_descriptor != -1, stats->connects,
+		stats->connects ? stats->total_connect_time / stats->connects : 0.0, stats->max_connect_time,
+		stats->pooled_starts, stats->direct_starts);
+}
@@ -0,0 +1,379 @@
+/*
+ * Imprimer: conversion stages replicated over chunks of their input
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "conversions.h"
+#include "stats.h"
+#include "replicate.h"
+#include "util.h"
+#include "debug.h"
+
+#define READ_SIZE (1 << 16)
+
+extern char **environ;
+
+static REPLICATE_RULE *rules;
+static int num_rules, rules_capacity;
+
+static int find_rule(FILE_TYPE *from, FILE_TYPE *to) {
+	for (int i = 0; i < num_rules; i++) {
+		if (rules[i].from == from && rules[i].to == to) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int replicate_set_rule(FILE_TYPE *from, FILE_TYPE *to, int instances, int pages) {
+	REPLICATE_RULE *grown;
+	int index = find_rule(from, to);
+	if (index == -1) {
+		if (num_rules == rules_capacity) {
+			rules_capacity = rules_capacity ? rules_capacity * 2 : 8;
+			if ((grown = realloc(rules, rules_capacity * sizeof(REPLICATE_RULE))) == NULL) {
+				return 0;
+			}
+			rules = grown;
+		}
+		index = num_rules++;
+	}
+	rules[index].from = from;
+	rules[index].to = to;
+	rules[index].instances = instances;
+	rules[index].pages = pages;
+	return 1;
+}
+
+void replicate_clear_rule(FILE_TYPE *from, FILE_TYPE *to) {
+	int index = find_rule(from, to);
+	if (index != -1) {
+		rules[index] = rules[--num_rules];
+	}
+}
+
+/*
+ * Conversions rebuilt by a pool worker have no types, and are never
+ * replicated.
+ */
+REPLICATE_RULE *replicate_rule(CONVERSION *conversion) {
+	int index = conversion->from != NULL ? find_rule(conversion->from, conversion->to) : -1;
+	return index != -1 && rules[index].instances > 1 ? &rules[index] : NULL;
+}
+
+int replicate_path(CONVERSION **conversion_path) {
+	for (int i = 0; conversion_path[i] != NULL; i++) {
+		if (replicate_rule(conversion_path[i]) != NULL) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void print_replicate_rules(FILE *out) {
+	for (int i = 0; i < num_rules; i++) {
+		fprintf(out, "PARALLEL: from=%s, to=%s, instances=%d, records=%s\n", rules[i].from->name, rules[i].to->name,
+			rules[i].instances, rules[i].pages ? "pages" : "lines");
+	}
+}
+
+void replicate_fini() {
+	free(rules);
+	rules = NULL;
+	num_rules = rules_capacity = 0;
+}
+
+/*
+ * One running copy of the command.  Only the replica at the head of the ring,
+ * whose chunk comes first, writes to the stage's output; the others hold what
+ * they produce until it is their turn, so that none of them stalls on a full
+ * pipe while an earlier one is still working.  Once one holds
+ * REPLICATE_HELD_LIMIT bytes it is no longer read, and waits on its pipe for
+ * the replicas ahead of it to finish.
+ */
+typedef struct replica {
+	int pid;
+	int fd;                 /* Read end of its output, -1 once it is at end of file. */
+	char *held;
+	size_t length;
+	size_t capacity;
+} REPLICA;
+
+typedef struct replicator {
+	char **cmd_and_args;
+	int pages;
+	int input;
+	int input_done;
+	int output;
+	char *buffer;           /* Input not yet given to a replica. */
+	size_t filled;
+	size_t capacity;
+	REPLICA *replicas;
+	int instances;
+	int head;
+	int running;
+	int started;            /* Replicas started so far. */
+	int error;
+} REPLICATOR;
+
+static int reserve(char **data, size_t *capacity, size_t needed) {
+	size_t size = *capacity ? *capacity : READ_SIZE;
+	char *grown;
+	while (size < needed) {
+		size *= 2;
+	}
+	if (size != *capacity) {
+		if ((grown = realloc(*data, size)) == NULL) {
+			return 0;
+		}
+		*data = grown;
+		*capacity = size;
+	}
+	return 1;
+}
+
+/*
+ * Returns the length of the longest prefix of data that ends a record, or 0
+ * if it holds no whole record.
+ */
+static size_t record_end(char *data, size_t length, int pages) {
+	char *end = pages ? memrchr(data, '\f', length) : NULL;
+	if (end == NULL) {
+		end = memrchr(data, '\n', length);
+	}
+	return end != NULL ? end - data + 1 : 0;
+}
+
+/*
+ * Starts a replica on the chunk, which it reads from a memory file so that
+ * the chunk never has to be fed to it.
+ */
+static int start_replica(REPLICATOR *replicator, REPLICA *replica, char *chunk, size_t length) {
+	posix_spawn_file_actions_t actions;
+	int memfd, fds[2], error;
+	if ((memfd = memfd_create("imprimer-chunk", MFD_CLOEXEC)) == -1) {
+		return 0;
+	}
+	if (!write_all(memfd, chunk, length) || lseek(memfd, 0, SEEK_SET) == -1 || pipe2(fds, O_CLOEXEC) == -1) {
+		close(memfd);
+		return 0;
+	}
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, memfd, 0);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+	error = posix_spawnp(&replica->pid, replicator->cmd_and_args[0], &actions, NULL, replicator->cmd_and_args, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(memfd);
+	close(fds[1]);
+	if (error != 0) {
+		debug("Could not start %s: %s", replicator->cmd_and_args[0], strerror(error));
+		close(fds[0]);
+		return 0;
+	}
+	replica->fd = fds[0];
+	replica->length = 0;
+	return 1;
+}
+
+/*
+ * Gives chunks to replicas while there are free ones.  A chunk is cut once
+ * REPLICATE_CHUNK bytes are buffered, after the last record in them; the
+ * rest of the input goes in the last chunk whole, which is empty only when
+ * the whole input is.
+ */
+static void dispatch(REPLICATOR *replicator) {
+	REPLICA *replica;
+	size_t length;
+	while (!replicator->error && replicator->running < replicator->instances
+			&& (replicator->filled > 0 || (replicator->input_done && replicator->started == 0))) {
+		if (replicator->input_done) {
+			length = replicator->filled;
+		} else if (replicator->filled < REPLICATE_CHUNK
+				|| (length = record_end(replicator->buffer, replicator->filled, replicator->pages)) == 0) {
+			return;
+		}
+		replica = &replicator->replicas[(replicator->head + replicator->running) % replicator->instances];
+		if (!start_replica(replicator, replica, replicator->buffer, length)) {
+			replicator->error = 1;
+			return;
+		}
+		replicator->running++;
+		replicator->started++;
+		memmove(replicator->buffer, replicator->buffer + length, replicator->filled - length);
+		replicator->filled -= length;
+	}
+}
+
+static void read_input(REPLICATOR *replicator) {
+	ssize_t bytes;
+	if (!reserve(&replicator->buffer, &replicator->capacity, replicator->filled + READ_SIZE)) {
+		replicator->error = 1;
+		return;
+	}
+	if ((bytes = read(replicator->input, replicator->buffer + replicator->filled, replicator->capacity - replicator->filled)) == -1) {
+		replicator->error = errno != EINTR;
+		return;
+	}
+	replicator->filled += bytes;
+	replicator->input_done = bytes == 0;
+}
+
+static void drain(REPLICATOR *replicator, REPLICA *replica) {
+	char buffer[READ_SIZE];
+	ssize_t bytes;
+	int status, pid;
+	if (replica == &replicator->replicas[replicator->head]) {
+		if ((bytes = read(replica->fd, buffer, sizeof(buffer))) > 0 && !write_all(replicator->output, buffer, bytes)) {
+			replicator->error = 1;
+		}
+	} else if (reserve(&replica->held, &replica->capacity, replica->length + READ_SIZE)) {
+		if ((bytes = read(replica->fd, replica->held + replica->length, replica->capacity - replica->length)) > 0) {
+			replica->length += bytes;
+		}
+	} else {
+		replicator->error = 1;
+		return;
+	}
+	if (bytes == -1 && errno != EINTR) {
+		replicator->error = 1;
+	} else if (bytes == 0) {
+		close(replica->fd);
+		replica->fd = -1;
+		while ((pid = waitpid(replica->pid, &status, 0)) == -1 && errno == EINTR);
+		replica->pid = 0;
+		if (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			debug("Replica of %s failed with status %d", replicator->cmd_and_args[0], status);
+			replicator->error = 1;
+		}
+	}
+}
+
+/*
+ * Retires finished replicas from the head, and writes out what the next one
+ * has held so far.
+ */
+static void advance(REPLICATOR *replicator) {
+	REPLICA *replica;
+	while (!replicator->error && replicator->running > 0 && replicator->replicas[replicator->head].fd == -1) {
+		replicator->head = (replicator->head + 1) % replicator->instances;
+		replicator->running--;
+		replica = &replicator->replicas[replicator->head];
+		if (replicator->running > 0 && replica->length > 0) {
+			replicator->error = !write_all(replicator->output, replica->held, replica->length);
+			replica->length = 0;
+		}
+	}
+}
+
+static void stop_replicas(REPLICATOR *replicator) {
+	REPLICA *replica;
+	for (int i = 0; i < replicator->instances; i++) {
+		replica = &replicator->replicas[i];
+		if (replica->fd != -1) {
+			close(replica->fd);
+		}
+		if (replica->pid > 0) {
+			kill(replica->pid, SIGTERM);
+			while (waitpid(replica->pid, NULL, 0) == -1 && errno == EINTR);
+		}
+		free(replica->held);
+	}
+}
+
+/*
+ * Runs in the replicated stage's process.
+ */
+static int replicate(REPLICATE_RULE *rule, char **cmd_and_args, int input, int output) {
+	REPLICATOR replicator;
+	REPLICA *replica;
+	struct pollfd polls[REPLICATE_MAX_INSTANCES + 1];
+	REPLICA *polled[REPLICATE_MAX_INSTANCES + 1];
+	int num_polls;
+	memset(&replicator, 0, sizeof(replicator));
+	replicator.cmd_and_args = cmd_and_args;
+	replicator.pages = rule->pages;
+	replicator.input = input;
+	replicator.output = output;
+	replicator.instances = rule->instances;
+	if ((replicator.replicas = calloc(rule->instances, sizeof(REPLICA))) == NULL) {
+		return 0;
+	}
+	for (int i = 0; i < rule->instances; i++) {
+		replicator.replicas[i].fd = -1;
+	}
+	while (!replicator.error && (replicator.running > 0 || !replicator.input_done || replicator.filled > 0
+			|| replicator.started == 0)) {
+		dispatch(&replicator);
+		num_polls = 0;
+		if (!replicator.input_done && replicator.running < replicator.instances) {
+			polls[num_polls].fd = input;
+			polls[num_polls].events = POLLIN;
+			polled[num_polls++] = NULL;
+		}
+		for (int k = 0; k < replicator.running; k++) {
+			replica = &replicator.replicas[(replicator.head + k) % replicator.instances];
+			if (replica->fd != -1 && (k == 0 || replica->length < REPLICATE_HELD_LIMIT)) {
+				polls[num_polls].fd = replica->fd;
+				polls[num_polls].events = POLLIN;
+				polled[num_polls++] = replica;
+			}
+		}
+		if (replicator.error || num_polls == 0) break;
+		if (poll(polls, num_polls, -1) == -1) {
+			replicator.error = errno != EINTR;
+			continue;
+		}
+		for (int i = 0; i < num_polls && !replicator.error; i++) {
+			if (polls[i].revents == 0) continue;
+			if (polled[i] == NULL) {
+				read_input(&replicator);
+			} else {
+				drain(&replicator, polled[i]);
+			}
+		}
+		advance(&replicator);
+	}
+	stop_replicas(&replicator);
+	free(replicator.replicas);
+	free(replicator.buffer);
+	return !replicator.error;
+}
+
+/*
+ * Forks the process that runs a replicated stage, with the same descriptors
+ * as spawn_stage() would give a single one.  Returns its pid, or -1.
+ */
+int start_replicated_stage(REPLICATE_RULE *rule, char **cmd_and_args, char *filename, int input, int output, int unused_read_end, int printer_descriptor) {
+	int pid = fork();
+	if (pid == 0) {
+		if (output != printer_descriptor) {
+			close(unused_read_end);
+			close(printer_descriptor);
+		}
+		if (filename != NULL && (input = open(filename, O_RDONLY)) == -1) {
+			_exit(EXIT_FAILURE);
+		}
+		fcntl(input, F_SETFD, FD_CLOEXEC);
+		fcntl(output, F_SETFD, FD_CLOEXEC);
+		_exit(replicate(rule, cmd_and_args, input, output) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+	if (pid == -1) {
+		debug("Could not start replicated %s", cmd_and_args[0]);
+		stats_count(STATS_STAGE_FAILURES);
+		return -1;
+	}
+	stats_stage_started(pid, cmd_and_args[0]);
+	return pid;
+}
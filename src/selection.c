@@ -0,0 +1,106 @@
+/*
+ * Imprimer: printer selection policies
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "conversion_cache.h"
+#include "selection.h"
+
+static char *policy_names[] = {"first", "shortest", "lru", "throughput", "round-robin"};
+
+static SELECTION_POLICY policy = POLICY_FIRST;
+static unsigned long dispatches;
+static int last_selected = -1;
+
+int set_selection_policy(char *name) {
+	for (int i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++) {
+		if (strcmp(name, policy_names[i]) == 0) {
+			policy = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+SELECTION_POLICY selection_policy() {
+	return policy;
+}
+
+char *selection_policy_name() {
+	return policy_names[policy];
+}
+
+static double throughput(PRINTER *printer) {
+	return printer->load.busy_time > 0 ? printer->load.bytes_printed / printer->load.busy_time : 0;
+}
+
+/*
+ * Returns nonzero if candidate should be preferred to best under the current
+ * policy.  Candidates are offered in increasing id order, so ties go to the
+ * lowest id.
+ */
+static int better(JOB *job, PRINTER *candidate, PRINTER *best) {
+	int links, best_links;
+	switch (policy) {
+	case POLICY_SHORTEST:
+		links = count_links_in_conversion_path(cached_conversion_path(job->type, candidate->type));
+		best_links = count_links_in_conversion_path(cached_conversion_path(job->type, best->type));
+		return links < best_links;
+	case POLICY_LRU:
+		return candidate->load.last_dispatch < best->load.last_dispatch;
+	case POLICY_THROUGHPUT:
+		// Printers that have not been measured yet are tried first.
+		if (best->load.jobs == 0) return 0;
+		return candidate->load.jobs == 0 || throughput(candidate) > throughput(best);
+	case POLICY_ROUND_ROBIN:
+		return best->id <= last_selected && candidate->id > last_selected;
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Returns the id of the printer in candidates that the job should go to, or -1
+ * if candidates is empty.
+ */
+int select_printer(JOB *job, BITSET *candidates, PRINTER **printers) {
+	int best = bitset_next(candidates, 0);
+	if (policy == POLICY_FIRST || best == -1) {
+		return best;
+	}
+	for (int id = bitset_next(candidates, best + 1); id != -1; id = bitset_next(candidates, id + 1)) {
+		if (better(job, printers[id], printers[best])) {
+			best = id;
+		}
+	}
+	return best;
+}
+
+void selection_job_started(PRINTER *printer) {
+	printer->load.jobs++;
+	printer->load.last_dispatch = ++dispatches;
+	last_selected = printer->id;
+}
+
+void selection_job_finished(PRINTER *printer, uint64_t bytes, double seconds) {
+	printer->load.bytes_printed += bytes;
+	printer->load.busy_time += seconds;
+}
+
+void display_printer_loads(FILE *out, PRINTER **printers, int num_printers) {
+	PRINTER *printer;
+	fprintf(out, "POLICY: %s\n", policy_names[policy]);
+	for (int i = 0; i < num_printers; i++) {
+		printer = printers[i];
+		fprintf(out, "LOAD: printer=%s, jobs=%d, bytes=%lu, busy=%.3f, throughput=%.1f\n", printer->name,
+			printer->load.jobs, (unsigned long) printer->load.bytes_printed, printer->load.busy_time, throughput(printer));
+	}
+}
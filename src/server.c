@@ -0,0 +1,316 @@
+/*
+ * Imprimer: command server on a Unix domain socket
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "events.h"
+#include "server.h"
+#include "debug.h"
+
+typedef struct client {
+	int fd;
+	EVENT_SOURCE *source;
+	FILE *out;              /* Appends to the reply buffer. */
+	char *input;
+	size_t input_length;
+	size_t input_capacity;
+	char *reply;
+	size_t reply_length;
+	size_t reply_sent;
+	size_t reply_capacity;
+	int hung_up;            /* No more input: close once the replies are sent. */
+	int watching_output;
+	struct client *next;
+} CLIENT;
+
+static int listen_fd = -1;
+static char *listen_path;
+static EVENT_SOURCE *listen_source;
+static CLIENT *clients;
+static int num_clients;
+static SERVER_STATS stats;
+
+static ssize_t append_reply(void *cookie, const char *data, size_t size) {
+	CLIENT *client = cookie;
+	char *reply;
+	if (client->reply_length + size > client->reply_capacity) {
+		size_t capacity = client->reply_capacity ? client->reply_capacity : 4096;
+		while (capacity < client->reply_length + size) {
+			capacity *= 2;
+		}
+		if ((reply = realloc(client->reply, capacity)) == NULL) {
+			return -1;
+		}
+		client->reply = reply;
+		client->reply_capacity = capacity;
+	}
+	memcpy(client->reply + client->reply_length, data, size);
+	client->reply_length += size;
+	return size;
+}
+
+static void free_client(CLIENT *client) {
+	fclose(client->out);
+	free(client->input);
+	free(client->reply);
+	free(client);
+}
+
+static void close_client(CLIENT *client) {
+	CLIENT **link = &clients;
+	while (*link != client) {
+		link = &(*link)->next;
+	}
+	*link = client->next;
+	events_remove(client->source);
+	close(client->fd);
+	free_client(client);
+	num_clients--;
+}
+
+/*
+ * Returns 0 if the client has gone away.
+ */
+static int send_replies(CLIENT *client) {
+	ssize_t sent;
+	while (client->reply_sent < client->reply_length) {
+		sent = send(client->fd, client->reply + client->reply_sent, client->reply_length - client->reply_sent, MSG_NOSIGNAL);
+		if (sent == -1) {
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		}
+		client->reply_sent += sent;
+		stats.bytes_sent += sent;
+	}
+	client->reply_sent = client->reply_length = 0;
+	return 1;
+}
+
+/*
+ * Runs one request, with the client's own events off while it runs, in case
+ * the command waits on the event loop.  Returns 0 for quit.
+ */
+static int run_request(CLIENT *client, char *line) {
+	COMMAND_RESULT result;
+	EVENT_SOURCE *previous = set_command_source(client->source);
+	int res = run_command(line, NULL, client->out, &result);
+	set_command_source(previous);
+	run_available_jobs();
+	if (res == -1) {
+		return 0;
+	}
+	stats.requests++;
+	if (result.failed) {
+		stats.errors++;
+		fprintf(client->out, "ERROR %s\n", result.message);
+	} else if (result.jobs == 1) {
+		fprintf(client->out, "OK job=%d\n", result.last_job);
+	} else if (result.jobs > 1) {
+		fprintf(client->out, "OK jobs=%d\n", result.jobs);
+	} else {
+		fprintf(client->out, "OK\n");
+	}
+	return 1;
+}
+
+/*
+ * Runs the complete lines that have been read, until the unsent replies grow
+ * past SERVER_MAX_PENDING.
+ */
+static void run_requests(CLIENT *client) {
+	char *line = client->input, *end = client->input + client->input_length, *newline;
+	while (line < end && client->reply_length < SERVER_MAX_PENDING) {
+		if ((newline = memchr(line, '\n', end - line)) == NULL) {
+			break;
+		}
+		*newline = '\0';
+		if (newline > line && newline[-1] == '\r') {
+			newline[-1] = '\0';
+		}
+		if (!run_request(client, line)) {
+			client->hung_up = 1;
+			line = end;
+			break;
+		}
+		line = newline + 1;
+	}
+	fflush(client->out);
+	client->input_length = end - line;
+	memmove(client->input, line, client->input_length);
+}
+
+static int read_requests(CLIENT *client) {
+	ssize_t bytes;
+	char *input;
+	if (client->input_capacity - client->input_length < SERVER_READ_SIZE / 2) {
+		if ((input = realloc(client->input, client->input_capacity + SERVER_READ_SIZE)) == NULL) {
+			return 0;
+		}
+		client->input = input;
+		client->input_capacity += SERVER_READ_SIZE;
+	}
+	bytes = read(client->fd, client->input + client->input_length, client->input_capacity - client->input_length);
+	if (bytes == 0 || (bytes == -1 && errno != EAGAIN && errno != EINTR)) {
+		client->hung_up = 1;
+	} else if (bytes > 0) {
+		client->input_length += bytes;
+	}
+	return 1;
+}
+
+static void client_callback(int fd, void *data) {
+	CLIENT *client = data;
+	int paused, backlog;
+	if (!send_replies(client)) {
+		close_client(client);
+		return;
+	}
+	run_requests(client);
+	if (!client->hung_up && client->reply_length < SERVER_MAX_PENDING) {
+		if (!read_requests(client)) {
+			close_client(client);
+			return;
+		}
+		run_requests(client);
+	}
+	if (!send_replies(client)) {
+		close_client(client);
+		return;
+	}
+	backlog = client->reply_length > 0;
+	if (client->hung_up && !backlog) {
+		close_client(client);
+		return;
+	}
+	// Input stays paused while the replies are over the limit.
+	paused = client->hung_up || client->reply_length >= SERVER_MAX_PENDING;
+	if (backlog != client->watching_output || paused) {
+		events_set_interest(client->source, !paused, backlog);
+		client->watching_output = backlog;
+	}
+}
+
+static void accept_callback(int fd, void *data) {
+	cookie_io_functions_t functions = {NULL, append_reply, NULL, NULL};
+	CLIENT *client;
+	int client_fd;
+	while ((client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+		if ((client = calloc(1, sizeof(CLIENT))) == NULL) {
+			close(client_fd);
+			continue;
+		}
+		client->fd = client_fd;
+		if ((client->out = fopencookie(client, "w", functions)) == NULL) {
+			free(client);
+			close(client_fd);
+			continue;
+		}
+		if ((client->source = events_add(client_fd, client_callback, client)) == NULL) {
+			free_client(client);
+			close(client_fd);
+			continue;
+		}
+		client->next = clients;
+		clients = client;
+		num_clients++;
+		stats.accepted++;
+	}
+}
+
+/*
+ * Starts accepting clients on path, replacing a stale socket left there.
+ */
+int server_listen(char *path) {
+	struct sockaddr_un address;
+	struct stat info;
+	int fd;
+	if (listen_fd != -1 || strlen(path) >= sizeof(address.sun_path)) {
+		return 0;
+	}
+	if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+		unlink(path);
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+		return 0;
+	}
+	if (bind(fd, (struct sockaddr *) &address, sizeof(address)) == -1 || listen(fd, SERVER_BACKLOG) == -1) {
+		close(fd);
+		return 0;
+	}
+	if ((listen_source = events_add(fd, accept_callback, NULL)) == NULL) {
+		close(fd);
+		unlink(path);
+		return 0;
+	}
+	listen_fd = fd;
+	listen_path = strdup(path);
+	memset(&stats, 0, sizeof(stats));
+	return 1;
+}
+
+/*
+ * Stops accepting clients.  Connected clients are served until they hang up.
+ */
+void server_close() {
+	if (listen_fd == -1) {
+		return;
+	}
+	events_remove(listen_source);
+	close(listen_fd);
+	unlink(listen_path);
+	free(listen_path);
+	listen_source = NULL;
+	listen_path = NULL;
+	listen_fd = -1;
+}
+
+int server_active() {
+	return listen_fd != -1 || clients != NULL;
+}
+
+/*
+ * Called in forked children, so that clients see the connection close when
+ * the server closes it.  The event loop is left alone.
+ */
+void server_detach() {
+	CLIENT *client;
+	while ((client = clients) != NULL) {
+		clients = client->next;
+		close(client->fd);
+		free_client(client);
+	}
+	num_clients = 0;
+	if (listen_fd != -1) {
+		close(listen_fd);
+		listen_fd = -1;
+	}
+	free(listen_path);
+	listen_path = NULL;
+	listen_source = NULL;
+}
+
+void server_fini() {
+	server_close();
+	while (clients != NULL) {
+		close_client(clients);
+	}
+}
+
+void print_server_status(FILE *out) {
+	fprintf(out, "LISTEN: path=%s, clients=%d, accepted=%lu, requests=%lu, errors=%lu, sent=%lu\n",
+		listen_path != NULL ? listen_path : "off", num_clients, stats.accepted, stats.requests, stats.errors, stats.bytes_sent);
+}
@@ -0,0 +1,280 @@
+/*
+ * Imprimer: splitting large jobs into chunks
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "worker_pool.h"
+#include "journal.h"
+#include "server.h"
+#include "split.h"
+#include "util.h"
+#include "debug.h"
+
+static SPLIT_RULE **rules;      /* By type index. */
+static int rules_capacity;
+
+static void free_rule(SPLIT_RULE *rule) {
+	if (rule == NULL) {
+		return;
+	}
+	if (rule->cmd_and_args != NULL) {
+		for (int i = 0; rule->cmd_and_args[i] != NULL; i++) {
+			free(rule->cmd_and_args[i]);
+		}
+		free(rule->cmd_and_args);
+	}
+	free(rule);
+}
+
+/*
+ * Splits by size if cmd_and_args is NULL.
+ */
+int split_set_rule(FILE_TYPE *type, uint64_t max_bytes, char **cmd_and_args) {
+	SPLIT_RULE *rule, **grown;
+	int count = 0, capacity;
+	if (type->index >= rules_capacity) {
+		capacity = rules_capacity ? rules_capacity : 16;
+		while (capacity <= type->index) {
+			capacity *= 2;
+		}
+		if ((grown = realloc(rules, capacity * sizeof(SPLIT_RULE *))) == NULL) {
+			return 0;
+		}
+		memset(grown + rules_capacity, 0, (capacity - rules_capacity) * sizeof(SPLIT_RULE *));
+		rules = grown;
+		rules_capacity = capacity;
+	}
+	if ((rule = calloc(1, sizeof(SPLIT_RULE))) == NULL) {
+		return 0;
+	}
+	rule->type = type;
+	rule->max_bytes = max_bytes;
+	if (cmd_and_args != NULL) {
+		while (cmd_and_args[count] != NULL) {
+			count++;
+		}
+		rule->cmd_and_args = calloc(count + 1, sizeof(char *));
+		for (int i = 0; i < count; i++) {
+			rule->cmd_and_args[i] = strdup(cmd_and_args[i]);
+		}
+	}
+	free_rule(rules[type->index]);
+	rules[type->index] = rule;
+	return 1;
+}
+
+void split_clear_rule(FILE_TYPE *type) {
+	if (type->index < rules_capacity) {
+		free_rule(rules[type->index]);
+		rules[type->index] = NULL;
+	}
+}
+
+SPLIT_RULE *split_rule(FILE_TYPE *type) {
+	return type->index < rules_capacity ? rules[type->index] : NULL;
+}
+
+void print_split_rules(FILE *out) {
+	SPLIT_RULE *rule;
+	for (int i = 0; i < rules_capacity; i++) {
+		if ((rule = rules[i]) == NULL) continue;
+		fprintf(out, "SPLIT: type=%s, ", rule->type->name);
+		if (rule->cmd_and_args == NULL) {
+			fprintf(out, "bytes=%llu\n", (unsigned long long) rule->max_bytes);
+			continue;
+		}
+		fprintf(out, "command=");
+		for (int j = 0; rule->cmd_and_args[j] != NULL; j++) {
+			fprintf(out, "%s%s", j == 0 ? "" : " ", rule->cmd_and_args[j]);
+		}
+		fprintf(out, "\n");
+	}
+}
+
+void split_fini() {
+	for (int i = 0; i < rules_capacity; i++) {
+		free_rule(rules[i]);
+	}
+	free(rules);
+	rules = NULL;
+	rules_capacity = 0;
+}
+
+/*
+ * A file that fits in one chunk is printed whole.
+ */
+int split_needed(SPLIT_RULE *rule, char *filename) {
+	struct stat file_stat;
+	if (rule->cmd_and_args != NULL) {
+		return 1;
+	}
+	return stat(filename, &file_stat) == 0 && file_stat.st_size > rule->max_bytes;
+}
+
+static int open_chunk(char *dir, int index) {
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/" SPLIT_CHUNK_FORMAT, dir, index) >= sizeof(path)) {
+		return -1;
+	}
+	return open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+}
+
+/*
+ * Writes each chunk as its bytes are read, noting the last form feed and the
+ * last newline in it so far.  A full chunk is cut back after the form feed,
+ * so that pages stay whole, or failing that after the newline, and the input
+ * is read again from the cut.
+ */
+static int split_by_size(char *filename, char *dir, uint64_t max_bytes) {
+	char buffer[COPY_BUFFER_SIZE];
+	char *end;
+	uint64_t length, form_feed, newline, cut;
+	off_t start = 0;
+	size_t size;
+	ssize_t bytes = 1;
+	int fd, chunk, index = 0, res = 1;
+	if ((fd = open(filename, O_RDONLY)) == -1) {
+		return 0;
+	}
+	while (res && bytes != 0) {
+		length = form_feed = newline = 0;
+		chunk = -1;
+		while (length < max_bytes) {
+			size = max_bytes - length < sizeof(buffer) ? max_bytes - length : sizeof(buffer);
+			if ((bytes = read(fd, buffer, size)) == -1) {
+				if (errno == EINTR) continue;
+				res = 0;
+				break;
+			}
+			if (bytes == 0) break;
+			if (chunk == -1 && (chunk = open_chunk(dir, index++)) == -1) {
+				res = 0;
+				break;
+			}
+			if ((end = memrchr(buffer, '\f', bytes)) != NULL) {
+				form_feed = length + (end - buffer) + 1;
+			}
+			if ((end = memrchr(buffer, '\n', bytes)) != NULL) {
+				newline = length + (end - buffer) + 1;
+			}
+			if (!write_all(chunk, buffer, bytes)) {
+				res = 0;
+				break;
+			}
+			length += bytes;
+		}
+		if (res && length == max_bytes) {
+			cut = form_feed ? form_feed : newline ? newline : length;
+			if (cut < length && (ftruncate(chunk, cut) == -1 || lseek(fd, start + cut, SEEK_SET) == -1)) {
+				res = 0;
+			}
+			start += cut;
+		}
+		if (chunk != -1 && close(chunk) == -1) {
+			res = 0;
+		}
+	}
+	close(fd);
+	return res;
+}
+
+/*
+ * Makes a directory for the chunks and forks a splitter, in a process group
+ * of its own like a job leader, that writes them there.  Returns its pid, or
+ * -1 with nothing left behind.
+ */
+int split_start(SPLIT_RULE *rule, char *filename, char **dir) {
+	char *tmpdir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+	int pid, fd;
+	if ((*dir = malloc(strlen(tmpdir) + strlen(SPLIT_DIR_TEMPLATE) + 2)) == NULL) {
+		return -1;
+	}
+	sprintf(*dir, "%s/%s", tmpdir, SPLIT_DIR_TEMPLATE);
+	if (mkdtemp(*dir) == NULL) {
+		free(*dir);
+		return -1;
+	}
+	if ((pid = fork()) == 0) {
+		setpgid(0, 0);
+		close_printer_connections();
+		worker_pool_close();
+		journal_detach();
+		server_detach();
+		if (!unblock_child_signals()) {
+			_exit(EXIT_FAILURE);
+		}
+		if (rule->cmd_and_args == NULL) {
+			_exit(split_by_size(filename, *dir, rule->max_bytes) ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+		if ((fd = open(filename, O_RDONLY)) == -1 || dup2(fd, 0) == -1 || chdir(*dir) == -1) {
+			_exit(EXIT_FAILURE);
+		}
+		close(fd);
+		if ((fd = open("/dev/null", O_WRONLY)) != -1) {
+			dup2(fd, 1);
+			close(fd);
+		}
+		execvp(rule->cmd_and_args[0], rule->cmd_and_args);
+		debug("Could not start splitter %s: %s", rule->cmd_and_args[0], strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	if (pid == -1) {
+		rmdir(*dir);
+		free(*dir);
+		return -1;
+	}
+	setpgid(pid, pid);
+	return pid;
+}
+
+static int is_chunk(const struct dirent *dirent) {
+	return dirent->d_name[0] != '.';
+}
+
+/*
+ * Fills chunks with the paths of the files in dir, in name order.  Returns
+ * how many there are, or -1.
+ */
+int split_collect(char *dir, char ***chunks) {
+	struct dirent **names;
+	int count = scandir(dir, &names, is_chunk, alphasort);
+	if (count == -1) {
+		return -1;
+	}
+	*chunks = malloc((count > 0 ? count : 1) * sizeof(char *));
+	for (int i = 0; i < count; i++) {
+		(*chunks)[i] = malloc(strlen(dir) + strlen(names[i]->d_name) + 2);
+		sprintf((*chunks)[i], "%s/%s", dir, names[i]->d_name);
+		free(names[i]);
+	}
+	free(names);
+	return count;
+}
+
+void split_remove(char *dir) {
+	struct dirent *dirent;
+	DIR *stream;
+	if ((stream = opendir(dir)) != NULL) {
+		while ((dirent = readdir(stream)) != NULL) {
+			if (strcmp(dirent->d_name, ".") != 0 && strcmp(dirent->d_name, "..") != 0) {
+				unlinkat(dirfd(stream), dirent->d_name, 0);
+			}
+		}
+		closedir(stream);
+	}
+	rmdir(dir);
+}
@@ -0,0 +1,274 @@
+/*
+ * Imprimer: hot-path counters and latency histograms
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+
+#include "stats.h"
+#include "util.h"
+#include "debug.h"
+
+enum { PROGRAM_FREE, PROGRAM_CLAIMED, PROGRAM_READY };
+
+typedef struct stats_program {
+	int state;
+	char name[STATS_PROGRAM_NAME];
+	uint64_t failures;
+	uint64_t cpu_us;
+	uint64_t max_rss;
+	uint64_t bytes_written;
+	STATS_HISTOGRAM runtime;
+} STATS_PROGRAM;
+
+typedef struct stats_region {
+	double started_at;
+	uint64_t counters[STATS_NUM_COUNTERS];
+	STATS_HISTOGRAM latencies[STATS_NUM_LATENCIES];
+	STATS_PROGRAM programs[STATS_MAX_PROGRAMS];
+} STATS_REGION;
+
+/*
+ * Stages spawned by this process that are still running.  Only job leaders
+ * and pool workers use it.
+ */
+typedef struct stats_stage {
+	int pid;
+	double started_at;
+	STATS_PROGRAM *program;
+} STATS_STAGE;
+
+static char *latency_names[] = {"queue_wait", "connect", "job_run", "reap"};
+static char *counter_names[] = {"submitted", "started", "finished", "aborted", "connect_failures", "reaped", "stage_failures"};
+
+static STATS_REGION *region;
+static STATS_STAGE stages[STATS_MAX_STAGES];
+static char *dump_path;
+static double dump_interval;
+static int timer_fd = -1;
+
+/*
+ * Must be called before the first fork, so that every process updates the
+ * same region.
+ */
+int stats_init() {
+	void *mapping;
+	if (region != NULL) {
+		return 1;
+	}
+	mapping = mmap(NULL, sizeof(STATS_REGION), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED) {
+		return 0;
+	}
+	region = mapping;
+	region->started_at = current_time();
+	return 1;
+}
+
+void stats_fini() {
+	if (region != NULL) {
+		munmap(region, sizeof(STATS_REGION));
+		region = NULL;
+	}
+	free(dump_path);
+	dump_path = NULL;
+	if (timer_fd != -1) {
+		close(timer_fd);
+		timer_fd = -1;
+	}
+}
+
+/*
+ * Updates racing with the reset may survive it; that is accepted, since
+ * nothing is locked.
+ */
+void stats_reset() {
+	if (region == NULL) {
+		return;
+	}
+	memset(region, 0, sizeof(STATS_REGION));
+	memset(stages, 0, sizeof(stages));
+	region->started_at = current_time();
+}
+
+void stats_count(STATS_COUNTER counter) {
+	if (region != NULL) {
+		__atomic_fetch_add(&region->counters[counter], 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void store_max(uint64_t *max, uint64_t value) {
+	uint64_t current = __atomic_load_n(max, __ATOMIC_RELAXED);
+	while (value > current && !__atomic_compare_exchange_n(max, &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void histogram_add(STATS_HISTOGRAM *histogram, double seconds) {
+	uint64_t us = seconds > 0 ? (uint64_t) (seconds * 1e6) : 0;
+	int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+	if (bucket >= STATS_BUCKETS) {
+		bucket = STATS_BUCKETS - 1;
+	}
+	__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->total_us, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+	store_max(&histogram->max_us, us);
+}
+
+void stats_record(STATS_LATENCY latency, double seconds) {
+	if (region != NULL) {
+		histogram_add(&region->latencies[latency], seconds);
+	}
+}
+
+/*
+ * Returns the slot for the program, claiming a free one the first time any
+ * process sees it, or NULL if every slot is taken by another program.
+ */
+static STATS_PROGRAM *find_program(char *name) {
+	STATS_PROGRAM *program;
+	int state;
+	for (int i = 0; i < STATS_MAX_PROGRAMS; i++) {
+		program = &region->programs[i];
+		state = __atomic_load_n(&program->state, __ATOMIC_ACQUIRE);
+		if (state == PROGRAM_FREE) {
+			if (__atomic_compare_exchange_n(&program->state, &state, PROGRAM_CLAIMED, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+				strncpy(program->name, name, STATS_PROGRAM_NAME - 1);
+				__atomic_store_n(&program->state, PROGRAM_READY, __ATOMIC_RELEASE);
+				return program;
+			}
+		}
+		/* Another process is copying the name in. */
+		while (state == PROGRAM_CLAIMED) {
+			state = __atomic_load_n(&program->state, __ATOMIC_ACQUIRE);
+		}
+		if (strncmp(program->name, name, STATS_PROGRAM_NAME - 1) == 0) {
+			return program;
+		}
+	}
+	return NULL;
+}
+
+void stats_stage_started(int pid, char *program) {
+	if (region == NULL) {
+		return;
+	}
+	for (int i = 0; i < STATS_MAX_STAGES; i++) {
+		if (stages[i].pid == 0) {
+			stages[i].pid = pid;
+			stages[i].started_at = current_time();
+			stages[i].program = find_program(program);
+			return;
+		}
+	}
+}
+
+void stats_stage_exited(int pid, int failed, double cpu_time, long max_rss, uint64_t bytes_written) {
+	STATS_PROGRAM *program;
+	for (int i = 0; i < STATS_MAX_STAGES && region != NULL; i++) {
+		if (stages[i].pid == pid) {
+			if ((program = stages[i].program) != NULL) {
+				histogram_add(&program->runtime, current_time() - stages[i].started_at);
+				__atomic_fetch_add(&program->cpu_us, (uint64_t) (cpu_time * 1e6), __ATOMIC_RELAXED);
+				__atomic_fetch_add(&program->bytes_written, bytes_written, __ATOMIC_RELAXED);
+				store_max(&program->max_rss, max_rss);
+				if (failed) {
+					__atomic_fetch_add(&program->failures, 1, __ATOMIC_RELAXED);
+				}
+			}
+			stages[i].pid = 0;
+			return;
+		}
+	}
+}
+
+/*
+ * Starts appending the statistics to path every interval seconds, or stops if
+ * path is NULL.
+ */
+int set_stats_dump(char *path, double interval) {
+	struct itimerspec timer;
+	char *copy = NULL;
+	if (timer_fd == -1) {
+		return 0;
+	}
+	if (path != NULL && (copy = strdup(path)) == NULL) {
+		return 0;
+	}
+	free(dump_path);
+	dump_path = copy;
+	dump_interval = path != NULL ? interval : 0;
+	memset(&timer, 0, sizeof(timer));
+	timer.it_interval.tv_sec = (time_t) dump_interval;
+	timer.it_interval.tv_nsec = (long) ((dump_interval - timer.it_interval.tv_sec) * 1e9);
+	timer.it_value = timer.it_interval;
+	return timerfd_settime(timer_fd, 0, &timer, NULL) == 0;
+}
+
+char *stats_dump_path() {
+	return dump_path;
+}
+
+int stats_timer() {
+	if (timer_fd == -1) {
+		timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	}
+	return timer_fd;
+}
+
+/*
+ * Percentiles are the upper bound of the bucket they fall in, capped at the
+ * maximum, so they are accurate to a factor of two.
+ */
+static double percentile(uint64_t *buckets, uint64_t count, uint64_t max_us, double fraction) {
+	uint64_t rank = (uint64_t) (count * fraction), seen = 0, bound = max_us;
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen > rank) {
+			bound = 1ULL << i;
+			break;
+		}
+	}
+	return (bound < max_us ? bound : max_us) / 1e6;
+}
+
+static void print_histogram(FILE *out, STATS_HISTOGRAM *histogram) {
+	uint64_t buckets[STATS_BUCKETS], count = 0, max_us = histogram->max_us;
+	for (int i = 0; i < STATS_BUCKETS; i++) {
+		buckets[i] = __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+		count += buckets[i];
+	}
+	fprintf(out, "count=%llu, avg=%.6f, p50=%.6f, p90=%.6f, p99=%.6f, max=%.6f", (unsigned long long) count,
+		count ? histogram->total_us / 1e6 / count : 0.0, percentile(buckets, count, max_us, 0.5),
+		percentile(buckets, count, max_us, 0.9), percentile(buckets, count, max_us, 0.99), max_us / 1e6);
+}
+
+void print_stats(FILE *out) {
+	STATS_PROGRAM *program;
+	if (region == NULL) {
+		return;
+	}
+	fprintf(out, "STATS: uptime=%.3f", current_time() - region->started_at);
+	for (int i = 0; i < STATS_NUM_COUNTERS; i++) {
+		fprintf(out, ", %s=%llu", counter_names[i], (unsigned long long) region->counters[i]);
+	}
+	fprintf(out, "\n");
+	for (int i = 0; i < STATS_NUM_LATENCIES; i++) {
+		fprintf(out, "LATENCY: name=%s, ", latency_names[i]);
+		print_histogram(out, &region->latencies[i]);
+		fprintf(out, "\n");
+	}
+	for (int i = 0; i < STATS_MAX_PROGRAMS; i++) {
+		program = &region->programs[i];
+		if (__atomic_load_n(&program->state, __ATOMIC_ACQUIRE) != PROGRAM_READY) continue;
+		fprintf(out, "STAGE: program=%s, ", program->name);
+		print_histogram(out, &program->runtime);
+		fprintf(out, ", cpu=%.6f, max_rss=%llu, written=%llu, failures=%llu\n", program->cpu_us / 1e6,
+			(unsigned long long) program->max_rss, (unsigned long long) program->bytes_written,
+			(unsigned long long) program->failures);
+	}
+}
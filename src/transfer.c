@@ -0,0 +1,46 @@
+/*
+ * Imprimer: zero-copy file transfer
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+
+#include "transfer.h"
+#include "util.h"
+#include "debug.h"
+
+#define TRANSFER_CHUNK (1 << 20)
+
+/*
+ * Uses sendfile() until the input is exhausted, falling back to a plain copy
+ * when the descriptors do not support it (e.g. the input is a pipe).
+ */
+int transfer_fd(int input, int output) {
+	ssize_t sent;
+	while ((sent = sendfile(output, input, NULL, TRANSFER_CHUNK)) != 0) {
+		if (sent == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EINVAL || errno == ENOSYS) {
+				debug("sendfile unsupported, copying instead");
+				return copy_all(input, output, NULL);
+			}
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int transfer_file(char *filename, int output) {
+	int input, res;
+	if ((input = open(filename, O_RDONLY)) == -1) {
+		return 0;
+	}
+	res = transfer_fd(input, output);
+	close(input);
+	return res;
+}
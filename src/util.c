@@ -0,0 +1,59 @@
+/*
+ * Imprimer: shared time and descriptor helpers
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "util.h"
+
+double current_time() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int write_all(int fd, char *data, size_t length) {
+	ssize_t written;
+	while (length > 0) {
+		if ((written = write(fd, data, length)) == -1) {
+			if (errno == EINTR) continue;
+			return 0;
+		}
+		data += written;
+		length -= written;
+	}
+	return 1;
+}
+
+int read_exactly(int fd, char *data, size_t length) {
+	ssize_t bytes;
+	while (length > 0) {
+		if ((bytes = read(fd, data, length)) <= 0) {
+			if (bytes == -1 && errno == EINTR) continue;
+			return 0;
+		}
+		data += bytes;
+		length -= bytes;
+	}
+	return 1;
+}
+
+int copy_all(int input, int output, uint64_t *counter) {
+	char buffer[COPY_BUFFER_SIZE];
+	ssize_t bytes;
+	while ((bytes = read(input, buffer, sizeof(buffer))) != 0) {
+		if (bytes == -1) {
+			if (errno == EINTR) continue;
+			return 0;
+		}
+		if (!write_all(output, buffer, bytes)) {
+			return 0;
+		}
+		if (counter != NULL) *counter += bytes;
+	}
+	return 1;
+}
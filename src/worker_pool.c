@@ -0,0 +1,364 @@
+/*
+ * Imprimer: pre-forked job leaders
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "events.h"
+#include "pipeline.h"
+#include "worker_pool.h"
+#include "server.h"
+#include "output_cache.h"
+#include "job_table.h"
+#include "journal.h"
+#include "debug.h"
+
+/*
+ * A job request is this header followed by the file name and, for each stage,
+ * its arguments terminated by an empty string.
+ */
+typedef struct worker_request {
+	int job_id;
+	int num_stages;
+	PIPELINE_OPTIONS options;
+} WORKER_REQUEST;
+
+/*
+ * Only the stages the job had are sent.
+ */
+typedef struct worker_result {
+	int job_id;
+	int status;
+	int num_stages;
+	STAGE_USAGE stages[WORKER_MAX_STAGES];
+} WORKER_RESULT;
+
+static WORKER **workers;
+static int num_workers, pool_size;
+
+static void stop_worker(WORKER *worker) {
+	if (worker->source != NULL) {
+		events_remove(worker->source);
+		worker->source = NULL;
+	}
+	if (worker->socket != -1) {
+		close(worker->socket);
+		worker->socket = -1;
+	}
+}
+
+static int append_string(char *buffer, int length, char *string) {
+	int size = strlen(string) + 1;
+	if (length + size > WORKER_MESSAGE_MAX) {
+		return -1;
+	}
+	memcpy(buffer + length, string, size);
+	return length + size;
+}
+
+/*
+ * Returns the length of the request for the job, or -1 if it does not fit in
+ * one message.
+ */
+static int build_request(char *buffer, JOB *job) {
+	WORKER_REQUEST *request = (WORKER_REQUEST *) buffer;
+	CONVERSION **path = job->conversion_path;
+	char **args;
+	int length = sizeof(WORKER_REQUEST);
+	request->job_id = job->id;
+	request->num_stages = count_links_in_conversion_path(path);
+	request->options = pipeline_options;
+	if (request->num_stages > WORKER_MAX_STAGES) {
+		return -1;
+	}
+	length = append_string(buffer, length, job->file);
+	for (int i = 0; i < request->num_stages && length != -1; i++) {
+		for (args = path[i]->cmd_and_args; *args != NULL && length != -1; args++) {
+			length = append_string(buffer, length, *args);
+		}
+		if (length != -1) {
+			length = append_string(buffer, length, "");
+		}
+	}
+	return length;
+}
+
+/*
+ * Runs in the worker: rebuilds the conversion path from the request and runs
+ * it the way a forked job leader would.
+ */
+static int run_request(char *buffer, int length, int printer_descriptor, STAGE_USAGE *usage) {
+	WORKER_REQUEST *request = (WORKER_REQUEST *) buffer;
+	char *file = buffer + sizeof(WORKER_REQUEST);
+	char *next = file + strlen(file) + 1;
+	char *end = buffer + length;
+	int num_strings = 0, index = 0, status, pipeline_status;
+	OUTPUT_CACHE_FILL fill = {0};
+	for (char *p = next; p < end; p += strlen(p) + 1) {
+		num_strings++;
+	}
+	char *args[num_strings + 1];
+	CONVERSION conversions[request->num_stages + 1];
+	CONVERSION *path[request->num_stages + 1];
+	for (int i = 0; i < request->num_stages; i++) {
+		conversions[i].from = conversions[i].to = NULL;
+		conversions[i].cmd_and_args = &args[index];
+		path[i] = &conversions[i];
+		while (next < end && *next != '\0') {
+			args[index++] = next;
+			next += strlen(next) + 1;
+		}
+		args[index++] = NULL;
+		next++;
+	}
+	path[request->num_stages] = NULL;
+	pipeline_options = request->options;
+	if (request->num_stages == 0) {
+		status = print_no_conversion(file, printer_descriptor);
+	} else {
+		status = run_conversion_pipeline(file, printer_descriptor, path, NULL, usage, &fill);
+	}
+	close(printer_descriptor);
+	if ((pipeline_status = reap_children(usage, request->num_stages)) != 0) {
+		status = pipeline_status;
+	}
+	output_cache_finish(&fill, status == 0);
+	return status;
+}
+
+static int receive_request(int sock, char *buffer, int *printer_descriptor) {
+	struct msghdr message;
+	struct iovec iov;
+	struct cmsghdr *control;
+	char control_buffer[CMSG_SPACE(sizeof(int))];
+	ssize_t length;
+	memset(&message, 0, sizeof(message));
+	iov.iov_base = buffer;
+	iov.iov_len = WORKER_MESSAGE_MAX;
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control_buffer;
+	message.msg_controllen = sizeof(control_buffer);
+	if ((length = recvmsg(sock, &message, 0)) < (ssize_t) sizeof(WORKER_REQUEST)) {
+		return -1;
+	}
+	control = CMSG_FIRSTHDR(&message);
+	if (control == NULL || control->cmsg_type != SCM_RIGHTS) {
+		return -1;
+	}
+	memcpy(printer_descriptor, CMSG_DATA(control), sizeof(int));
+	return length;
+}
+
+static void worker_loop(int sock) {
+	char *buffer = malloc(WORKER_MESSAGE_MAX);
+	WORKER_RESULT result;
+	int length, printer_descriptor;
+	while ((length = receive_request(sock, buffer, &printer_descriptor)) != -1) {
+		result.job_id = ((WORKER_REQUEST *) buffer)->job_id;
+		result.num_stages = ((WORKER_REQUEST *) buffer)->num_stages;
+		result.status = run_request(buffer, length, printer_descriptor, result.stages);
+		length = offsetof(WORKER_RESULT, stages) + result.num_stages * sizeof(STAGE_USAGE);
+		if (write(sock, &result, length) != length) {
+			break;
+		}
+	}
+	free(buffer);
+}
+
+static void receive_result(int fd, void *data) {
+	WORKER *worker = data;
+	WORKER_RESULT result;
+	JOB *job;
+	ssize_t length = read(fd, &result, sizeof(result));
+	if (length < (ssize_t) offsetof(WORKER_RESULT, stages)) {
+		// The worker died; reap_jobs() deals with any job it was running.
+		stop_worker(worker);
+		return;
+	}
+	job = job_table_get(result.job_id);
+	if (job != NULL && job->stage_usage != NULL && result.num_stages == job->num_stages
+			&& length == offsetof(WORKER_RESULT, stages) + result.num_stages * sizeof(STAGE_USAGE)) {
+		memcpy(job->stage_usage, result.stages, result.num_stages * sizeof(STAGE_USAGE));
+	}
+	worker->job_id = -1;
+	worker->jobs_run++;
+	job_completed(result.job_id, worker->pid, result.status);
+	for (int i = pool_size; i < num_workers; i++) {
+		if (workers[i] == worker) {
+			stop_worker(worker);
+		}
+	}
+}
+
+static WORKER *start_worker(WORKER *worker) {
+	int socks[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) == -1) {
+		return NULL;
+	}
+	if ((worker->pid = fork()) == 0) {
+		setpgid(0, 0);
+		close(socks[0]);
+		worker_pool_close();
+		close_printer_connections();
+		journal_detach();
+		server_detach();
+		events_fini();
+		if (unblock_child_signals()) {
+			worker_loop(socks[1]);
+		}
+		_exit(0);
+	}
+	close(socks[1]);
+	if (worker->pid == -1) {
+		close(socks[0]);
+		return NULL;
+	}
+	setpgid(worker->pid, worker->pid);
+	worker->socket = socks[0];
+	worker->job_id = -1;
+	if ((worker->source = events_add(socks[0], receive_result, worker)) == NULL) {
+		stop_worker(worker);
+	}
+	return worker;
+}
+
+/*
+ * Returns an idle worker, starting a replacement for one that has died if the
+ * pool is not full.
+ */
+static WORKER *find_idle_worker() {
+	WORKER *dead = NULL;
+	for (int i = 0; i < pool_size && i < num_workers; i++) {
+		if (workers[i]->socket == -1) {
+			if (dead == NULL && workers[i]->pid == 0) dead = workers[i];
+		} else if (workers[i]->job_id == -1) {
+			return workers[i];
+		}
+	}
+	return dead != NULL ? start_worker(dead) : NULL;
+}
+
+void set_worker_pool_size(int size) {
+	if (size > num_workers) {
+		workers = realloc(workers, sizeof(WORKER *) * size);
+		for (int i = num_workers; i < size; i++) {
+			workers[i] = calloc(1, sizeof(WORKER));
+			workers[i]->socket = -1;
+		}
+		num_workers = size;
+	}
+	pool_size = size;
+	for (int i = 0; i < num_workers; i++) {
+		if (i >= pool_size && workers[i]->job_id == -1) {
+			stop_worker(workers[i]);
+		} else if (i < pool_size && workers[i]->socket == -1 && workers[i]->pid == 0) {
+			start_worker(workers[i]);
+		}
+	}
+}
+
+int worker_pool_size() {
+	return pool_size;
+}
+
+/*
+ * Hands the job to an idle worker.  Returns the worker's pid, which is also
+ * the process group running the job, or 0 if no worker could take it.
+ */
+int worker_pool_submit(JOB *job, int printer_descriptor) {
+	struct msghdr message;
+	struct iovec iov;
+	struct cmsghdr *control;
+	char control_buffer[CMSG_SPACE(sizeof(int))];
+	char *buffer;
+	int length;
+	WORKER *worker;
+	if (pool_size == 0 || (worker = find_idle_worker()) == NULL) {
+		return 0;
+	}
+	buffer = malloc(WORKER_MESSAGE_MAX);
+	if ((length = build_request(buffer, job)) == -1) {
+		free(buffer);
+		return 0;
+	}
+	memset(&message, 0, sizeof(message));
+	iov.iov_base = buffer;
+	iov.iov_len = length;
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control_buffer;
+	message.msg_controllen = sizeof(control_buffer);
+	control = CMSG_FIRSTHDR(&message);
+	control->cmsg_level = SOL_SOCKET;
+	control->cmsg_type = SCM_RIGHTS;
+	control->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(control), &printer_descriptor, sizeof(int));
+	length = sendmsg(worker->socket, &message, MSG_NOSIGNAL);
+	free(buffer);
+	if (length == -1) {
+		debug("Could not send job %d to worker %d", job->id, worker->pid);
+		return 0;
+	}
+	worker->job_id = job->id;
+	return worker->pid;
+}
+
+void worker_pool_reaped(int pid) {
+	for (int i = 0; i < num_workers; i++) {
+		if (workers[i]->pid == pid) {
+			stop_worker(workers[i]);
+			workers[i]->pid = 0;
+			workers[i]->job_id = -1;
+		}
+	}
+}
+
+/*
+ * Closes the pool's sockets in a forked child, so that workers still see end
+ * of file when imprimer exits.  The event sources are left alone, since the
+ * epoll instance is shared with the parent.
+ */
+void worker_pool_close() {
+	for (int i = 0; i < num_workers; i++) {
+		if (workers[i]->socket != -1) {
+			close(workers[i]->socket);
+			workers[i]->socket = -1;
+		}
+		workers[i]->source = NULL;
+	}
+}
+
+/*
+ * Closing the sockets is enough to make idle workers exit.
+ */
+void worker_pool_fini() {
+	for (int i = 0; i < num_workers; i++) {
+		stop_worker(workers[i]);
+		free(workers[i]);
+	}
+	free(workers);
+	workers = NULL;
+	num_workers = pool_size = 0;
+}
+
+void display_workers(FILE *out) {
+	WORKER *worker;
+	for (int i = 0; i < num_workers; i++) {
+		worker = workers[i];
+		if (worker->socket == -1 && i >= pool_size) continue;
+		fprintf(out, "WORKER: pid=%d, status=%s, job=%d, jobs_run=%d\n", worker->pid,
+			worker->socket == -1 ? "dead" : (worker->job_id == -1 ? "idle" : "busy"),
+			worker->job_id, worker->jobs_run);
+	}
+}
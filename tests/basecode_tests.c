@@ -73,9 +73,8 @@ Test(basecode_suite, conversion_test, .init = setup_test, .timeout=20) {
 
 // One file, one printer for the same type.
 Test(basecode_suite, print_test, .init = setup_test, .fini = stop_printers, .timeout=20) {
-    char *cmd = "rm -f spool/Alice*; bin/imprimer < test_scripts/print_test.imp -o test_output/print_test.out";
+    char *cmd = "rm -f spool/Alice*; (cat test_scripts/print_test.imp; echo 'wait all 15') | bin/imprimer -o test_output/print_test.out";
     int ret = system(cmd);
-    sleep(10); // Allow "printing" time to occur
     ret = system("ls spool | grep -q 'Alice_aaa_[0-9]*\\.[0-9]*'");
     cr_assert_eq(ret, 0, "There was no output from printer Alice");
     // Check that the correct data was "printed".
@@ -85,9 +84,8 @@ Test(basecode_suite, print_test, .init = setup_test, .fini = stop_printers, .tim
 
 // One printer, one file of a different type, one conversion.
 Test(basecode_suite, convert_test, .init = setup_test, .fini = stop_printers, .timeout=30) {
-    char *cmd = "rm -f spool/Bob*; bin/imprimer < test_scripts/convert_test.imp -o test_output/convert_test.out";
+    char *cmd = "rm -f spool/Bob*; (cat test_scripts/convert_test.imp; echo 'wait all 25') | bin/imprimer -o test_output/convert_test.out";
     int ret = system(cmd);
-    sleep(10); // Allow "printing" time to occur
     ret = system("ls spool | grep -q 'Bob_aaa_[0-9]*\\.[0-9]*'");
     cr_assert_eq(ret, 0, "There was no output from printer Bob");
     // Check that the correct data was "printed".
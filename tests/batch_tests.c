@@ -0,0 +1,29 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test_helper.h"
+
+static void setup_test(void) {
+    char name[64];
+    setup_test_output();
+    system("rm -rf test_output/batch_test; mkdir -p test_output/batch_test");
+    for (int i = 0; i < 3; i++) {
+        snprintf(name, sizeof(name), "test_output/batch_test/file%d.aaa", i);
+        write_test_file(name, "batch test\n");
+    }
+    write_test_file("test_output/batch_test/file3.zzz", "batch test\n");
+}
+
+Test(batch_suite, batch_test, .init = setup_test, .timeout = 20) {
+    run_script("batch_test", HEADER "print_batch test_output/batch_test/*.aaa\njobs\n");
+    cr_assert(output_contains("batch_test", "BATCH: files=3, submitted=3"), "The batch was not submitted");
+    cr_assert(output_contains("batch_test", "JOB: id=2, type=aaa"), "The last job is missing");
+}
+
+// One file of an unknown type fails the batch before any job is created.
+Test(batch_suite, invalid_file_test, .init = setup_test, .timeout = 20) {
+    run_script("batch_invalid_test", HEADER "print_batch test_output/batch_test/*\n");
+    cr_assert(output_contains("batch_invalid_test", "CMD_ERROR \\[Invalid file type\\]"), "The batch did not fail");
+    cr_assert(!output_contains("batch_invalid_test", "JOB_CREATED"), "Part of the batch was submitted");
+}
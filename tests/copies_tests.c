@@ -0,0 +1,27 @@
+#include <criterion/criterion.h>
+
+#include "test_helper.h"
+
+#define COPIES_HEADER HEADER "printer p2 bbb\nprinter p3 bbb\nconversion aaa bbb cat\nenable p1\nenable p2\nenable p3\n"
+
+static void setup_test(void) {
+    setup_test_output();
+    write_test_file("test_output/copies_test.aaa", "copies test\n");
+}
+
+// One job prints a copy on every listed printer, and on no other.
+Test(copies_suite, copies_to_test, .init = setup_test, .fini = stop_printers, .timeout = 30) {
+    run_script("copies_to_test", COPIES_HEADER "print --copies-to p1,p3 test_output/copies_test.aaa\nwait all 10\njobs\n");
+    cr_assert(output_contains("copies_to_test", "JOB_STARTED \\[0: p1,"), "No copy was sent to p1");
+    cr_assert(output_contains("copies_to_test", "JOB_STARTED \\[0: p3,"), "No copy was sent to p3");
+    cr_assert(!output_contains("copies_to_test", "JOB_STARTED \\[0: p2,"), "A copy was sent to an unlisted printer");
+    cr_assert(!output_contains("copies_to_test", "JOB_CREATED \\[1:"), "The copies were printed as separate jobs");
+    cr_assert(output_contains("copies_to_test", "JOB: id=0, type=aaa, status=finished, eligible=00000005,.* copies=2"),
+              "The job did not finish with both copies");
+}
+
+Test(copies_suite, unknown_printer_test, .init = setup_test, .fini = stop_printers, .timeout = 30) {
+    run_script("copies_unknown_test", COPIES_HEADER "print --copies-to p1,p9 test_output/copies_test.aaa\n");
+    cr_assert(output_contains("copies_unknown_test", "CMD_ERROR"), "An unknown printer was accepted");
+    cr_assert(!output_contains("copies_unknown_test", "JOB_CREATED"), "A job was created");
+}
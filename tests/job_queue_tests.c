@@ -0,0 +1,169 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "job_queue.h"
+
+static FILE_TYPE type_a = {"aaa", 0}, type_b = {"bbb", 1};
+static int refused_calls;
+
+static void set_option(char *option) {
+    char buffer[64];
+    strcpy(buffer, option);
+    cr_assert(set_queue_option(buffer), "Option %s was refused", option);
+}
+
+static void setup_queue(void) {
+    set_option("aging=60");
+    set_option("fairshare=off");
+    set_option("quantum=1");
+    refused_calls = 0;
+}
+
+static void teardown_queue(void) {
+    job_queue_fini();
+}
+
+static JOB *new_job(int id, FILE_TYPE *type, int priority, char *owner) {
+    JOB *job = calloc(1, sizeof(JOB));
+    job->id = id;
+    job->submission = id + 1;
+    job->type = type;
+    job->priority = priority;
+    job->owner = owner != NULL ? job_queue_owner(owner) : NULL;
+    bitset_set(&job->eligible, 0);
+    job_queue_push(job);
+    return job;
+}
+
+static int any_job(JOB *job) {
+    return 1;
+}
+
+static int only_type_a(JOB *job) {
+    if (job->type != &type_a) {
+        refused_calls++;
+        return 0;
+    }
+    return 1;
+}
+
+static int pop_id(int (*can_start)(JOB *job)) {
+    JOB *job = job_queue_pop_startable(can_start);
+    return job != NULL ? job->id : -1;
+}
+
+Test(job_queue_suite, strict_priority_test, .init = setup_queue, .fini = teardown_queue) {
+    set_option("aging=0");
+    new_job(0, &type_a, 1, NULL);
+    new_job(1, &type_a, 5, NULL);
+    new_job(2, &type_a, 1, NULL);
+    new_job(3, &type_a, 9, NULL);
+    int expected[] = {3, 1, 0, 2};
+    for (int i = 0; i < 4; i++) {
+        cr_assert_eq(pop_id(any_job), expected[i], "Job %d popped out of order", expected[i]);
+    }
+    cr_assert_eq(job_queue_pop_startable(any_job), NULL, "The queue should be empty");
+    cr_assert_eq(job_queue_size(), 0, "The queue size should be 0");
+}
+
+// A low priority job that has waited longer than its priority difference is
+// worth overtakes a newer high priority job.
+Test(job_queue_suite, aging_test, .init = setup_queue, .fini = teardown_queue) {
+    set_option("aging=0.001");
+    new_job(0, &type_a, 0, NULL);
+    usleep(50000);
+    new_job(1, &type_a, 9, NULL);
+    new_job(2, &type_a, 0, NULL);
+    cr_assert_eq(pop_id(any_job), 0, "The aged job should be first");
+    cr_assert_eq(pop_id(any_job), 1, "The high priority job should be second");
+    cr_assert_eq(pop_id(any_job), 2, "The newest job should be last");
+}
+
+// Changing the aging setting reorders the jobs already waiting, as if they
+// had been queued under it.
+Test(job_queue_suite, aging_change_test, .init = setup_queue, .fini = teardown_queue) {
+    set_option("aging=0.001");
+    new_job(0, &type_a, 0, NULL);
+    new_job(1, &type_a, 0, NULL);
+    usleep(50000);
+    new_job(2, &type_a, 5, NULL);
+    new_job(3, &type_a, 9, NULL);
+    set_option("aging=0");
+    int strict[] = {3, 2, 0, 1};
+    for (int i = 0; i < 4; i++) {
+        cr_assert_eq(pop_id(any_job), strict[i], "Job %d popped out of order", strict[i]);
+    }
+    new_job(4, &type_a, 0, NULL);
+    usleep(50000);
+    new_job(5, &type_a, 9, NULL);
+    set_option("aging=0.001");
+    cr_assert_eq(pop_id(any_job), 4, "The aged job should be first once aging is on");
+    cr_assert_eq(pop_id(any_job), 5, "The high priority job should be second");
+}
+
+// Jobs that cannot start are passed over, and their class is asked only once
+// per dispatch pass however many jobs it holds.
+Test(job_queue_suite, blocked_class_test, .init = setup_queue, .fini = teardown_queue) {
+    for (int i = 0; i < 100; i++) {
+        new_job(i, &type_b, 9, NULL);
+    }
+    new_job(100, &type_a, 0, NULL);
+    new_job(101, &type_a, 0, NULL);
+    cr_assert_eq(pop_id(only_type_a), 100, "The first startable job should be popped");
+    cr_assert_eq(pop_id(only_type_a), 101, "The second startable job should be popped");
+    cr_assert_eq(pop_id(only_type_a), -1, "No job should be startable");
+    cr_assert_eq(refused_calls, 1, "The blocked class was asked %d times", refused_calls);
+    job_queue_restore();
+    cr_assert_eq(job_queue_size(), 100, "The unstartable jobs should still be waiting");
+    cr_assert_eq(pop_id(any_job), 0, "A new pass should offer the class again");
+}
+
+Test(job_queue_suite, defer_restore_test, .init = setup_queue, .fini = teardown_queue) {
+    new_job(0, &type_a, 0, NULL);
+    new_job(1, &type_a, 0, NULL);
+    JOB *job = job_queue_pop_startable(any_job);
+    cr_assert_eq(job->id, 0, "Job 0 should be first");
+    job_queue_defer(job);
+    cr_assert_eq(pop_id(any_job), 1, "Job 1 should be next");
+    job_queue_restore();
+    cr_assert_eq(pop_id(any_job), 0, "The deferred job should keep its place");
+}
+
+Test(job_queue_suite, fairshare_test, .init = setup_queue, .fini = teardown_queue) {
+    set_option("fairshare=on");
+    new_job(0, &type_a, 0, "x");
+    new_job(1, &type_a, 0, "x");
+    new_job(2, &type_a, 0, "x");
+    new_job(3, &type_a, 0, "y");
+    int expected[] = {0, 3, 1, 2};
+    for (int i = 0; i < 4; i++) {
+        cr_assert_eq(pop_id(any_job), expected[i], "Job %d popped out of order", expected[i]);
+    }
+}
+
+// Once all of an owner's jobs have ended, earlier bursts no longer count
+// against it.
+Test(job_queue_suite, fairshare_reset_test, .init = setup_queue, .fini = teardown_queue) {
+    JOB *jobs[5];
+    set_option("fairshare=on");
+    for (int i = 0; i < 5; i++) {
+        jobs[i] = new_job(i, &type_a, 0, "x");
+    }
+    for (int i = 0; i < 5; i++) {
+        cr_assert_eq(pop_id(any_job), i, "Job %d popped out of order", i);
+        job_queue_job_ended(jobs[i]);
+    }
+    new_job(5, &type_a, 0, "y");
+    new_job(6, &type_a, 0, "x");
+    cr_assert_eq(pop_id(any_job), 5, "Job 5 should be first");
+    new_job(7, &type_a, 0, "x");
+    new_job(8, &type_a, 0, "y");
+    cr_assert_eq(pop_id(any_job), 6, "Owner x should not be penalized for its finished jobs");
+}
@@ -0,0 +1,65 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imprimer.h"
+#include "conversions.h"
+#include "bitset.h"
+#include "my_imprimer.h"
+#include "journal.h"
+#include "test_helper.h"
+
+#define JOURNAL "test_output/journal_test.jnl"
+#define JOURNAL_HEADER HEADER "conversion aaa bbb cat\njournal " JOURNAL "\n"
+#define REPLAY "journal " JOURNAL "\n"
+
+static void setup_test(void) {
+    setup_test_output();
+    system("rm -f " JOURNAL);
+    write_test_file("test_output/journal_test.aaa", "journal test\n");
+}
+
+static void append_record(FILE *file, int kind, char *payload, size_t length) {
+    JOURNAL_RECORD record;
+    memset(&record, 0, sizeof(record));
+    record.length = sizeof(record) + length;
+    record.kind = kind;
+    fwrite(&record, sizeof(record), 1, file);
+    fwrite(payload, 1, length, file);
+}
+
+// Jobs that had not finished are submitted again, with the definitions they
+// need, and stay in the journal until they finish.
+Test(journal_suite, restore_test, .init = setup_test, .fini = stop_printers, .timeout = 20) {
+    run_script("journal_write_test", JOURNAL_HEADER "print test_output/journal_test.aaa\nprint test_output/journal_test.aaa\n");
+    cr_assert(output_contains("journal_write_test", "JOURNAL: path=" JOURNAL ", replayed=0, restored=0"),
+              "The new journal was not opened");
+    run_script("journal_restore_test", REPLAY);
+    cr_assert(output_contains("journal_restore_test", "restored=2,"), "The unfinished jobs were not restored");
+    run_script("journal_restore_again_test", REPLAY);
+    cr_assert(output_contains("journal_restore_again_test", "restored=2,"), "The snapshot lost the restored jobs");
+}
+
+Test(journal_suite, finished_job_test, .init = setup_test, .fini = stop_printers, .timeout = 20) {
+    run_script("journal_finish_test", JOURNAL_HEADER "enable p1\nprint test_output/journal_test.aaa\nwait all 10\n");
+    cr_assert(output_contains("journal_finish_test", "JOB_STATUS \\[0: finished\\]"), "The job did not finish");
+    run_script("journal_finished_test", REPLAY);
+    cr_assert(output_contains("journal_finished_test", "restored=0,"), "A finished job was restored");
+}
+
+// Replay keeps what precedes a record whose string runs past its end, and
+// trusts nothing after it.
+Test(journal_suite, bad_record_test, .init = setup_test, .fini = stop_printers, .timeout = 20) {
+    FILE *file;
+    run_script("journal_good_test", JOURNAL_HEADER "print test_output/journal_test.aaa\n");
+    file = fopen(JOURNAL, "a");
+    append_record(file, JOURNAL_DEFINITION, "type ccc", 8);
+    append_record(file, JOURNAL_DEFINITION, "type zzz", 9);
+    fclose(file);
+    run_script("journal_bad_test", REPLAY);
+    cr_assert(output_contains("journal_bad_test", "restored=1,"), "The records before the bad one were not replayed");
+    cr_assert(!output_contains("journal_bad_test", "TYPE_DEFINED \\[ccc\\]"), "The bad record was replayed");
+    cr_assert(!output_contains("journal_bad_test", "TYPE_DEFINED \\[zzz\\]"), "A record after the bad one was replayed");
+}
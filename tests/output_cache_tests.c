@@ -0,0 +1,31 @@
+#include <criterion/criterion.h>
+#include <stdlib.h>
+
+#include "test_helper.h"
+
+#define CACHE "test_output/cache_test"
+#define CACHE_HEADER HEADER "conversion aaa bbb cat\nenable p1\n"
+
+static void setup_test(void) {
+    setup_test_output();
+    system("rm -rf " CACHE);
+    system("head -c 600 /dev/urandom | base64 > test_output/cache_test1.aaa");
+    system("head -c 600 /dev/urandom | base64 > test_output/cache_test2.aaa");
+}
+
+// Printing the same file again takes its converted output from the cache.
+Test(output_cache_suite, reprint_hit_test, .init = setup_test, .fini = stop_printers, .timeout = 30) {
+    run_script("cache_hit_test", CACHE_HEADER "cache " CACHE "\n"
+               "print test_output/cache_test1.aaa\nwait all 10\nprint test_output/cache_test1.aaa\nwait all 10\ncache\n");
+    cr_assert(output_contains("cache_hit_test", "JOB_STATUS \\[1: finished\\]"), "The reprint did not finish");
+    cr_assert(output_contains("cache_hit_test", "hits=1, partial_hits=0, misses=1, stored=1, evicted=0"),
+              "The reprint was not a cache hit");
+}
+
+// Storing an entry that takes the cache over its limit evicts the oldest.
+Test(output_cache_suite, eviction_test, .init = setup_test, .fini = stop_printers, .timeout = 30) {
+    run_script("cache_evict_test", CACHE_HEADER "cache " CACHE " 1k\n"
+               "print test_output/cache_test1.aaa\nwait all 10\nprint test_output/cache_test2.aaa\nwait all 10\ncache\n");
+    cr_assert(output_contains("cache_evict_test", "limit=1024, bytes=811,.* misses=2, stored=2, evicted=1"),
+              "The cache was not kept under its limit");
+}
@@ -0,0 +1,29 @@
+#include <criterion/criterion.h>
+#include <stdlib.h>
+
+#include "test_helper.h"
+
+#define PARALLEL_HEADER "type aaa\ntype bbb\ntype ccc\nprinter p1 ccc\nconversion aaa bbb sed s/1/one/g\nenable p1\n"
+#define PRINT "print test_output/parallel_test.aaa\nwait 0 30\n"
+
+static void setup_test(void) {
+    setup_test_output();
+    system("rm -f test_output/parallel_test_*.log");
+    // Several chunks of input, so that several instances run.
+    system("seq 1 400000 > test_output/parallel_test.aaa");
+}
+
+// What a replicated conversion writes matches, byte for byte, what one
+// instance of it writes.
+Test(parallel_suite, same_output_test, .init = setup_test, .fini = stop_printers, .timeout = 90) {
+    run_script("parallel_single_test", PARALLEL_HEADER "conversion bbb ccc tee test_output/parallel_test_single.log\n" PRINT);
+    cr_assert(output_contains("parallel_single_test", "WAIT: id=0, status=finished"), "The single stage job did not finish");
+    cr_assert_eq(system("[ -s test_output/parallel_test_single.log ]"), 0, "The single stage wrote nothing");
+    run_script("parallel_replicated_test", PARALLEL_HEADER "conversion bbb ccc tee test_output/parallel_test_replicated.log\n"
+               "parallel aaa bbb 4\n" PRINT "parallel\n");
+    cr_assert(output_contains("parallel_replicated_test", "PARALLEL: from=aaa, to=bbb, instances=4, records=lines"),
+              "The conversion was not replicated");
+    cr_assert(output_contains("parallel_replicated_test", "WAIT: id=0, status=finished"), "The replicated job did not finish");
+    cr_assert_eq(system("cmp -s test_output/parallel_test_single.log test_output/parallel_test_replicated.log"), 0,
+                 "The replicated stage changed the output");
+}
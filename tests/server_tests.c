@@ -0,0 +1,141 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define SOCKET_PATH "test_output/server_test.sock"
+
+static int server_pid;
+
+static void stop_server(void) {
+    if (server_pid > 0) {
+        kill(server_pid, SIGTERM);
+        waitpid(server_pid, NULL, 0);
+        server_pid = 0;
+    }
+    system("bash util/stop_printers.sh > /dev/null 2>&1");
+}
+
+static void setup_server(void) {
+    FILE *file;
+    int null_fd;
+    system("bash util/stop_printers.sh > /dev/null 2>&1");
+    system("mkdir -p spool test_output; rm -f " SOCKET_PATH);
+    file = fopen("test_output/server_test.aaa", "w");
+    fputs("server test\n", file);
+    fclose(file);
+    // The conversion is slow enough that the first job is still running when
+    // the second client submits.
+    file = fopen("test_output/server_test.imp", "w");
+    fputs("type aaa\ntype bbb\nprinter p1 bbb\nenable p1\nconversion aaa bbb sleep 2\n"
+          "listen " SOCKET_PATH "\n", file);
+    fclose(file);
+    if ((server_pid = fork()) == 0) {
+        null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, 0), dup2(null_fd, 1), dup2(null_fd, 2);
+        execl("bin/imprimer", "bin/imprimer", "-i", "test_output/server_test.imp", NULL);
+        _exit(1);
+    }
+}
+
+static int connect_client(void) {
+    struct sockaddr_un address;
+    int fd;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, SOCKET_PATH);
+    for (int i = 0; i < 500; i++) {
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+            return -1;
+        }
+        if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    return -1;
+}
+
+/*
+ * Reads the client's next OK or ERROR line into reply, skipping any other
+ * output of the command.
+ */
+static int read_reply(int fd, char *reply, size_t size) {
+    size_t length = 0;
+    char c;
+    while (read(fd, &c, 1) == 1) {
+        if (c != '\n') {
+            if (length < size - 1) reply[length++] = c;
+            continue;
+        }
+        reply[length] = '\0';
+        if (strncmp(reply, "OK", 2) == 0 || strncmp(reply, "ERROR", 5) == 0) {
+            return 1;
+        }
+        length = 0;
+    }
+    return 0;
+}
+
+static void send_line(int fd, char *line) {
+    cr_assert_eq(write(fd, line, strlen(line)), strlen(line), "Could not send %s", line);
+}
+
+Test(server_suite, submit_reply_test, .init = setup_server, .fini = stop_server, .timeout = 20) {
+    char reply[256];
+    int fd = connect_client();
+    cr_assert_neq(fd, -1, "Could not connect to the server");
+    send_line(fd, "print test_output/server_test.aaa\n");
+    cr_assert(read_reply(fd, reply, sizeof(reply)), "No reply");
+    cr_assert_str_eq(reply, "OK job=0", "Unexpected reply: %s", reply);
+    send_line(fd, "print no_such_type.zzz\n");
+    cr_assert(read_reply(fd, reply, sizeof(reply)), "No reply");
+    cr_assert_eq(strncmp(reply, "ERROR", 5), 0, "Unexpected reply: %s", reply);
+    close(fd);
+}
+
+// A client's wait runs other clients' commands while it waits; their outcomes
+// must not become the waiting client's reply.
+Test(server_suite, wait_with_other_client_test, .init = setup_server, .fini = stop_server, .timeout = 40) {
+    char reply[256];
+    int waiter = connect_client(), other = connect_client();
+    cr_assert(waiter != -1 && other != -1, "Could not connect to the server");
+    send_line(waiter, "print test_output/server_test.aaa\n");
+    cr_assert(read_reply(waiter, reply, sizeof(reply)), "No reply");
+    cr_assert_str_eq(reply, "OK job=0", "Unexpected reply: %s", reply);
+    send_line(waiter, "wait all 30\n");
+    usleep(200000);
+    send_line(other, "print test_output/server_test.aaa\n");
+    cr_assert(read_reply(other, reply, sizeof(reply)), "No reply");
+    cr_assert_str_eq(reply, "OK job=1", "Unexpected reply to the other client: %s", reply);
+    send_line(other, "print no_such_type.zzz\n");
+    cr_assert(read_reply(other, reply, sizeof(reply)), "No reply");
+    cr_assert_eq(strncmp(reply, "ERROR", 5), 0, "Unexpected reply to the other client: %s", reply);
+    cr_assert(read_reply(waiter, reply, sizeof(reply)), "No reply to wait");
+    cr_assert_str_eq(reply, "OK", "Unexpected reply to wait: %s", reply);
+    close(other);
+    close(waiter);
+}
+
+// A client that disconnects while another one waits is freed safely.
+Test(server_suite, disconnect_during_wait_test, .init = setup_server, .fini = stop_server, .timeout = 40) {
+    char reply[256];
+    int waiter = connect_client(), other = connect_client();
+    cr_assert(waiter != -1 && other != -1, "Could not connect to the server");
+    send_line(waiter, "print test_output/server_test.aaa\n");
+    cr_assert(read_reply(waiter, reply, sizeof(reply)), "No reply");
+    send_line(waiter, "wait all 30\n");
+    usleep(200000);
+    close(other);
+    cr_assert(read_reply(waiter, reply, sizeof(reply)), "No reply to wait");
+    cr_assert_str_eq(reply, "OK", "Unexpected reply to wait: %s", reply);
+    send_line(waiter, "jobs\n");
+    cr_assert(read_reply(waiter, reply, sizeof(reply)), "The server did not survive the disconnect");
+    close(waiter);
+}
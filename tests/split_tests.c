@@ -0,0 +1,33 @@
+#include <criterion/criterion.h>
+#include <stdlib.h>
+
+#include "test_helper.h"
+
+#define SPLIT_TMPDIR "test_output/split_test_tmp"
+#define SPLIT_HEADER HEADER "conversion aaa bbb tee -a test_output/split_test.log\nenable p1\n"
+
+static void setup_test(void) {
+    setup_test_output();
+    system("rm -rf " SPLIT_TMPDIR " test_output/split_test.log; mkdir -p " SPLIT_TMPDIR);
+    system("seq 1 1000 > test_output/split_test.aaa");
+    setenv("TMPDIR", SPLIT_TMPDIR, 1);
+}
+
+// The chunks are printed in order, so what reaches the printer is the whole
+// file, and the split job finishes with the last of them.
+Test(split_suite, chunk_order_test, .init = setup_test, .fini = stop_printers, .timeout = 60) {
+    run_script("split_order_test", SPLIT_HEADER "split aaa 1k\nprint test_output/split_test.aaa\nwait 0 50\n");
+    cr_assert(output_contains("split_order_test", "JOB_CREATED \\[4:"), "The file was not split into chunks");
+    cr_assert(output_contains("split_order_test", "WAIT: id=0, status=finished"), "The split job did not finish");
+    cr_assert_eq(system("cmp -s test_output/split_test.aaa test_output/split_test.log"), 0,
+                 "The chunks were not printed in order");
+}
+
+// The chunks and the directory that held them are removed once the split job
+// has ended.
+Test(split_suite, temp_dir_removed_test, .init = setup_test, .fini = stop_printers, .timeout = 60) {
+    run_script("split_cleanup_test", SPLIT_HEADER "split aaa 1k\nprint test_output/split_test.aaa\nwait 0 50\n");
+    cr_assert(output_contains("split_cleanup_test", "JOB_CREATED \\[1:"), "The file was not split into chunks");
+    cr_assert(output_contains("split_cleanup_test", "WAIT: id=0, status=finished"), "The split job did not finish");
+    cr_assert_eq(system("[ -z \"$(ls -A " SPLIT_TMPDIR ")\" ]"), 0, "The split directory was left behind");
+}
@@ -0,0 +1,28 @@
+#include <criterion/criterion.h>
+
+#include "test_helper.h"
+
+#define USAGE_HEADER HEADER "type ccc\nprinter p2 ccc\nconversion aaa bbb cat\nconversion bbb ccc tr a-z A-Z\nenable p2\n"
+
+static void setup_test(void) {
+    setup_test_output();
+    write_test_file("test_output/stage_usage_test.aaa", "usage test\n");
+}
+
+// Once a job has finished, jobs shows the resource usage of each of its
+// stages, in pipeline order.
+Test(stage_usage_suite, jobs_usage_test, .init = setup_test, .fini = stop_printers, .timeout = 30) {
+    run_script("stage_usage_test", USAGE_HEADER "print test_output/stage_usage_test.aaa\nwait all 10\njobs\n");
+    cr_assert(output_contains("stage_usage_test", "JOB: id=0, type=aaa, status=finished,.*, usage=\\["
+                              "cat:wall=[0-9.]*,cpu=[0-9.]*,rss=[1-9][0-9]*,read=[0-9]*,written=11 "
+                              "tr:wall=[0-9.]*,cpu=[0-9.]*,rss=[1-9][0-9]*,read=[0-9]*,written=11\\]"),
+              "The usage of the stages was not shown");
+}
+
+// A job that has not run has no stages to show.
+Test(stage_usage_suite, unstarted_usage_test, .init = setup_test, .fini = stop_printers, .timeout = 30) {
+    run_script("stage_unstarted_test", HEADER "type ccc\nprinter p2 ccc\nconversion aaa bbb cat\n"
+               "conversion bbb ccc tr a-z A-Z\nprint test_output/stage_usage_test.aaa\njobs\n");
+    cr_assert(output_contains("stage_unstarted_test", "JOB: id=0, type=aaa, status=created"), "The job is missing");
+    cr_assert(!output_contains("stage_unstarted_test", "cat:wall="), "Usage was shown for stages that never ran");
+}
@@ -0,0 +1,34 @@
+#include <criterion/criterion.h>
+
+#include "test_helper.h"
+
+static void setup_test(void) {
+    setup_test_output();
+    write_test_file("test_output/stats_test.aaa", "stats test\n");
+}
+
+Test(stats_suite, finished_jobs_test, .init = setup_test, .fini = stop_printers, .timeout = 30) {
+    run_script("stats_finished_test", HEADER "conversion aaa bbb cat\nenable p1\n"
+               "print test_output/stats_test.aaa\nprint test_output/stats_test.aaa\nwait all 10\nstats\n");
+    cr_assert(output_contains("stats_finished_test",
+                              "STATS: uptime=[0-9.]*, submitted=2, started=2, finished=2, aborted=0, connect_failures=0"),
+              "The job counters are wrong");
+    cr_assert(output_contains("stats_finished_test", "LATENCY: name=queue_wait, count=2, avg=[0-9.]*, p50="),
+              "The queue wait latency is missing");
+    cr_assert(output_contains("stats_finished_test", "LATENCY: name=job_run, count=2,"), "The run latency is missing");
+    cr_assert(output_contains("stats_finished_test", "STAGE: program=cat, count=2,.*, written=22, failures=0"),
+              "The stage statistics are wrong");
+    cr_assert(output_contains("stats_finished_test", "UTILIZATION: printer=p1, status=idle, jobs=2,"),
+              "The printer utilization is wrong");
+}
+
+// A stage that runs and exits nonzero is a failure of its program, not one of
+// the stages that could not be spawned.
+Test(stats_suite, failed_stage_test, .init = setup_test, .fini = stop_printers, .timeout = 30) {
+    run_script("stats_failed_test", HEADER "conversion aaa bbb false\nenable p1\n"
+               "print test_output/stats_test.aaa\nwait all 10\nstats\n");
+    cr_assert(output_contains("stats_failed_test", "finished=0, aborted=1,.*, stage_failures=0"),
+              "The aborted job was not counted");
+    cr_assert(output_contains("stats_failed_test", "STAGE: program=false, count=1,.*, failures=1"),
+              "The failed program was not counted");
+}
@@ -0,0 +1,47 @@
+#include <criterion/criterion.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "test_helper.h"
+
+void stop_printers(void) {
+    system("bash util/stop_printers.sh > /dev/null 2>&1");
+}
+
+/*
+ * Stops printers left over from an earlier test, and makes the directories
+ * the tests write to.
+ */
+void setup_test_output(void) {
+    stop_printers();
+    system("mkdir -p spool test_output");
+}
+
+void write_test_file(char *path, char *contents) {
+    FILE *file = fopen(path, "w");
+    cr_assert_not_null(file, "Could not create %s", path);
+    fputs(contents, file);
+    fclose(file);
+}
+
+void run_script(char *name, char *script) {
+    char command[512];
+    int ret;
+    snprintf(command, sizeof(command), "test_output/%s.imp", name);
+    write_test_file(command, script);
+    snprintf(command, sizeof(command), "bin/imprimer -i test_output/%s.imp -o test_output/%s.out"
+             " < /dev/null > test_output/%s.err 2>&1", name, name, name);
+    ret = system(command);
+    cr_assert_eq(ret, 0, "Program did not exit normally (status 0x%x)", ret);
+}
+
+/*
+ * Returns whether the command output or events of a script run contain the
+ * given text, which is a grep pattern.
+ */
+int output_contains(char *name, char *expected) {
+    char command[512];
+    snprintf(command, sizeof(command), "cat test_output/%s.out test_output/%s.err | grep -q '%s'",
+             name, name, expected);
+    return system(command) == 0;
+}
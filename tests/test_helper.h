@@ -0,0 +1,18 @@
+#ifndef TEST_HELPER_H
+#define TEST_HELPER_H
+
+/*
+ * Helpers shared by the tests that drive bin/imprimer with a script.  Each
+ * script run saves its command output in test_output/<name>.out and its
+ * events in test_output/<name>.err.
+ */
+
+#define HEADER "type aaa\ntype bbb\nprinter p1 bbb\n"
+
+void stop_printers(void);
+void setup_test_output(void);
+void write_test_file(char *path, char *contents);
+void run_script(char *name, char *script);
+int output_contains(char *name, char *expected);
+
+#endif
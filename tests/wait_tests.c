@@ -0,0 +1,37 @@
+#include <criterion/criterion.h>
+
+#include "test_helper.h"
+
+static void setup_test(void) {
+    setup_test_output();
+    write_test_file("test_output/wait_test.aaa", "wait test\n");
+}
+
+Test(wait_suite, wait_finished_test, .init = setup_test, .fini = stop_printers, .timeout = 20) {
+    run_script("wait_finished_test", HEADER "enable p1\nconversion aaa bbb sleep 1\nprint test_output/wait_test.aaa\nwait 0 10\n");
+    cr_assert(output_contains("wait_finished_test", "WAIT: id=0, status=finished"), "The wait did not report the finished job");
+}
+
+Test(wait_suite, wait_aborted_test, .init = setup_test, .fini = stop_printers, .timeout = 20) {
+    run_script("wait_aborted_test", HEADER "enable p1\nconversion aaa bbb false\nprint test_output/wait_test.aaa\nwait 0 10\n");
+    cr_assert(output_contains("wait_aborted_test", "WAIT: id=0, status=aborted"), "The wait did not report the aborted job");
+}
+
+Test(wait_suite, wait_timeout_test, .init = setup_test, .fini = stop_printers, .timeout = 20) {
+    run_script("wait_timeout_test", HEADER "enable p1\nconversion aaa bbb sleep 3\nprint test_output/wait_test.aaa\nwait all 0.5\n");
+    cr_assert(output_contains("wait_timeout_test", "CMD_ERROR \\[Timed out\\]"), "The wait did not time out");
+}
+
+// With its only printer disabled the job can never run, so the wait fails
+// at once rather than blocking.
+Test(wait_suite, wait_cannot_run_test, .init = setup_test, .fini = stop_printers, .timeout = 20) {
+    run_script("wait_cannot_run_test", HEADER "conversion aaa bbb sleep 1\nprint test_output/wait_test.aaa\nwait all\n");
+    cr_assert(output_contains("wait_cannot_run_test", "CMD_ERROR \\[Waiting for jobs that cannot run\\]"), "The wait did not fail");
+}
+
+Test(wait_suite, wait_invalid_args_test, .init = setup_test, .fini = stop_printers, .timeout = 20) {
+    run_script("wait_invalid_id_test", HEADER "wait 7\n");
+    cr_assert(output_contains("wait_invalid_id_test", "CMD_ERROR \\[Invalid job id\\]"), "An unknown job id was accepted");
+    run_script("wait_invalid_timeout_test", HEADER "wait all -1\n");
+    cr_assert(output_contains("wait_invalid_timeout_test", "CMD_ERROR \\[Invalid timeout\\]"), "A negative timeout was accepted");
+}